@@ -0,0 +1,11 @@
+let zstd ~size data = Zstd.decompress size data
+
+let lz4 ~size data =
+  LZ4.Bytes.decompress ~length:size (Bytes.of_string data) |>
+  Bytes.to_string
+
+let init () =
+  Frame_reader.register_codec 1 zstd;
+  Frame_reader.register_codec 2 lz4
+
+let () = init ()
@@ -0,0 +1,7 @@
+(** The zstd and lz4 block codecs of version 4 and 5 traces. They
+    are registered with {!Frame_reader.register_codec} as soon as this
+    module is linked. *)
+
+(** [init ()] registers the codecs again. Calling it makes sure that
+    the module is linked. *)
+val init : unit -> unit
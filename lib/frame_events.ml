@@ -29,12 +29,24 @@ module EF : sig
     Frame.bit_length ->
     Frame.binary -> Trace.event
 
+  val register_read_var :
+    arch option -> var -> Frame.bit_length -> Frame.binary -> Trace.event
+
+  val register_write_var :
+    arch option -> var -> Frame.bit_length -> Frame.binary -> Trace.event
+
   (* val timestamp : int64 -> Trace.event *)
 
+  val addr_of_address : arch option -> Frame.address -> addr
+
   val pc_update : arch option -> Frame.address -> Trace.event
 
+  val pc_update_addr : addr -> Trace.event
+
   val code_exec : arch option -> Frame.address -> Frame.binary -> Trace.event
 
+  val code_exec_addr : addr -> Frame.binary -> Trace.event
+
   val context_switch : Frame.thread_id -> Trace.event
 
   val syscall : number:Frame.uint64 -> Frame.argument_list -> Trace.event
@@ -77,23 +89,32 @@ end = struct
   let memory_store arch mo width value =
     memory_operation arch memory_store mo width value
 
-  let register_operation arch tag ro width value =
-    move arch tag (Var.create ro.Frame.Reg_operand.name @@ Type.imm width)
-      width value
+  let register_var ro width =
+    Var.create ro.Frame.Reg_operand.name @@ Type.imm width
+
+  let register_read_var arch var width value =
+    move arch register_read var width value
+
+  let register_write_var arch var width value =
+    move arch register_write var width value
 
   let register_read arch ro width value =
-    register_operation arch register_read ro width value
+    register_read_var arch (register_var ro width) width value
 
   let register_write arch ro width value =
-    register_operation arch register_write ro width value
+    register_write_var arch (register_var ro width) width value
 
-  let pc_update arch address =
-    Value.create pc_update (addr_of_address arch address)
+  let pc_update_addr addr = Value.create pc_update addr
 
-  let code_exec arch address data =
-    Chunk.Fields.create ~addr:(addr_of_address arch address) ~data |>
+  let pc_update arch address = pc_update_addr (addr_of_address arch address)
+
+  let code_exec_addr addr data =
+    Chunk.Fields.create ~addr ~data |>
     Value.create code_exec
 
+  let code_exec arch address data =
+    code_exec_addr (addr_of_address arch address) data
+
   let context_switch id =
     Value.create context_switch @@ Int64.to_int_exn id
 
@@ -196,3 +217,56 @@ let of_frame ~context ?arch = function
   | `modload_frame frm -> of_modload_frame arch frm
   | `key_frame frm -> []
   | `meta_frame _ -> []
+
+(** An event generator keeps the variable of every register, by name
+    and width, and the address of every instruction it has seen, so
+    that frames replaying the same code share them, and passes events
+    to a callback instead of building lists. *)
+type t = {
+  arch : arch option;
+  context : Frame.thread_id -> bool;
+  vars : (string * int, var) Hashtbl.t;
+  code : addr Int64.Table.t;
+}
+
+let create ~context ?arch () = {
+  arch; context;
+  vars = Hashtbl.Poly.create ();
+  code = Int64.Table.create ();
+}
+
+(** A register that frames read or write at several widths gets a
+    variable for each width. *)
+let var t name width =
+  Hashtbl.find_or_add t.vars (name, width)
+    ~default:(fun () -> Var.create name (Type.imm width))
+
+let code_addr t address =
+  Hashtbl.find_or_add t.code address
+    ~default:(fun () -> EF.addr_of_address t.arch address)
+
+let iter_operand t ~f oi =
+  let open Frame.Operand_info in
+  let {Frame.Operand_usage.read; written; _} = oi.operand_usage in
+  match oi.operand_info_specific with
+  | `mem_operand mo ->
+    if read then f (EF.memory_load t.arch mo oi.bit_length oi.value);
+    if written then f (EF.memory_store t.arch mo oi.bit_length oi.value)
+  | `reg_operand ro ->
+    let var = var t ro.Frame.Reg_operand.name oi.bit_length in
+    if read then f (EF.register_read_var t.arch var oi.bit_length oi.value);
+    if written then f (EF.register_write_var t.arch var oi.bit_length oi.value)
+
+let iter_std_frame t ~f frm =
+  let open Frame.Std_frame in
+  let addr = code_addr t frm.address in
+  f (EF.pc_update_addr addr);
+  if t.context frm.thread_id then f (EF.context_switch frm.thread_id);
+  Option.iter frm.mode ~f:(fun mode -> f (EF.mode mode));
+  f (EF.code_exec_addr addr frm.rawbytes);
+  List.iter frm.operand_pre_list ~f:(iter_operand t ~f);
+  Option.iter frm.operand_post_list ~f:(List.iter ~f:(iter_operand t ~f))
+
+let iter t frame ~f = match frame with
+  | `std_frame frm -> iter_std_frame t ~f frm
+  | frame -> List.iter (of_frame ~context:t.context ?arch:t.arch frame) ~f
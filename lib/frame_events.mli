@@ -10,3 +10,18 @@ val of_frame :
   context:(Frame.thread_id -> bool) ->
   ?arch:arch ->
   Frame.frame -> Trace.event list
+
+(** Generator of the events of a sequence of frames, that creates the
+    variable of each register and the address of each instruction
+    only once. *)
+type t
+
+(** [create ~context ?arch ()] creates a generator, with [context] as
+    in [of_frame]. *)
+val create :
+  context:(Frame.thread_id -> bool) ->
+  ?arch:arch -> unit -> t
+
+(** [iter t frame ~f] applies [f] to the events of [frame], in the
+    order of [of_frame], without building a list of them. *)
+val iter : t -> Frame.frame -> f:(Trace.event -> unit) -> unit
@@ -37,21 +37,15 @@ type header = {
 type frame = Frame.frame
 
 
+(** Reads the frames of one trace version from the input. [skip]
+    passes over a frame without parsing it if it can, and [reset]
+    drops any state tied to the input position, before a seek. *)
 type chan = {
-  close : unit -> unit;
   read  : unit -> frame;
+  skip  : unit -> unit;
+  reset : unit -> unit;
 }
 
-type reader = {
-  header : header;
-  meta : dict;
-  chan : chan;
-  frames : unit -> frame option;
-}
-
-type t = reader
-
-
 (** Map BFD architecture specification to BAP architecture.
 
     Note: it looks like that having BFD Arch and Machine
@@ -130,12 +124,61 @@ let header buf = {
   toc_off  = field toc      int64    buf;
 }
 
-let read_header ic =
-  let len = header_size in
-  let buf = Bytes.create len in
-  match In_channel.really_input ic ~buf ~pos:0 ~len with
-  | None -> parse_error "malformed header"
-  | Some () -> header buf
+(** The trace file, mapped into memory. Frames are read straight from
+    the mapping, without copying them through a channel buffer, and
+    moving [pos] is all it takes to seek. *)
+module Input = struct
+  type t = {
+    data : Bigstring.t;
+    mutable pos : int;
+  }
+
+  let map path =
+    let fd = Unix.openfile path [Unix.O_RDONLY] 0 in
+    Exn.protect ~finally:(fun () -> Unix.close fd) ~f:(fun () ->
+        if (Unix.fstat fd).Unix.st_size < header_size
+        then parse_error "malformed header";
+        let data =
+          Unix.map_file fd
+            Caml.Bigarray.char Caml.Bigarray.c_layout false [|-1|] |>
+          Caml.Bigarray.array1_of_genarray in
+        {data; pos = 0})
+
+  let length t = Bigstring.length t.data
+
+  let check t ~pos len =
+    if len < 0 || pos < 0 || pos > length t - len then raise End_of_file
+
+  (** The little-endian number at [pos]. *)
+  let int t ~pos =
+    check t ~pos field_size;
+    let rec loop i acc =
+      if i < 0 then acc
+      else
+        let c = Caml.Bigarray.Array1.unsafe_get t.data (pos + i) in
+        let b = Int64.of_int (Char.to_int c) in
+        loop (i - 1) Int64.(shift_left acc 8 lor b) in
+    Int64.to_int_exn (loop (field_size - 1) 0L)
+
+  let next_int t =
+    let n = int t ~pos:t.pos in
+    t.pos <- t.pos + field_size;
+    n
+
+  (** The next [len] bytes, copied into a string. *)
+  let string t len =
+    check t ~pos:t.pos len;
+    let s = Bigstring.to_string t.data ~pos:t.pos ~len in
+    t.pos <- t.pos + len;
+    s
+
+  let skip t len =
+    check t ~pos:t.pos len;
+    t.pos <- t.pos + len
+end
+
+let read_header input =
+  Input.string input header_size |> Bytes.of_string |> header
 
 let tracer {Frame.Tracer.name; args; envp; version} = Tracer.{
     name; version;
@@ -169,57 +212,357 @@ let meta_fields meta = Frame.Meta_frame.[
 let meta_frame init frame =
   meta_fields frame |> List.fold ~init ~f:(fun d f -> f d)
 
-let read_size =
-  let len = field_size in
-  let buf = Bytes.create len in
-  fun ch ->
-    Caml.really_input ch buf 0 len;
-    int ~buf ~pos:0
-
-let read_piqi parse ch =
-  let len = read_size ch in
-  Caml.really_input_string ch len |>
+(** Piqirun only parses strings, so each frame is copied out of the
+    mapping, and nothing else. *)
+let read_piqi parse input =
+  let len = Input.next_int input in
+  Input.string input len |>
   Piqirun.init_from_string |>
   parse
 
-let read_frames input = fun () ->
-  try
-    Some (input.read ())
-  with
-    Piqirun.IBuf.End_of_buffer | End_of_file ->
-    input.close ();
-    None
+let skip_piqi input =
+  Input.skip input (Input.next_int input)
+
+(** Decompressors of block codecs, by codec number. None are built
+    in, bap-frames.codecs registers zstd and lz4. *)
+let codecs : (int, (size:int -> string -> string)) Hashtbl.t =
+  Hashtbl.Poly.create ()
+
+let register_codec codec decompress =
+  Hashtbl.set codecs ~key:codec ~data:decompress
+
+(** Since version 4 frames are stored in blocks, each holding the
+    frames of one TOC entry, optionally compressed. A block starts
+    with a header of four fields: codec, number of frames, size of the
+    contents, and size of the contents as stored. *)
+module Block = struct
+  type t = {
+    mutable data : string;
+    mutable pos : int;
+    (** The frames of an uncompressed block are left in the input, up
+        to [stop], and [data] stays empty. *)
+    mutable stop : int;
+  }
+
+  let first_version = 4
+  let header_size = 4 * field_size
+
+  let create () = {data = ""; pos = 0; stop = 0}
+
+  let decompress codec ~size data =
+    if codec = 0 then data
+    else match Hashtbl.find codecs codec with
+      | Some decompress -> decompress ~size data
+      | None -> parse_error "unsupported codec %d" codec
+
+  (** Read the next block into [data], decompressed. *)
+  let load t input =
+    let codec = Input.next_int input in
+    let _frames = Input.next_int input in
+    let size = Input.next_int input in
+    let stored = Input.next_int input in
+    t.data <- decompress codec ~size (Input.string input stored);
+    t.pos <- 0
+
+  (** Forget the current block, so that the next frame comes from the
+      block at the input position. *)
+  let reset t =
+    t.data <- "";
+    t.pos <- 0;
+    t.stop <- 0
+
+  let in_data t = t.pos < String.length t.data
+
+  (** Move to the next block once the frames of the current one are
+      used up. An uncompressed block is not copied, its frames are
+      read from the input one at a time. *)
+  let rec next t input =
+    if not (in_data t) && input.Input.pos >= t.stop then begin
+      if Input.int input ~pos:input.Input.pos = 0 then begin
+        let stored = Input.int input ~pos:(input.Input.pos + 3 * field_size) in
+        Input.skip input header_size;
+        Input.check input ~pos:input.Input.pos stored;
+        t.data <- "";
+        t.pos <- 0;
+        t.stop <- input.Input.pos + stored
+      end else load t input;
+      next t input
+    end
+
+  (** The position and length of the next frame of [data]. *)
+  let next_frame t =
+    let len = int ~buf:(Bytes.unsafe_of_string t.data) ~pos:t.pos in
+    let pos = t.pos + field_size in
+    if len <= 0 || pos + len > String.length t.data
+    then parse_error "malformed frame in block";
+    t.pos <- pos + len;
+    pos, len
+
+  (** Check that the next frame of the input is within the block. *)
+  let check_input t input =
+    let len = Input.int input ~pos:input.Input.pos in
+    if len <= 0 || input.Input.pos + field_size + len > t.stop
+    then parse_error "malformed frame in block"
+
+  (** A frame of a compressed block is copied once more, out of the
+      decompressed block, since piqirun only parses whole strings. *)
+  let read_piqi t parse input =
+    next t input;
+    if in_data t then begin
+      let pos, len = next_frame t in
+      String.sub t.data ~pos ~len |>
+      Piqirun.init_from_string |>
+      parse
+    end else begin
+      check_input t input;
+      read_piqi parse input
+    end
+
+  let skip t input =
+    next t input;
+    if in_data t then ignore (next_frame t : int * int)
+    else begin
+      check_input t input;
+      skip_piqi input
+    end
+end
 
-let read_meta header ch =
+(** Since version 5 the frames of a block are encoded against each
+    other: standard frames refer to the instruction bytes and strings
+    that the block has already used, and store their addresses as the
+    difference to the previous ones. See trace.encoding.hpp in libtrace
+    for the layout. Standard frames are decoded straight into their
+    records, other frames are stored serialized. *)
+module Encoded = struct
+  type t = {
+    block : Block.t;
+    instructions : (int, string) Hashtbl.t;
+    strings : (int, string) Hashtbl.t;
+    mutable address : int64;
+    mutable mem_address : int64;
+  }
+
+  let first_version = 5
+
+  (* The frame types and flags of trace.encoding.hpp, without their
+     encoded_ prefix. *)
+  let frame_plain = 0
+  let frame_std = 1
+
+  let std_post_list = 1 lsl 0
+  let std_mode = 1 lsl 1
+
+  let operand_mem = 1 lsl 0
+  let operand_read = 1 lsl 1
+  let operand_written = 1 lsl 2
+  let operand_index = 1 lsl 3
+  let operand_base = 1 lsl 4
+  let operand_has_taint_id = 1 lsl 7
+  let operand_has_taint_multiple = 1 lsl 8
+
+  let create () = {
+    block = Block.create ();
+    instructions = Hashtbl.Poly.create ();
+    strings = Hashtbl.Poly.create ();
+    address = 0L;
+    mem_address = 0L;
+  }
+
+  let byte t =
+    let b = t.block in
+    if b.Block.pos >= String.length b.Block.data
+    then parse_error "truncated encoded frame";
+    b.Block.pos <- b.Block.pos + 1;
+    Char.to_int b.Block.data.[b.Block.pos - 1]
+
+  let varint t =
+    let rec loop shift acc =
+      if shift >= 64 then parse_error "malformed number in encoded frame";
+      let b = byte t in
+      let low = Int64.of_int (b land 0x7f) in
+      let acc = Int64.(acc lor shift_left low shift) in
+      if b land 0x80 = 0 then acc else loop (shift + 7) acc in
+    loop 0 0L
+
+  let int t = Int64.to_int_exn (varint t)
+
+  let signed t =
+    let z = varint t in
+    Int64.(shift_right_logical z 1 lxor neg (z land 1L))
+
+  let bytes t len =
+    let b = t.block in
+    if len < 0 || b.Block.pos + len > String.length b.Block.data
+    then parse_error "truncated encoded frame";
+    b.Block.pos <- b.Block.pos + len;
+    String.sub b.Block.data ~pos:(b.Block.pos - len) ~len
+
+  (** A dictionary number, that defines a new entry if it is the next
+      one. *)
+  let entry t dict =
+    let n = int t in
+    if n = Hashtbl.length dict
+    then Hashtbl.set dict ~key:n ~data:(bytes t (int t));
+    match Hashtbl.find dict n with
+    | Some s -> s
+    | None -> parse_error "undefined dictionary entry %d" n
+
+  let has flags bit = flags land bit <> 0
+
+  let operand t =
+    let flags = int t in
+    let operand_info_specific =
+      if has flags operand_mem then begin
+        let address = Int64.(t.mem_address + signed t) in
+        t.mem_address <- address;
+        `mem_operand {Frame.Mem_operand.address}
+      end else `reg_operand {Frame.Reg_operand.name = entry t t.strings} in
+    let bit_length = Int64.to_int_exn (signed t) in
+    let taint_info =
+      if has flags operand_has_taint_id then `taint_id (varint t)
+      else if has flags operand_has_taint_multiple then `taint_multiple
+      else `no_taint in
+    let value = bytes t (int t) in
+    let operand_usage = {
+      Frame.Operand_usage.read = has flags operand_read;
+      written = has flags operand_written;
+      index = has flags operand_index;
+      base = has flags operand_base;
+    } in
+    {Frame.Operand_info.operand_info_specific;
+     bit_length; operand_usage; taint_info; value}
+
+  let operands t = List.init (int t) ~f:(fun _ -> operand t)
+
+  let std_frame t =
+    let address = Int64.(t.address + signed t) in
+    t.address <- address;
+    let thread_id = varint t in
+    let rawbytes = entry t t.instructions in
+    let flags = int t in
+    let mode =
+      if has flags std_mode then Some (entry t t.strings) else None in
+    let operand_pre_list = operands t in
+    let operand_post_list =
+      if has flags std_post_list then Some (operands t) else None in
+    {Frame.Std_frame.address; thread_id; rawbytes;
+     operand_pre_list; operand_post_list; mode}
+
+  let reset t = Block.reset t.block
+
+  let read t input =
+    if t.block.Block.pos >= String.length t.block.Block.data then begin
+      Block.load t.block input;
+      Hashtbl.clear t.instructions;
+      Hashtbl.clear t.strings;
+      t.address <- 0L;
+      t.mem_address <- 0L;
+    end;
+    let encoding = byte t in
+    if encoding = frame_plain then
+      bytes t (int t) |>
+      Piqirun.init_from_string |>
+      Frame_piqi.parse_frame
+    else if encoding = frame_std then `std_frame (std_frame t)
+    else parse_error "unknown frame encoding %d" encoding
+end
+
+type reader = {
+  header : header;
+  meta : dict;
+  input : Input.t;
+  chan : chan;
+  first_frame : int;
+  frames_per_toc_entry : int;
+  mutable frame : int;
+}
+
+type t = reader
+
+let read_meta header input =
   let dict = match Arch.of_bfd header.bfd_arch header.bfd_mach with
     | None -> Dict.empty
     | Some arch -> Dict.set Dict.empty Meta.arch arch in
   if header.version = 1 then dict
-  else meta_frame dict @@ read_piqi Frame_piqi.parse_meta_frame ch
+  else meta_frame dict @@ read_piqi Frame_piqi.parse_meta_frame input
+
+let chan header input =
+  if header.version < Block.first_version
+  then {
+    read = (fun () -> read_piqi Frame_piqi.parse_frame input);
+    skip = (fun () -> skip_piqi input);
+    reset = ignore;
+  }
+  else if header.version < Encoded.first_version
+  then
+    let block = Block.create () in {
+      read = (fun () -> Block.read_piqi block Frame_piqi.parse_frame input);
+      skip = (fun () -> Block.skip block input);
+      reset = (fun () -> Block.reset block);
+    }
+  else
+    (* Encoded frames depend on the frames before them in their
+       block, so they can not be skipped without decoding them. *)
+    let encoded = Encoded.create () in {
+      read = (fun () -> Encoded.read encoded input);
+      skip = (fun () -> ignore (Encoded.read encoded input : frame));
+      reset = (fun () -> Encoded.reset encoded);
+    }
+
+(** A trace has a TOC once its writer has finished it. The TOC starts
+    with the number of frames per entry. *)
+let finished t = Int64.(t.header.toc_off <> 0L)
+
+let toc_off t = Int64.to_int_exn t.header.toc_off
 
 let create uri =
-  let ic = In_channel.create ~binary:true (Uri.path uri) in
-  let close = lazy (In_channel.close ic) in
-  let close () = Lazy.force close in
-  try
-    let header = read_header ic in
-    let read () =
-      try read_piqi Frame_piqi.parse_frame ic with exn ->
-        if Int64.(header.toc_off <> 0L &&
-                  In_channel.pos ic >= header.toc_off)
-        then raise End_of_file
-        else raise exn in
-    let chan = {close; read} in
-    let meta = read_meta header ic in
-    let frames = read_frames chan in
-    {header;meta;frames;chan}
-  with exn ->
-    close ();
-    raise exn
-
-let close t = t.chan.close ()
+  let input = Input.map (Uri.path uri) in
+  let header = read_header input in
+  let meta = read_meta header input in
+  let first_frame = input.Input.pos in
+  let frames_per_toc_entry =
+    if Int64.(header.toc_off = 0L) then 0
+    else
+      let m = Input.int input ~pos:(Int64.to_int_exn header.toc_off) in
+      if m <= 0 then parse_error "malformed table of contents";
+      m in
+  {header; meta; input; chan = chan header input;
+   first_frame; frames_per_toc_entry; frame = 0}
 
 let meta t = t.meta
 let arch t = Arch.of_bfd t.header.bfd_arch t.header.bfd_mach
-let next_frame t = t.frames ()
 let version t = t.header.version
+
+let num_frames t =
+  if finished t then Int64.to_int_exn t.header.frames else 0
+
+(** The frames of an unfinished trace end wherever its writer got
+    to. *)
+let next_frame t =
+  if finished t && t.frame >= num_frames t then None
+  else match t.chan.read () with
+    | frame -> t.frame <- t.frame + 1; Some frame
+    | exception (Piqirun.IBuf.End_of_buffer | End_of_file)
+      when not (finished t) -> None
+
+(** There is no TOC entry for the first [m] frames, entry [k - 1]
+    holds the offset of frame [k * m]. *)
+let toc_entry t k =
+  Input.int t.input ~pos:(toc_off t + field_size * (k + 1))
+
+let seek t n =
+  if n < 0 || n >= num_frames t
+  then invalid_argf "Frame_reader.seek: no frame %d" n ();
+  let m = t.frames_per_toc_entry in
+  let entry = n / m in
+  (* Frames ahead in the same TOC entry are reached by skipping. *)
+  if n < t.frame || entry <> t.frame / m then begin
+    t.input.Input.pos <-
+      if entry = 0 then t.first_frame else toc_entry t (entry - 1);
+    t.chan.reset ();
+    t.frame <- entry * m
+  end;
+  while t.frame < n do
+    t.chan.skip ();
+    t.frame <- t.frame + 1
+  done
@@ -6,6 +6,12 @@ type frame = Frame_piqi.frame
 
 exception Parse_error of string
 
+(** [register_codec n decompress] decodes the blocks stored with codec
+    [n] with [decompress ~size data], which returns the [size] bytes
+    that [data] decompresses to. Linking bap-frames.codecs registers
+    zstd (1) and lz4 (2). Reading a block whose codec is not
+    registered raises [Parse_error]. *)
+val register_codec : int -> (size:int -> string -> string) -> unit
 
 val create : Uri.t -> t
 
@@ -16,3 +22,13 @@ val version : t -> int
 val arch : t -> arch option
 
 val next_frame : t -> frame option
+
+(** [num_frames t] is the number of frames of [t], or 0 if its writer
+    has not finished it yet. *)
+val num_frames : t -> int
+
+(** [seek t n] makes frame [n], numbered from 0, the next frame that
+    [next_frame t] returns, using the table of contents of [t], like
+    [seek] of the C++ [TraceContainerReader]. Raises
+    [Invalid_argument] if [t] has no frame [n]. *)
+val seek : t -> int -> unit
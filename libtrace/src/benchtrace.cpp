@@ -0,0 +1,665 @@
+/**
+ * Measure the throughput and latency of writing, reading and seeking
+ * in a synthetic trace, and report them as JSON.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "trace.async.hpp"
+#include "trace.container.hpp"
+#include "trace.parallel.hpp"
+#include "trace.prefetch.hpp"
+
+using namespace SerializedTrace;
+
+/* Count every allocation, to report allocations per frame. */
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+struct options {
+  uint64_t frames;
+  uint64_t frames_per_toc_entry;
+  uint64_t trace_version;
+  std::string codec;
+  std::string reader;
+  std::string writer;
+  uint64_t seeks;
+  uint64_t batch;
+  unsigned threads;
+  uint64_t prefetch;
+  uint64_t seed;
+  std::string trace;
+  bool keep;
+
+  options(void)
+    : frames (1000000)
+    , frames_per_toc_entry (default_frames_per_toc_entry)
+    , trace_version (default_trace_version)
+    , codec ("none")
+    , reader ("stdio")
+    , writer ("sync")
+    , seeks (1000)
+    , batch (1000)
+    , threads (0)
+    , prefetch (0)
+    , seed (1)
+    , trace ("benchtrace.trace")
+    , keep (false)
+  { }
+};
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [options]" << std::endl
+            << "  --frames <n>          frames in the synthetic trace (1000000)" << std::endl
+            << "  --toc <m>             frames per toc entry (" << default_frames_per_toc_entry << ")" << std::endl
+            << "  --version <v>         trace version (" << default_trace_version << ")" << std::endl
+            << "  --codec <c>           block codec of versions 4 and up: none, zstd or lz4" << std::endl
+            << "  --reader <r>          stdio or mmap" << std::endl
+            << "  --writer <w>          sync or async" << std::endl
+            << "  --seeks <k>           random seeks to measure (1000)" << std::endl
+            << "  --batch <b>           frames per get_frames batch (1000)" << std::endl
+            << "  --threads <t>         threads of the parallel and prefetching reads, 0 for one per core" << std::endl
+            << "  --prefetch <q>        also measure the prefetching read, with q segments queued, e.g. " << default_prefetch_segments << std::endl
+            << "  --seed <s>            seed of the synthetic trace" << std::endl
+            << "  --trace <file>        where to write the trace (benchtrace.trace)" << std::endl
+            << "  --keep                keep the trace afterwards" << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
+/** A small, fast and reproducible random number generator. */
+class random_numbers {
+
+public:
+
+  random_numbers(uint64_t seed) : state (seed) { }
+
+  uint64_t next(void) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  /** Uniform in [0, n). */
+  uint64_t below(uint64_t n) { return next() % n; }
+
+private:
+
+  uint64_t state;
+};
+
+/** Generates the frames of a program that runs loops over a fixed
+    set of instructions, with the operand mix of typical x86 code:
+    register arithmetic, loads, stores, stack operations and
+    branches. A few threads take turns, and there is an occasional
+    system call. */
+class synthetic_trace {
+
+public:
+
+  synthetic_trace(uint64_t seed)
+    : rng (seed)
+    , pc (0)
+    , loop_start (0)
+    , loop_len (1)
+    , iterations (0)
+    , iteration (0)
+    , thread (0)
+    , count (0)
+  {
+    const char *regs[] = { "EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP" };
+    uint64_t address = 0x8048000;
+    for (int i = 0; i < num_sites; i++) {
+      site &s = sites[i];
+      s.address = address;
+      s.kind = (site_kind) rng.below(num_site_kinds);
+      s.len = 1 + rng.below(7);
+      for (unsigned b = 0; b < s.len; b++) {
+        s.bytes[b] = (char) rng.next();
+      }
+      s.reg[0] = regs[rng.below(7)];
+      s.reg[1] = regs[rng.below(7)];
+      s.mem = 0x10000000 + rng.below(1 << 20) * 8;
+      s.stride = (rng.below(4) + 1) * 4;
+      address += s.len;
+    }
+  }
+
+  void next(frame &f) {
+    count++;
+    if (count % 20000 == 0) {
+      thread = (thread + 1) % 4;
+    }
+    if (count % 5000 == 0) {
+      syscall_frame *sc = f.mutable_syscall_frame();
+      sc->set_address(sites[pc].address);
+      sc->set_thread_id(thread);
+      sc->set_number(rng.below(300));
+      argument_list *args = sc->mutable_argument_list();
+      args->Clear();
+      for (int i = 0; i < 3; i++) {
+        args->add_elem(rng.next() & 0xffffffff);
+      }
+      return;
+    }
+
+    const site &s = sites[pc];
+    std_frame *sf = f.mutable_std_frame();
+    sf->set_address(s.address);
+    sf->set_thread_id(thread);
+    sf->set_rawbytes(s.bytes, s.len);
+    operand_value_list *pre = sf->mutable_operand_pre_list();
+    operand_value_list *post = sf->mutable_operand_post_list();
+    pre->Clear();
+    post->Clear();
+
+    uint64_t mem = s.mem + iteration * s.stride;
+    switch (s.kind) {
+    case site_alu:
+      add_reg(pre, s.reg[0], false);
+      add_reg(pre, s.reg[1], false);
+      add_reg(post, s.reg[0], true);
+      add_reg(post, "EFLAGS", true);
+      break;
+    case site_load:
+      add_reg(pre, s.reg[1], false);
+      add_mem(pre, mem, false);
+      add_reg(post, s.reg[0], true);
+      break;
+    case site_store:
+      add_reg(pre, s.reg[0], false);
+      add_reg(pre, s.reg[1], false);
+      add_mem(post, mem, true);
+      break;
+    case site_stack:
+      add_reg(pre, "ESP", false);
+      add_reg(pre, s.reg[0], false);
+      add_mem(post, 0xbfff0000 - (iteration % 64) * 4, true);
+      add_reg(post, "ESP", true);
+      break;
+    case site_branch:
+      add_reg(pre, "EFLAGS", false);
+      break;
+    default:
+      break;
+    }
+
+    advance();
+  }
+
+private:
+
+  enum site_kind {
+    site_alu,
+    site_load,
+    site_store,
+    site_stack,
+    site_branch,
+    num_site_kinds
+  };
+
+  struct site {
+    uint64_t address;
+    site_kind kind;
+    unsigned len;
+    char bytes[8];
+    const char *reg[2];
+    uint64_t mem;
+    uint64_t stride;
+  };
+
+  static const int num_sites = 4096;
+
+  random_numbers rng;
+  site sites[num_sites];
+
+  /** The current instruction, and the loop that is running. */
+  uint64_t pc;
+  uint64_t loop_start;
+  uint64_t loop_len;
+  uint64_t iterations;
+  uint64_t iteration;
+
+  uint64_t thread;
+  uint64_t count;
+
+  void add_operand(operand_value_list *l, bool written, uint64_t value, operand_info *&o) {
+    o = l->add_elem();
+    o->set_bit_length(32);
+    operand_usage *u = o->mutable_operand_usage();
+    u->set_read(!written);
+    u->set_written(written);
+    u->set_index(false);
+    u->set_base(false);
+    o->mutable_taint_info()->set_no_taint(true);
+    uint32_t v = value;
+    o->set_value(&v, sizeof(v));
+  }
+
+  void add_reg(operand_value_list *l, const char *name, bool written) {
+    operand_info *o;
+    add_operand(l, written, rng.next(), o);
+    o->mutable_operand_info_specific()->mutable_reg_operand()->set_name(name);
+  }
+
+  void add_mem(operand_value_list *l, uint64_t address, bool written) {
+    operand_info *o;
+    add_operand(l, written, rng.next(), o);
+    o->mutable_operand_info_specific()->mutable_mem_operand()->set_address(address);
+  }
+
+  /** Move to the next instruction of the loop, or start another
+      loop once this one is done. */
+  void advance(void) {
+    pc++;
+    if (pc < loop_start + loop_len) {
+      return;
+    }
+    pc = loop_start;
+    if (++iteration < iterations) {
+      return;
+    }
+    loop_len = 5 + rng.below(56);
+    loop_start = rng.below(num_sites - loop_len);
+    iterations = 1 + rng.below(100);
+    iteration = 0;
+    pc = loop_start;
+  }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+uint64_t elapsed_ns(bench_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+/** The measurements of one benchmark. */
+struct result {
+  std::string name;
+  uint64_t operations;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t ns;
+  uint64_t allocations;
+  std::vector<uint64_t> latencies;
+
+  result(const std::string &name_in)
+    : name (name_in)
+    , operations (0)
+    , frames (0)
+    , bytes (0)
+    , ns (0)
+    , allocations (0)
+  { }
+
+  std::string json(void) {
+    std::ostringstream o;
+    double seconds = ns / 1e9;
+    o << "    {\"name\": \"" << name << "\""
+      << ", \"operations\": " << operations
+      << ", \"frames\": " << frames
+      << ", \"seconds\": " << seconds
+      << ", \"frames_per_second\": " << (seconds > 0 ? frames / seconds : 0)
+      << ", \"mb_per_second\": " << (seconds > 0 ? bytes / seconds / 1e6 : 0)
+      << ", \"allocations_per_frame\": " << (frames > 0 ? (double) allocations / frames : 0);
+    if (!latencies.empty()) {
+      std::sort(latencies.begin(), latencies.end());
+      const char *names[] = { "p50", "p90", "p99", "p999" };
+      const double ranks[] = { 0.5, 0.9, 0.99, 0.999 };
+      o << ", \"latency_ns\": {";
+      for (int i = 0; i < 4; i++) {
+        o << "\"" << names[i] << "\": " << latencies[(uint64_t) (ranks[i] * (latencies.size() - 1))] << ", ";
+      }
+      o << "\"max\": " << latencies.back() << "}";
+    }
+    o << "}";
+    return o.str();
+  }
+};
+
+block_codec codec_named(const std::string &name, const char *program) {
+  if (name == "none") {
+    return block_codec_none;
+  } else if (name == "zstd") {
+    return block_codec_zstd;
+  } else if (name == "lz4") {
+    return block_codec_lz4;
+  }
+  usage(program);
+  return block_codec_none;
+}
+
+std::unique_ptr<TraceContainerReader> open_reader(const options &opts) {
+#ifndef _WIN32
+  if (opts.reader == "mmap") {
+    return std::unique_ptr<TraceContainerReader>(new MappedTraceReader(opts.trace));
+  }
+#endif
+  return std::unique_ptr<TraceContainerReader>(new TraceContainerReader(opts.trace));
+}
+
+uint64_t file_size(const std::string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (!f) {
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  uint64_t size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+result bench_write(const options &opts, block_codec codec) {
+  result r("write");
+  meta_frame meta;
+  meta.mutable_tracer()->set_name("benchtrace");
+  meta.mutable_tracer()->set_version("1");
+  meta.mutable_target()->set_path("synthetic");
+  meta.mutable_target()->set_md5sum("");
+  meta.mutable_fstats()->set_size(0);
+  meta.mutable_fstats()->set_atime(0);
+  meta.mutable_fstats()->set_mtime(0);
+  meta.mutable_fstats()->set_ctime(0);
+  meta.set_user("");
+  meta.set_host("");
+  meta.set_time(0);
+
+  TraceContainerWriter w(opts.trace, meta, default_arch, default_machine, opts.frames_per_toc_entry,
+                         default_write_buffer_size, opts.trace_version, codec);
+  std::unique_ptr<AsyncTraceWriter> async;
+  if (opts.writer == "async") {
+    async.reset(new AsyncTraceWriter(w));
+  }
+
+  synthetic_trace gen(opts.seed);
+  frame f;
+  r.latencies.reserve(opts.frames);
+  uint64_t allocs = 0;
+  for (uint64_t i = 0; i < opts.frames; i++) {
+    f.Clear();
+    gen.next(f);
+    uint64_t before = allocations.load(std::memory_order_relaxed);
+    bench_clock::time_point start = bench_clock::now();
+    if (async) {
+      async->add(f);
+    } else {
+      w.add(f);
+    }
+    uint64_t ns = elapsed_ns(start);
+    allocs += allocations.load(std::memory_order_relaxed) - before;
+    r.latencies.push_back(ns);
+    r.ns += ns;
+  }
+  bench_clock::time_point start = bench_clock::now();
+  if (async) {
+    async->finish();
+  } else {
+    w.finish();
+  }
+  r.ns += elapsed_ns(start);
+
+  r.operations = opts.frames;
+  r.frames = opts.frames;
+  r.bytes = file_size(opts.trace);
+  r.allocations = allocs;
+  return r;
+}
+
+result bench_read(const options &opts) {
+  result r("read");
+  std::unique_ptr<TraceContainerReader> reader = open_reader(opts);
+  r.latencies.reserve(reader->get_num_frames());
+  frame f;
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  bench_clock::time_point total = bench_clock::now();
+  for (;;) {
+    bench_clock::time_point start = bench_clock::now();
+    if (!reader->next(f)) {
+      break;
+    }
+    r.latencies.push_back(elapsed_ns(start));
+  }
+  r.ns = elapsed_ns(total);
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.frames = r.latencies.size();
+  r.bytes = file_size(opts.trace);
+  return r;
+}
+
+result bench_seek(const options &opts) {
+  result r("seek");
+  std::unique_ptr<TraceContainerReader> reader = open_reader(opts);
+  uint64_t n = reader->get_num_frames();
+  random_numbers rng(opts.seed + 1);
+  frame f;
+  r.latencies.reserve(opts.seeks);
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  for (uint64_t i = 0; i < opts.seeks && n > 0; i++) {
+    uint64_t target = rng.below(n);
+    bench_clock::time_point start = bench_clock::now();
+    reader->seek(target);
+    reader->next(f);
+    uint64_t ns = elapsed_ns(start);
+    r.latencies.push_back(ns);
+    r.ns += ns;
+  }
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.frames = r.latencies.size();
+  return r;
+}
+
+result bench_get_frames(const options &opts, bool use_arena) {
+  result r(use_arena ? "get_frames_arena" : "get_frames");
+  std::unique_ptr<TraceContainerReader> reader = open_reader(opts);
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  bench_clock::time_point total = bench_clock::now();
+  while (!reader->end_of_trace()) {
+    bench_clock::time_point start = bench_clock::now();
+    uint64_t got;
+    if (use_arena) {
+      google::protobuf::Arena arena;
+      std::vector<frame *> frames;
+      got = reader->get_frames(opts.batch, arena, frames);
+    } else {
+      got = reader->get_frames(opts.batch)->size();
+    }
+    r.latencies.push_back(elapsed_ns(start));
+    r.frames += got;
+  }
+  r.ns = elapsed_ns(total);
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.latencies.size();
+  r.bytes = file_size(opts.trace);
+  return r;
+}
+
+result bench_get_flat_frames(const options &opts) {
+  result r("get_frames_flat");
+  std::unique_ptr<TraceContainerReader> reader = open_reader(opts);
+  FlatArena arena;
+  std::vector<FlatFrame> frames;
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  bench_clock::time_point total = bench_clock::now();
+  while (!reader->end_of_trace()) {
+    bench_clock::time_point start = bench_clock::now();
+    r.frames += reader->get_frames(opts.batch, arena, frames);
+    r.latencies.push_back(elapsed_ns(start));
+  }
+  r.ns = elapsed_ns(total);
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.latencies.size();
+  r.bytes = file_size(opts.trace);
+  return r;
+}
+
+result bench_parallel_read(const options &opts) {
+  result r("parallel_read");
+  std::unique_ptr<TraceContainerReader> reader = open_reader(opts);
+  std::atomic<uint64_t> frames(0);
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  bench_clock::time_point total = bench_clock::now();
+  parallel_for_each_frame(*reader, opts.threads, [&](uint64_t, const frame &) {
+      frames.fetch_add(1, std::memory_order_relaxed);
+    });
+  r.ns = elapsed_ns(total);
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.frames = frames.load();
+  r.bytes = file_size(opts.trace);
+  return r;
+}
+
+result bench_prefetch_read(const options &opts) {
+  result r("prefetch_read");
+  PrefetchingTraceReader reader(opts.trace, opts.threads, opts.prefetch);
+  r.latencies.reserve(reader.get_num_frames());
+  uint64_t before = allocations.load(std::memory_order_relaxed);
+  bench_clock::time_point total = bench_clock::now();
+  /* The latency of a frame is the wait between two visits. */
+  bench_clock::time_point start = total;
+  reader.for_each_frame([&](const frame &) {
+      r.latencies.push_back(elapsed_ns(start));
+      start = bench_clock::now();
+      return true;
+    });
+  r.ns = elapsed_ns(total);
+  r.allocations = allocations.load(std::memory_order_relaxed) - before;
+  r.operations = r.frames = r.latencies.size();
+  r.bytes = file_size(opts.trace);
+  return r;
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "benchtrace";
+  options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "--keep") {
+      opts.keep = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(name);
+    }
+    const char *value = argv[++i];
+    if (arg == "--frames") {
+      opts.frames = number(value, name);
+    } else if (arg == "--toc") {
+      opts.frames_per_toc_entry = number(value, name);
+    } else if (arg == "--version") {
+      opts.trace_version = number(value, name);
+    } else if (arg == "--codec") {
+      opts.codec = value;
+    } else if (arg == "--reader") {
+      opts.reader = value;
+    } else if (arg == "--writer") {
+      opts.writer = value;
+    } else if (arg == "--seeks") {
+      opts.seeks = number(value, name);
+    } else if (arg == "--batch") {
+      opts.batch = number(value, name);
+    } else if (arg == "--threads") {
+      opts.threads = number(value, name);
+    } else if (arg == "--prefetch") {
+      opts.prefetch = number(value, name);
+    } else if (arg == "--seed") {
+      opts.seed = number(value, name);
+    } else if (arg == "--trace") {
+      opts.trace = value;
+    } else {
+      usage(name);
+    }
+  }
+  if ((opts.reader != "stdio" && opts.reader != "mmap") ||
+      (opts.writer != "sync" && opts.writer != "async") ||
+      opts.frames_per_toc_entry == 0 || opts.batch == 0) {
+    usage(name);
+  }
+  block_codec codec = codec_named(opts.codec, name);
+
+  std::vector<result> results;
+  try {
+    results.push_back(bench_write(opts, codec));
+    results.push_back(bench_read(opts));
+    results.push_back(bench_seek(opts));
+    results.push_back(bench_get_frames(opts, false));
+    results.push_back(bench_get_frames(opts, true));
+    results.push_back(bench_get_flat_frames(opts));
+    results.push_back(bench_parallel_read(opts));
+    if (opts.prefetch > 0) {
+      results.push_back(bench_prefetch_read(opts));
+    }
+  } catch (std::exception &e) {
+    std::cerr << name << ": " << e.what() << std::endl;
+    if (!opts.keep) {
+      remove(opts.trace.c_str());
+    }
+    exit(1);
+  }
+
+  std::cout << "{" << std::endl
+            << "  \"config\": {\"frames\": " << opts.frames
+            << ", \"frames_per_toc_entry\": " << opts.frames_per_toc_entry
+            << ", \"trace_version\": " << opts.trace_version
+            << ", \"codec\": \"" << opts.codec << "\""
+            << ", \"reader\": \"" << opts.reader << "\""
+            << ", \"writer\": \"" << opts.writer << "\""
+            << ", \"seed\": " << opts.seed
+            << ", \"trace_bytes\": " << file_size(opts.trace) << "}," << std::endl
+            << "  \"results\": [" << std::endl;
+  for (uint64_t i = 0; i < results.size(); i++) {
+    std::cout << results[i].json() << (i + 1 < results.size() ? "," : "") << std::endl;
+  }
+  std::cout << "  ]" << std::endl << "}" << std::endl;
+
+  if (!opts.keep) {
+    remove(opts.trace.c_str());
+  }
+}
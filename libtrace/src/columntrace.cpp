@@ -0,0 +1,32 @@
+/**
+ * Build the frame columns of a trace, so that queries on program
+ * counters, threads and frame kinds can skip decoding the frames.
+ */
+
+#include <iostream>
+#include "trace.container.hpp"
+
+using namespace SerializedTrace;
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    if (argv[0]) {
+      std::cout << "Usage: " << argv[0] << " <trace>" << std::endl;
+    }
+    exit(1);
+  }
+  std::string tracefile(argv[1]);
+
+#ifndef _WIN32
+  MappedTraceReader r(tracefile);
+#else
+  TraceContainerReader r(tracefile);
+#endif
+  FrameColumnsWriter w(FrameColumns::filename_for(tracefile));
+  /* Only scan the fields of the columns, without parsing frames. */
+  scanned_frame s;
+  while (r.next_scanned(s, frame_fields_located)) {
+    w.add(s.address, s.thread_id, s.kind);
+  }
+  w.finish(r.indexed_trace());
+}
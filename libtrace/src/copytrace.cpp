@@ -4,6 +4,8 @@
 
 #include <fstream>
 #include <iostream>
+#include <stdlib.h>
+#include <string>
 #include "trace.container.hpp"
 
 using namespace SerializedTrace;
@@ -14,19 +16,92 @@ void copy_all(TraceContainerReader &r, TraceContainerWriter &w) {
   }
 }
 
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [--encode] [--key-frames <n> [--align-key-frames]] [--stats] <source filename> <destination filename> [none|zstd|lz4]" << std::endl;
+  std::cout << "  Giving a block codec writes a version 4 trace, with block summaries." << std::endl;
+  std::cout << "  --encode writes a version 5 trace, whose blocks are also dictionary encoded." << std::endl;
+  std::cout << "  --key-frames adds a key frame every n frames, n > 0, at the next toc entry with --align-key-frames." << std::endl;
+  std::cout << "  --stats prints the statistics of the reader and the writer." << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  /* strtoull accepts, and negates, a leading minus sign. */
+  if (*s == '-') {
+    usage(name);
+  }
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    if (argv[0]) {
-      std::cout << "Usage: " << argv[0] << " <source filename> <destination filename>" << std::endl;
+  const char *name = argv[0] ? argv[0] : "copytrace";
+  bool encode = false, stats = false, align_key_frames = false;
+  uint64_t key_frames = 0;
+  int first = 1;
+  for (; first < argc; first++) {
+    std::string arg(argv[first]);
+    if (arg == "--encode") {
+      encode = true;
+    } else if (arg == "--key-frames" && first + 1 < argc) {
+      key_frames = number(argv[++first], name);
+      if (key_frames == 0) {
+        usage(name);
+      }
+    } else if (arg == "--align-key-frames") {
+      align_key_frames = true;
+    } else if (arg == "--stats") {
+      stats = true;
+    } else {
+      break;
+    }
+  }
+  if (argc - first != 2 && argc - first != 3) {
+    usage(name);
+  }
+  std::string srcfile(argv[first]);
+  std::string dstfile(argv[first + 1]);
+
+  uint64_t version = encode ? encoded_trace_version : default_trace_version;
+  block_codec codec = block_codec_none;
+  if (argc - first == 3) {
+    std::string name(argv[first + 2]);
+    version = encode ? encoded_trace_version : blocked_trace_version;
+    if (name == "zstd") {
+      codec = block_codec_zstd;
+    } else if (name == "lz4") {
+      codec = block_codec_lz4;
+    } else if (name != "none") {
+      std::cerr << "Unknown block codec " << name << std::endl;
+      exit(1);
     }
-    exit(1);
   }
-  std::string srcfile(argv[1]);
-  std::string dstfile(argv[2]);
 
   TraceContainerReader r(srcfile);
-  TraceContainerWriter w(dstfile, *r.get_meta(), r.get_arch(), r.get_machine(), r.get_frames_per_toc_entry());
+  TraceContainerWriter w(dstfile, *r.get_meta(), r.get_arch(), r.get_machine(), r.get_frames_per_toc_entry(),
+                         default_write_buffer_size, version, codec);
+  if (version >= blocked_trace_version) {
+    w.write_block_summaries();
+  }
+  if (key_frames > 0) {
+    w.write_key_frames(key_frames, align_key_frames);
+  }
 
   copy_all(r, w);
   w.finish();
+
+  if (stats) {
+    if (!stats_enabled) {
+      std::cerr << "libtrace was configured without --enable-stats" << std::endl;
+    } else {
+      std::cerr << "reader:" << std::endl;
+      r.get_stats().print(std::cerr);
+      std::cerr << "writer:" << std::endl;
+      w.get_stats().print(std::cerr);
+    }
+  }
 }
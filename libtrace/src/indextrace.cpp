@@ -0,0 +1,37 @@
+/**
+ * Build the dense frame index of a trace, so that readers can seek
+ * to any frame directly.
+ */
+
+#include <iostream>
+#include "trace.container.hpp"
+
+using namespace SerializedTrace;
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    if (argv[0]) {
+      std::cout << "Usage: " << argv[0] << " <trace>" << std::endl;
+    }
+    exit(1);
+  }
+  std::string tracefile(argv[1]);
+
+#ifndef _WIN32
+  MappedTraceReader r(tracefile);
+#else
+  TraceContainerReader r(tracefile);
+#endif
+  std::unique_ptr<FrameIndex> index;
+  try {
+    index = r.build_frame_index();
+  } catch (TraceException &e) {
+    if (r.get_trace_version() >= blocked_trace_version) {
+      std::cerr << "frame indexes are only supported for version 3 traces" << std::endl;
+    } else {
+      std::cerr << e.what() << std::endl;
+    }
+    exit(1);
+  }
+  index->save(FrameIndex::filename_for(tracefile));
+}
@@ -0,0 +1,21 @@
+/**
+ * Concatenate traces.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include "trace.copy.hpp"
+
+using namespace SerializedTrace;
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    if (argv[0]) {
+      std::cout << "Usage: " << argv[0] << " <destination trace> <source trace>..." << std::endl;
+    }
+    exit(1);
+  }
+  std::vector<std::string> srcs(argv + 2, argv + argc);
+  uint64_t n = merge_traces(srcs, argv[1]);
+  std::cout << n << " frames" << std::endl;
+}
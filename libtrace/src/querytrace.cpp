@@ -0,0 +1,101 @@
+/**
+ * Print the frames of a trace that match a query.
+ */
+
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.container.hpp"
+#include "trace.query.hpp"
+
+using namespace SerializedTrace;
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [options] <trace>" << std::endl
+            << "  --frames <first>:<last>  frames in [first, last)" << std::endl
+            << "  --pc <low>:<high>        program counter in [low, high)" << std::endl
+            << "  --thread <id>            frames of thread <id>" << std::endl
+            << "  --store <address>        frames that write to <address>" << std::endl
+            << "  --syscall <number>       system calls <number>" << std::endl
+            << "  --count                  only print the number of frames" << std::endl
+            << "Numbers may be given in hex with a 0x prefix." << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
+void range(const char *s, uint64_t &low, uint64_t &high, const char *name) {
+  const char *colon = strchr(s, ':');
+  if (!colon) {
+    usage(name);
+  }
+  low = number(std::string(s, colon).c_str(), name);
+  high = number(colon + 1, name);
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "querytrace";
+  trace_query query;
+  bool count_only = false;
+
+  int i = 1;
+  for (; i < argc - 1; i++) {
+    if (strcmp(argv[i], "--count") == 0) {
+      count_only = true;
+    } else if (i + 1 >= argc - 1) {
+      usage(name);
+    } else if (strcmp(argv[i], "--frames") == 0) {
+      range(argv[++i], query.first_frame, query.last_frame, name);
+    } else if (strcmp(argv[i], "--pc") == 0) {
+      query.match_pc = true;
+      range(argv[++i], query.pc_low, query.pc_high, name);
+    } else if (strcmp(argv[i], "--thread") == 0) {
+      query.match_thread = true;
+      query.thread_id = number(argv[++i], name);
+    } else if (strcmp(argv[i], "--store") == 0) {
+      query.match_store = true;
+      query.store_address = number(argv[++i], name);
+    } else if (strcmp(argv[i], "--syscall") == 0) {
+      query.match_syscall = true;
+      query.syscall_number = number(argv[++i], name);
+    } else {
+      usage(name);
+    }
+  }
+  if (i != argc - 1) {
+    usage(name);
+  }
+  std::string tracefile(argv[i]);
+
+#ifndef _WIN32
+  MappedTraceReader r(tracefile);
+#else
+  TraceContainerReader r(tracefile);
+#endif
+
+  /* Use the frame columns if they were built for this trace. */
+  std::unique_ptr<FrameColumns> columns;
+  try {
+    columns.reset(new FrameColumns(FrameColumns::filename_for(tracefile), r.indexed_trace()));
+  } catch (TraceException &) {
+  }
+
+  uint64_t matches = run_query(r, query, [&](uint64_t n, const frame &f) {
+      if (!count_only) {
+        std::cout << "frame " << n << std::endl << f.DebugString() << std::endl;
+      }
+      return true;
+    }, columns.get());
+
+  if (count_only) {
+    std::cout << matches << std::endl;
+  }
+}
@@ -5,7 +5,9 @@
 #include <cassert>
 #include <exception>
 #include <iostream>
+#include <string.h>
 #include "trace.container.hpp"
+#include "trace.stream.hpp"
 
 using namespace SerializedTrace;
 
@@ -13,28 +15,73 @@ void print(frame &f) {
   std::cout << f.DebugString() << std::endl;
 }
 
-void print_all(const char *f) {
+/* Print the statistics of a reader to stderr, so that they do not
+   mix with the frames. */
+void print_stats(const trace_stats &stats) {
+  if (!stats_enabled) {
+    std::cerr << "libtrace was configured without --enable-stats" << std::endl;
+    return;
+  }
+  stats.print(std::cerr);
+}
+
+void print_all(const char *f, bool stats) {
   uint64_t ctr = 0;
 
   TraceContainerReader t(f);
 
   std::cout << t.get_meta()->DebugString() << std::endl;
 
-  while (!t.end_of_trace()) {
+  frame fr;
+  while (t.next(fr)) {
     ctr++;
-    print(*(t.get_frame()));
+    print(fr);
   }
 
   assert(ctr == t.get_num_frames());
+
+  if (stats) {
+    print_stats(t.get_stats());
+  }
+}
+
+/* Read the trace sequentially, without its table of contents, so
+   that it can come from a pipe or still be written. */
+void print_stream(const char *f, bool follow) {
+  TraceStreamReader t(f, follow);
+
+  std::cout << t.get_meta()->DebugString() << std::endl;
+
+  frame fr;
+  while (t.next(fr)) {
+    print(fr);
+  }
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  bool follow = false, stats = false;
+  int i = 1;
+  for (; i < argc - 1; i++) {
+    if (strcmp(argv[i], "--follow") == 0) {
+      follow = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else {
+      break;
+    }
+  }
+  if (i != argc - 1) {
     if (argv[0]) {
-      std::cout << "Usage: " << argv[0] << " <trace>" << std::endl;
+      std::cout << "Usage: " << argv[0] << " [--follow] [--stats] <trace|->" << std::endl;
+      std::cout << "  --stats prints the statistics of the reader; streams have none." << std::endl;
     }
     exit(1);
   }
 
-  print_all(argv[1]);
+  const char *f = argv[argc - 1];
+  if (follow || strcmp(f, "-") == 0) {
+    print_stream(f, follow);
+  } else {
+    print_all(f, stats);
+  }
 }
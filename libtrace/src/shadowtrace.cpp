@@ -0,0 +1,92 @@
+/**
+ * Build the shadow memory of a trace, or read memory at a frame from
+ * it.
+ */
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+#include "trace.shadow.hpp"
+
+using namespace SerializedTrace;
+
+/* The most bytes printed at once. */
+const uint64_t max_length = 1LL << 20;
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " --build [<frames per snapshot>] <trace>" << std::endl
+            << "       " << name << " <trace> <frame number> <address> [<length>]" << std::endl
+            << "  The first form writes the shadow memory of the trace, the second prints" << std::endl
+            << "  the bytes at the address just before the frame, ?? for unknown bytes." << std::endl
+            << "  The frame number is at most the number of frames, the length at most "
+            << max_length << "." << std::endl
+            << "Numbers may be given in hex with a 0x prefix." << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  /* strtoull accepts, and negates, a leading minus sign. */
+  if (*s == '-') {
+    usage(name);
+  }
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "shadowtrace";
+  if (argc >= 3 && strcmp(argv[1], "--build") == 0) {
+    if (argc > 4) {
+      usage(name);
+    }
+    uint64_t frames_per_snapshot = argc == 4 ? number(argv[2], name) : default_frames_per_snapshot;
+    if (frames_per_snapshot == 0) {
+      usage(name);
+    }
+    TraceContainerReader r(argv[argc - 1]);
+    ShadowMemory::build(r, ShadowMemory::filename_for(argv[argc - 1]), frames_per_snapshot);
+    ShadowMemory s(r, ShadowMemory::filename_for(argv[argc - 1]));
+    std::cout << s.get_num_versions() << " page versions in "
+              << (r.get_num_frames() + frames_per_snapshot - 1) / frames_per_snapshot
+              << " snapshots" << std::endl;
+    return 0;
+  }
+  if (argc != 4 && argc != 5) {
+    usage(name);
+  }
+  uint64_t frame_number = number(argv[2], name);
+  uint64_t address = number(argv[3], name);
+  uint64_t len = argc == 5 ? number(argv[4], name) : 16;
+  if (len > max_length || (len > 0 && address + (len - 1) < address)) {
+    usage(name);
+  }
+
+  TraceContainerReader r(argv[1]);
+  if (frame_number > r.get_num_frames()) {
+    usage(name);
+  }
+  ShadowMemory s(r, ShadowMemory::filename_for(argv[1]));
+
+  std::vector<uint8_t> bytes(len);
+  std::unique_ptr<bool[]> known(new bool[len]);
+  s.read(frame_number, address, len, bytes.data(), known.get());
+  for (uint64_t i = 0; i < len; i += 16) {
+    std::cout << std::hex << "0x" << address + i << ":";
+    for (uint64_t j = i; j < len && j < i + 16; j++) {
+      if (known[j]) {
+        std::cout << " " << std::setfill('0') << std::setw(2) << (unsigned) bytes[j];
+      } else {
+        std::cout << " ??";
+      }
+    }
+    std::cout << std::dec << std::endl;
+  }
+}
@@ -0,0 +1,37 @@
+/**
+ * Split a trace into one trace per thread, with a sequence index
+ * that keeps their merged order.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include "trace.shard.hpp"
+
+using namespace SerializedTrace;
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    if (argv[0]) {
+      std::cout << "Usage: " << argv[0] << " <source trace> <sharded trace>" << std::endl
+                << "  Writes the frames of every thread to <sharded trace>.N, and their order" << std::endl
+                << "  to <sharded trace>.seq, without parsing the frames." << std::endl;
+    }
+    exit(1);
+  }
+
+  TraceContainerReader r(argv[1]);
+  ShardedTraceWriter w(argv[2], *r.get_meta(), r.get_arch(), r.get_machine(),
+                       r.get_frames_per_toc_entry(), default_shard_buffer_size,
+                       r.get_trace_version(), r.get_block_codec());
+  uint64_t len;
+  const uint8_t *data;
+  while ((data = r.next_raw(len))) {
+    w.add_raw(data, len);
+  }
+  w.finish();
+
+  ShardedTraceReader s(argv[2]);
+  std::cout << s.get_num_frames() << " frames, "
+            << s.get_thread_ids().size() << " shards, "
+            << s.get_runs().size() << " runs" << std::endl;
+}
@@ -0,0 +1,33 @@
+/**
+ * Copy a range of frames of a trace to a new trace.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include "trace.copy.hpp"
+
+using namespace SerializedTrace;
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " <source trace> <destination trace> <first> <last>" << std::endl
+            << "  Copies frames [first, last) without parsing them." << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "slicetrace";
+  if (argc != 5) {
+    usage(name);
+  }
+  uint64_t n = slice_trace(argv[1], argv[2], number(argv[3], name), number(argv[4], name));
+  std::cout << n << " frames" << std::endl;
+}
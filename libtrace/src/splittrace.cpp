@@ -0,0 +1,33 @@
+/**
+ * Split a trace into shards of consecutive frames.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include "trace.copy.hpp"
+
+using namespace SerializedTrace;
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " <trace> <number of shards> [destination prefix]" << std::endl
+            << "  Writes the shards to <prefix>.0, <prefix>.1, ..., the prefix defaults to <trace>." << std::endl;
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "splittrace";
+  if (argc != 3 && argc != 4) {
+    usage(name);
+  }
+  char *end;
+  uint64_t shards = strtoull(argv[2], &end, 0);
+  if (end == argv[2] || *end != '\0' || shards == 0) {
+    usage(name);
+  }
+  std::string prefix(argc == 4 ? argv[3] : argv[1]);
+
+  std::vector<std::string> names = split_trace(argv[1], prefix, shards);
+  for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); ++i) {
+    std::cout << *i << std::endl;
+  }
+}
@@ -0,0 +1,80 @@
+/**
+ * Print the machine state at a frame of a trace, reconstructed from
+ * its last key frame.
+ */
+
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include "trace.container.hpp"
+
+using namespace SerializedTrace;
+
+/* Print a value, most significant byte first. */
+void print_value(const std::string &value) {
+  std::cout << "0x" << std::hex << std::setfill('0');
+  for (std::string::size_type i = value.size(); i-- > 0; ) {
+    std::cout << std::setw(2) << (unsigned) (uint8_t) value[i];
+  }
+  std::cout << std::dec;
+}
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " <trace> <frame number>" << std::endl
+            << "  Prints the registers of every thread and the memory seen before the frame," << std::endl
+            << "  which is at most the number of frames." << std::endl;
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "statetrace";
+  if (argc != 3) {
+    usage(name);
+  }
+  char *end;
+  uint64_t frame_number = strtoull(argv[2], &end, 0);
+  /* strtoull accepts, and negates, a leading minus sign. */
+  if (end == argv[2] || *end != '\0' || argv[2][0] == '-') {
+    usage(name);
+  }
+
+  TraceContainerReader r(argv[1]);
+  if (frame_number > r.get_num_frames()) {
+    usage(name);
+  }
+  MachineState state;
+  uint64_t start = r.reconstruct_state(frame_number, state);
+  std::cout << "replayed frames " << start << " to " << frame_number << std::endl;
+
+  const std::map<uint64_t, MachineState::register_file> &registers = state.get_registers();
+  for (std::map<uint64_t, MachineState::register_file>::const_iterator t = registers.begin();
+       t != registers.end(); ++t) {
+    if (t->first == no_thread_id) {
+      std::cout << "no thread:" << std::endl;
+    } else {
+      std::cout << "thread " << t->first << ":" << std::endl;
+    }
+    for (MachineState::register_file::const_iterator i = t->second.begin(); i != t->second.end(); ++i) {
+      std::cout << "  " << i->first << " = ";
+      print_value(i->second.value);
+      std::cout << std::endl;
+    }
+  }
+
+  /* Print memory as runs of consecutive bytes, in address order. */
+  const std::map<uint64_t, uint8_t> &memory = state.get_memory();
+  std::cout << "memory: " << memory.size() << " bytes" << std::endl;
+  std::map<uint64_t, uint8_t>::const_iterator i = memory.begin();
+  while (i != memory.end()) {
+    uint64_t address = i->first;
+    std::cout << "  " << std::hex << "0x" << address << ":" << std::setfill('0');
+    uint64_t n = 0;
+    do {
+      std::cout << " " << std::setw(2) << (unsigned) i->second;
+      ++i;
+      ++n;
+    } while (i != memory.end() && i->first == address + n && n < 16);
+    std::cout << std::dec << std::endl;
+  }
+}
@@ -0,0 +1,226 @@
+/**
+ * Implementation of the asynchronous trace writer.
+ */
+
+#include "trace.async.hpp"
+#include <algorithm>
+#include <chrono>
+
+namespace SerializedTrace {
+
+  static uint64_t round_up_pow2(uint64_t n) {
+    uint64_t r = 1;
+    while (r < n) {
+      r <<= 1;
+    }
+    return r;
+  }
+
+  /* Spin briefly, then yield, then sleep. Used by producers waiting
+     for a free slot and by workers waiting for frames. */
+  static void backoff(unsigned &spins) {
+    spins++;
+    if (spins < 64) {
+      return;
+    } else if (spins < 128) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  AsyncTraceWriter::AsyncTraceWriter(TraceContainerWriter &writer_in,
+                                     uint64_t queue_size,
+                                     backpressure_policy policy_in,
+                                     unsigned num_workers_in)
+    : writer (writer_in)
+    , policy (policy_in)
+    , num_workers (num_workers_in > 0 ? num_workers_in : 1)
+    , ring (round_up_pow2(std::max(queue_size, min_async_queue_size)))
+    , mask (ring.size() - 1)
+    , enqueue_pos (0)
+    , serialize_pos (0)
+    , write_pos (0)
+    , closed (false)
+    , dropped (0)
+  {
+    for (uint64_t i = 0; i < ring.size(); i++) {
+      ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < num_workers; i++) {
+      workers.push_back(std::thread(&AsyncTraceWriter::work, this));
+    }
+  }
+
+  AsyncTraceWriter::~AsyncTraceWriter(void) noexcept {
+    stop();
+    if (num_workers > 1) {
+      drain();
+    }
+  }
+
+  AsyncTraceWriter::slot *AsyncTraceWriter::claim(uint64_t &pos) {
+    unsigned spins = 0;
+    pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      slot &s = ring[pos & mask];
+      int64_t diff = (int64_t)(s.seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          return &s;
+        }
+      } else if (diff < 0) {
+        /* The slot still holds a frame from the previous lap. */
+        if (policy == backpressure_drop) {
+          dropped.fetch_add(1, std::memory_order_relaxed);
+          return NULL;
+        }
+        backoff(spins);
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      } else {
+        /* Another producer took this slot. */
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void AsyncTraceWriter::publish(slot &s, uint64_t pos) {
+    s.seq.store(pos + 1, std::memory_order_release);
+  }
+
+  bool AsyncTraceWriter::add(const frame &f) {
+    uint64_t pos;
+    slot *s = claim(pos);
+    if (!s) {
+      return false;
+    }
+    s->serialized = false;
+    s->f = f;
+    publish(*s, pos);
+    return true;
+  }
+
+  bool AsyncTraceWriter::add(frame &&f) {
+    uint64_t pos;
+    slot *s = claim(pos);
+    if (!s) {
+      return false;
+    }
+    s->serialized = false;
+    s->f.Swap(&f);
+    publish(*s, pos);
+    return true;
+  }
+
+  bool AsyncTraceWriter::add_serialized(std::string &&data) {
+    uint64_t pos;
+    slot *s = claim(pos);
+    if (!s) {
+      return false;
+    }
+    s->serialized = true;
+    s->data.swap(data);
+    publish(*s, pos);
+    return true;
+  }
+
+  void AsyncTraceWriter::work(void) {
+    for (;;) {
+      uint64_t pos = serialize_pos.fetch_add(1, std::memory_order_relaxed);
+      slot &s = ring[pos & mask];
+
+      unsigned spins = 0;
+      while (s.seq.load(std::memory_order_acquire) != pos + 1) {
+        if (closed.load(std::memory_order_acquire) &&
+            pos >= enqueue_pos.load(std::memory_order_acquire)) {
+          return;
+        }
+        backoff(spins);
+      }
+
+      if (num_workers == 1) {
+        /* Frames are claimed in order, so a single worker can write
+           them right away, serializing into the writer's buffer. */
+        write_slot(s, pos);
+        continue;
+      }
+
+      if (!s.serialized) {
+        s.data.resize(s.f.ByteSizeLong());
+        s.f.SerializeWithCachedSizesToArray((uint8_t *)&s.data[0]);
+        s.serialized = true;
+      }
+      s.seq.store(pos + 2, std::memory_order_release);
+      drain();
+    }
+  }
+
+  void AsyncTraceWriter::drain(void) {
+    bool more;
+    do {
+      {
+        std::unique_lock<std::mutex> lock(write_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+          return;
+        }
+        uint64_t pos = write_pos.load(std::memory_order_relaxed);
+        for (;;) {
+          slot &s = ring[pos & mask];
+          if (s.seq.load(std::memory_order_acquire) != pos + 2) {
+            break;
+          }
+          write_slot(s, pos);
+          pos++;
+        }
+        write_pos.store(pos, std::memory_order_relaxed);
+      }
+      /* A frame may have been serialized after we stopped looking
+         but before the lock was released. */
+      uint64_t pos = write_pos.load(std::memory_order_relaxed);
+      more = ring[pos & mask].seq.load(std::memory_order_acquire) == pos + 2;
+    } while (more);
+  }
+
+  void AsyncTraceWriter::write_slot(slot &s, uint64_t pos) {
+    /* Keep freeing slots after a failure, so that producers do not
+       block forever. The error is reported by finish(). */
+    if (!error) {
+      try {
+        if (s.serialized) {
+          writer.add_raw((const uint8_t *)s.data.data(), s.data.size());
+        } else {
+          writer.add(s.f);
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+    s.seq.store(pos + ring.size(), std::memory_order_release);
+  }
+
+  void AsyncTraceWriter::stop(void) {
+    closed.store(true, std::memory_order_release);
+    for (std::vector<std::thread>::iterator i = workers.begin(); i != workers.end(); ++i) {
+      if (i->joinable()) {
+        i->join();
+      }
+    }
+  }
+
+  void AsyncTraceWriter::finish() {
+    stop();
+    /* The workers exit as soon as nothing is left to claim, the last
+       serialized frames may still be waiting to be written. */
+    if (num_workers > 1) {
+      drain();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    writer.finish();
+  }
+
+  uint64_t AsyncTraceWriter::get_dropped(void) const noexcept {
+    return dropped.load(std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,153 @@
+#ifndef TRACE_ASYNC_HPP
+#define TRACE_ASYNC_HPP
+
+/**
+ * An asynchronous front end for [TraceContainerWriter].
+ *
+ * Producers push frames, or frames they have already serialized,
+ * into a bounded lock-free ring. Worker threads take them out of
+ * the ring, serialize them and hand them to the underlying writer,
+ * so the producing thread never waits for protobuf or for the disk.
+ *
+ * Every slot of the ring carries a sequence number that tells which
+ * stage it is in. For the slot of frame [pos] in a ring of [size]
+ * slots the sequence number is
+ *
+ *   pos            the slot is free and may be filled,
+ *   pos + 1        the frame was pushed and waits for a worker,
+ *   pos + 2        the frame was serialized and waits to be written,
+ *   pos + size     the frame was written, the slot is free again.
+ *
+ * Producers claim slots with a compare-and-swap, so any number of
+ * threads may push concurrently. Workers claim frames in order and
+ * serialize them in parallel, while the frames are written to the
+ * trace strictly in the order they were pushed.
+ */
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t default_async_queue_size = 1LL << 16;
+
+  /** The ring needs at least four slots for the sequence numbers of
+      its stages to be distinct. */
+  const uint64_t min_async_queue_size = 4;
+
+  /** What a producer does when the queue is full. */
+  enum backpressure_policy {
+    /** Wait until a worker frees a slot. */
+    backpressure_block,
+    /** Discard the frame and count it as dropped. */
+    backpressure_drop
+  };
+
+  class AsyncTraceWriter {
+
+  public:
+
+    /** Creates an asynchronous writer that feeds [writer] from
+        [num_workers] background threads through a queue of
+        [queue_size] frames, rounded up to a power of two. Errors
+        raised by [writer] are reported by [finish]. */
+    AsyncTraceWriter(TraceContainerWriter &writer,
+                     uint64_t queue_size = default_async_queue_size,
+                     backpressure_policy policy = backpressure_block,
+                     unsigned num_workers = 1);
+
+    /** Stops the workers and writes out the queued frames if
+        [finish] was not called, but does not finish the trace. */
+    ~AsyncTraceWriter(void) noexcept;
+
+    /** Queue a copy of [f]. Returns false if the frame was dropped. */
+    bool add(const frame &f);
+
+    /** Queue [f], taking over its contents. Returns false if the
+        frame was dropped. */
+    bool add(frame &&f);
+
+    /** Queue a frame already serialized into [data], taking over
+        the string. Returns false if the frame was dropped. */
+    bool add_serialized(std::string &&data);
+
+    /** Wait until all queued frames are written, stop the workers
+        and finish the underlying trace. No frames may be added
+        concurrently with or after this call. */
+    void finish();
+
+    /** Returns the number of frames dropped because the queue was
+        full. */
+    uint64_t get_dropped(void) const noexcept;
+
+  private:
+
+    struct slot {
+      std::atomic<uint64_t> seq;
+      /** The frame is in [data] rather than in [f]. */
+      bool serialized;
+      frame f;
+      std::string data;
+    };
+
+    TraceContainerWriter &writer;
+
+    const backpressure_policy policy;
+
+    const unsigned num_workers;
+
+    std::vector<slot> ring;
+
+    /** [ring.size() - 1], the ring size is a power of two. */
+    const uint64_t mask;
+
+    /** Position of the next frame to be pushed. */
+    std::atomic<uint64_t> enqueue_pos;
+
+    /** Position of the next frame to be claimed by a worker. */
+    std::atomic<uint64_t> serialize_pos;
+
+    /** Position of the next frame to be written. Only advanced by
+        the thread holding [write_mutex]. */
+    std::atomic<uint64_t> write_pos;
+
+    std::mutex write_mutex;
+
+    /** Set by [finish] once no more frames will be pushed. */
+    std::atomic<bool> closed;
+
+    std::atomic<uint64_t> dropped;
+
+    /** The first exception raised by [writer], if any. Only set by
+        the thread writing frames. */
+    std::exception_ptr error;
+
+    std::vector<std::thread> workers;
+
+    /** Claim a slot for a new frame, or return NULL if the frame is
+        dropped. The caller fills the slot and calls [publish]. */
+    slot *claim(uint64_t &pos);
+
+    void publish(slot &s, uint64_t pos);
+
+    /** Worker thread loop. */
+    void work(void);
+
+    /** Write out serialized frames in order, as long as they are
+        available and no other thread is doing so. */
+    void drain(void);
+
+    /** Write the frame in [s] to the trace and free the slot. */
+    void write_slot(slot &s, uint64_t pos);
+
+    /** Stop and join the workers. */
+    void stop(void);
+  };
+};
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * Implementation of block compression.
+ */
+
+#include "trace.codec.hpp"
+#include <string.h>
+#include <string>
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define TRACE_ZSTD 1
+#endif
+#if defined(HAVE_LZ4_H) && defined(HAVE_LIBLZ4)
+#include <lz4.h>
+#define TRACE_LZ4 1
+#endif
+
+namespace SerializedTrace {
+
+  bool codec_supported(uint64_t codec) {
+    switch (codec) {
+    case block_codec_none:
+      return true;
+#ifdef TRACE_ZSTD
+    case block_codec_zstd:
+      return true;
+#endif
+#ifdef TRACE_LZ4
+    case block_codec_lz4:
+      return true;
+#endif
+    default:
+      return false;
+    }
+  }
+
+  uint64_t compress_bound(block_codec codec, uint64_t len) {
+    switch (codec) {
+#ifdef TRACE_ZSTD
+    case block_codec_zstd:
+      return ZSTD_compressBound(len);
+#endif
+#ifdef TRACE_LZ4
+    case block_codec_lz4:
+      if (len > LZ4_MAX_INPUT_SIZE) {
+        throw (TraceException("Block too large for lz4"));
+      }
+      return LZ4_compressBound(len);
+#endif
+    default:
+      return len;
+    }
+  }
+
+  uint64_t compress_block(block_codec codec,
+                          const uint8_t *src, uint64_t len,
+                          uint8_t *dst, uint64_t dst_len) {
+    /* Only used by the codecs, which may all be missing. */
+    (void) dst_len;
+    switch (codec) {
+#ifdef TRACE_ZSTD
+    case block_codec_zstd: {
+      size_t r = ZSTD_compress(dst, dst_len, src, len, default_zstd_level);
+      if (ZSTD_isError(r)) {
+        throw (TraceException(std::string("Unable to compress block: ") + ZSTD_getErrorName(r)));
+      }
+      return r;
+    }
+#endif
+#ifdef TRACE_LZ4
+    case block_codec_lz4: {
+      int r = LZ4_compress_default((const char *)src, (char *)dst, len, dst_len);
+      if (r <= 0) {
+        throw (TraceException("Unable to compress block"));
+      }
+      return r;
+    }
+#endif
+    default:
+      memcpy(dst, src, len);
+      return len;
+    }
+  }
+
+  void decompress_block(uint64_t codec,
+                        const uint8_t *src, uint64_t len,
+                        uint8_t *dst, uint64_t dst_len) {
+    /* Only used by the codecs, which may all be missing. */
+    (void) src;
+    (void) len;
+    (void) dst;
+    (void) dst_len;
+    switch (codec) {
+#ifdef TRACE_ZSTD
+    case block_codec_zstd: {
+      size_t r = ZSTD_decompress(dst, dst_len, src, len);
+      if (ZSTD_isError(r) || r != dst_len) {
+        throw (TraceException("Unable to decompress block"));
+      }
+      return;
+    }
+#endif
+#ifdef TRACE_LZ4
+    case block_codec_lz4: {
+      int r = LZ4_decompress_safe((const char *)src, (char *)dst, len, dst_len);
+      if (r < 0 || (uint64_t)r != dst_len) {
+        throw (TraceException("Unable to decompress block"));
+      }
+      return;
+    }
+#endif
+    default:
+      throw (TraceException("Trace block compressed with an unsupported codec " + std::to_string(codec)));
+    }
+  }
+};
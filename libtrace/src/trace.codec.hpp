@@ -0,0 +1,35 @@
+#ifndef TRACE_CODEC_HPP
+#define TRACE_CODEC_HPP
+
+/**
+ * Compression of the frame blocks of version 4 traces. Which codecs
+ * are available depends on the libraries found by configure.
+ */
+
+#include <stdint.h>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** Return true if blocks compressed with [codec] can be read and
+      written by this build. */
+  bool codec_supported(uint64_t codec);
+
+  /** Upper bound of the size of [len] bytes compressed with [codec]. */
+  uint64_t compress_bound(block_codec codec, uint64_t len);
+
+  /** Compress [len] bytes at [src] into [dst], which has room for
+      [dst_len] bytes, at least [compress_bound]. Returns the
+      compressed size. */
+  uint64_t compress_block(block_codec codec,
+                          const uint8_t *src, uint64_t len,
+                          uint8_t *dst, uint64_t dst_len);
+
+  /** Decompress [len] bytes at [src] into the [dst_len] bytes at
+      [dst], which must be exactly the size of the contents. */
+  void decompress_block(uint64_t codec,
+                        const uint8_t *src, uint64_t len,
+                        uint8_t *dst, uint64_t dst_len);
+};
+
+#endif
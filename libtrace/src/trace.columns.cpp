@@ -0,0 +1,238 @@
+/**
+ * Implementation of the columnar side index.
+ */
+
+#include "trace.columns.hpp"
+#include "trace.container.hpp"
+#include "trace.scan.hpp"
+#include <algorithm>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace SerializedTrace {
+
+  void frame_columns_of(const frame &f, uint64_t &pc, uint64_t &thread_id, frame_kind &kind) noexcept {
+    pc = 0;
+    thread_id = no_thread_id;
+    if (f.has_std_frame()) {
+      kind = frame_kind_std;
+      pc = f.std_frame().address();
+      thread_id = f.std_frame().thread_id();
+    } else if (f.has_syscall_frame()) {
+      kind = frame_kind_syscall;
+      pc = f.syscall_frame().address();
+      thread_id = f.syscall_frame().thread_id();
+    } else if (f.has_exception_frame()) {
+      kind = frame_kind_exception;
+      const exception_frame &e = f.exception_frame();
+      if (e.has_from_addr()) {
+        pc = e.from_addr();
+      }
+      if (e.has_thread_id()) {
+        thread_id = e.thread_id();
+      }
+    } else if (f.has_taint_intro_frame()) {
+      kind = frame_kind_taint_intro;
+    } else if (f.has_modload_frame()) {
+      kind = frame_kind_modload;
+    } else if (f.has_key_frame()) {
+      kind = frame_kind_key;
+    } else {
+      kind = frame_kind_unknown;
+    }
+  }
+
+  FrameColumns::FrameColumns(const std::string &filename, const IndexedTrace &expected)
+    : map (NULL)
+    , map_size (0)
+  {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open frame columns " + filename));
+    }
+
+    uint64_t header[columns_header_size / sizeof(uint64_t)];
+    if (fread(header, sizeof(header), 1, f) != 1) {
+      fclose(f);
+      throw (TraceException("Unable to read frame columns header"));
+    }
+    trace.trace_version = header[2];
+    trace.num_frames = header[3];
+    trace.toc_offset = header[4];
+    trace.trace_size = header[5];
+    if (header[0] != columns_magic_number || header[1] != columns_version ||
+        header[6] != column_chunk_frames || !(trace == expected)) {
+      fclose(f);
+      throw (TraceException("Frame columns " + filename + " do not match the trace"));
+    }
+
+    uint64_t num_chunks = (trace.num_frames + column_chunk_frames - 1) / column_chunk_frames;
+    uint64_t size = columns_header_size + num_chunks * column_chunk_size;
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size != size) {
+      fclose(f);
+      throw (TraceException("Frame columns " + filename + " are truncated"));
+    }
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    fclose(f);
+    if (addr == MAP_FAILED) {
+      throw (TraceException("Unable to map frame columns " + filename));
+    }
+    /* Scans read the columns from front to back. */
+    madvise(addr, size, MADV_SEQUENTIAL);
+    map = static_cast<const uint8_t *>(addr);
+    map_size = size;
+#else
+    owned.resize(size / sizeof(uint64_t));
+    memcpy(owned.data(), header, sizeof(header));
+    size_t read = fread(owned.data() + columns_header_size / sizeof(uint64_t), 1, size - columns_header_size, f);
+    fclose(f);
+    if (read != size - columns_header_size) {
+      throw (TraceException("Frame columns " + filename + " are truncated"));
+    }
+    map = reinterpret_cast<const uint8_t *>(owned.data());
+#endif
+  }
+
+  FrameColumns::~FrameColumns(void) noexcept {
+#ifndef _WIN32
+    if (map_size > 0) {
+      munmap(const_cast<uint8_t *>(map), map_size);
+    }
+#endif
+  }
+
+  void FrameColumns::scan(const column_filter &filter,
+                          std::vector<uint64_t> &frames,
+                          uint64_t first,
+                          uint64_t last) const {
+    last = std::min(last, trace.num_frames);
+    if (filter.pc_high <= filter.pc_low) {
+      return;
+    }
+    const uint64_t pc_span = filter.pc_high - filter.pc_low;
+    const uint64_t any_thread = filter.match_thread ? 0 : 1;
+    uint8_t matches[column_chunk_frames];
+
+    while (first < last) {
+      const uint64_t *pcs = chunk(first);
+      const uint64_t *tids = pcs + column_chunk_frames;
+      const uint8_t *kinds = reinterpret_cast<const uint8_t *>(tids + column_chunk_frames);
+      uint64_t base = first - first % column_chunk_frames;
+      uint64_t begin = first - base;
+      uint64_t end = std::min(last - base, column_chunk_frames);
+
+      /* Evaluate the filter without branches, so that the compiler
+         can vectorize the loop, then collect the matches. */
+      for (uint64_t i = begin; i < end; i++) {
+        uint64_t m = (pcs[i] - filter.pc_low) < pc_span;
+        m &= any_thread | (tids[i] == filter.thread_id);
+        m &= (filter.kinds >> kinds[i]) & 1;
+        matches[i] = m;
+      }
+      for (uint64_t i = begin; i < end; i++) {
+        if (matches[i]) {
+          frames.push_back(base + i);
+        }
+      }
+      first = base + end;
+    }
+  }
+
+  std::string FrameColumns::filename_for(const std::string &trace_filename) {
+    return trace_filename + ".cols";
+  }
+
+  FrameColumnsWriter::FrameColumnsWriter(const std::string &filename_in)
+    : filename (filename_in)
+    , tmp_filename (filename_in + ".tmp")
+    , num_frames (0)
+    , chunk (column_chunk_size / sizeof(uint64_t))
+  {
+    ofs = fopen(tmp_filename.c_str(), "wb");
+    if (!ofs) {
+      throw (TraceException("Unable to open frame columns " + tmp_filename + " for writing"));
+    }
+    /* The header is written by [finish]. */
+    uint8_t header[columns_header_size] = { 0 };
+    if (fwrite(header, sizeof(header), 1, ofs) != 1) {
+      throw (TraceException("Unable to write frame columns " + tmp_filename));
+    }
+  }
+
+  FrameColumnsWriter::~FrameColumnsWriter(void) noexcept {
+    if (ofs) {
+      fclose(ofs);
+      remove(tmp_filename.c_str());
+    }
+  }
+
+  void FrameColumnsWriter::add(uint64_t pc, uint64_t thread_id, frame_kind kind) {
+    uint64_t i = num_frames % column_chunk_frames;
+    chunk[i] = pc;
+    chunk[column_chunk_frames + i] = thread_id;
+    reinterpret_cast<uint8_t *>(chunk.data() + 2 * column_chunk_frames)[i] = kind;
+    num_frames++;
+    if (num_frames % column_chunk_frames == 0) {
+      write_chunk();
+    }
+  }
+
+  void FrameColumnsWriter::add(const frame &f) {
+    uint64_t pc, thread_id;
+    frame_kind kind;
+    frame_columns_of(f, pc, thread_id, kind);
+    add(pc, thread_id, kind);
+  }
+
+  void FrameColumnsWriter::add_raw(const uint8_t *data, uint64_t len) {
+    scanned_frame s;
+    if (!scan_frame(data, len, frame_fields_located, s)) {
+      throw (TraceException("Unable to scan frame"));
+    }
+    add(s.address, s.thread_id, s.kind);
+  }
+
+  void FrameColumnsWriter::write_chunk(void) {
+    if (fwrite(chunk.data(), column_chunk_size, 1, ofs) != 1) {
+      throw (TraceException("Unable to write frame columns " + tmp_filename));
+    }
+  }
+
+  void FrameColumnsWriter::finish(const IndexedTrace &trace) {
+    if (trace.num_frames != num_frames) {
+      throw (TraceException("Frame columns do not cover all frames"));
+    }
+    /* Pad the last chunk. */
+    uint64_t used = num_frames % column_chunk_frames;
+    if (used > 0) {
+      std::fill(chunk.begin() + used, chunk.begin() + column_chunk_frames, 0);
+      std::fill(chunk.begin() + column_chunk_frames + used, chunk.begin() + 2 * column_chunk_frames, 0);
+      uint8_t *kinds = reinterpret_cast<uint8_t *>(chunk.data() + 2 * column_chunk_frames);
+      std::fill(kinds + used, kinds + column_chunk_frames, 0);
+      write_chunk();
+    }
+
+    uint64_t header[columns_header_size / sizeof(uint64_t)] = {
+      columns_magic_number,
+      columns_version,
+      trace.trace_version,
+      trace.num_frames,
+      trace.toc_offset,
+      trace.trace_size,
+      column_chunk_frames,
+      0
+    };
+    bool ok = fseek(ofs, 0, SEEK_SET) == 0 && fwrite(header, sizeof(header), 1, ofs) == 1;
+    ok = (fclose(ofs) == 0) && ok;
+    ofs = NULL;
+    if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      remove(tmp_filename.c_str());
+      throw (TraceException("Unable to write frame columns " + filename));
+    }
+  }
+};
@@ -0,0 +1,192 @@
+#ifndef TRACE_COLUMNS_HPP
+#define TRACE_COLUMNS_HPP
+
+/**
+ * A columnar side index, stored next to a trace, that holds the
+ * program counter, the thread id and the kind of every frame. Queries
+ * that only need these fields scan the packed columns instead of
+ * decoding every frame, and then seek to the frames that match.
+ *
+ * The program counter is the address of standard and system call
+ * frames, and the source address of exception frames. Frames without
+ * one have program counter 0, and frames without a thread id have
+ * [no_thread_id].
+ *
+ * The format, all numbers in the byte order of the trace:
+ *
+ * [<uint64_t columns magic number>
+ *  <uint64_t columns version number>
+ *  <uint64_t trace version number>
+ *  <uint64_t n = number of trace frames>
+ *  <uint64_t offset of the trace toc>
+ *  <uint64_t size of the trace file>
+ *  <uint64_t c = number of frames per chunk>
+ *  <uint64_t 0>
+ *  [ <uint64_t program counter of frames 0 to c - 1>
+ *    <uint64_t thread id of frames 0 to c - 1>
+ *    <uint8_t frame_kind of frames 0 to c - 1> ]
+ *  ..............
+ *  [ the same for frames up to n - 1, padded to c frames ]]
+ *
+ * Grouping the columns in chunks lets the writer produce them while
+ * the trace is written, and keeps the scans over contiguous arrays.
+ * Like the frame index, the columns remember the trace they belong
+ * to, so stale columns are rejected.
+ */
+
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "frame.piqi.pb.h"
+#include "trace.index.hpp"
+#include "trace.toc.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t columns_magic_number = 0x736e6d756c6f632dLL;
+  const uint64_t columns_version = 1LL;
+  const uint64_t columns_header_size = 64LL;
+  const uint64_t column_chunk_frames = 4096LL;
+  const uint64_t column_chunk_size = column_chunk_frames * (2 * sizeof(uint64_t) + 1);
+
+  /** Thread id of frames that have none. */
+  const uint64_t no_thread_id = ~0ULL;
+
+  /** Return the program counter, thread id and kind of [f]. */
+  void frame_columns_of(const frame &f, uint64_t &pc, uint64_t &thread_id, frame_kind &kind) noexcept;
+
+  /** Selects frames by their columns. By default, all frames
+      match. */
+  struct column_filter {
+    /** Match program counters in [pc_low, pc_high). */
+    uint64_t pc_low;
+    uint64_t pc_high;
+
+    /** If [match_thread] is true, only match [thread_id]. */
+    bool match_thread;
+    uint64_t thread_id;
+
+    /** Mask of the frame kinds to match, bit [k] for kind [k]. */
+    uint32_t kinds;
+
+    column_filter(void)
+      : pc_low (0)
+      , pc_high (~0ULL)
+      , match_thread (false)
+      , thread_id (0)
+      , kinds ((1U << num_frame_kinds) - 1)
+    { }
+
+    /** Return true if a frame with these columns matches. */
+    bool matches(uint64_t pc, uint64_t tid, frame_kind kind) const noexcept {
+      return pc - pc_low < pc_high - pc_low
+        && (!match_thread || tid == thread_id)
+        && ((kinds >> kind) & 1);
+    }
+  };
+
+  class FrameColumns {
+
+  public:
+
+    /** Opens the columns in [filename]. Throws [TraceException] if
+        they can not be read or were not built for [trace]. */
+    FrameColumns(const std::string &filename, const IndexedTrace &trace);
+
+    ~FrameColumns(void) noexcept;
+
+    uint64_t get_num_frames(void) const noexcept { return trace.num_frames; }
+
+    uint64_t get_pc(uint64_t frame_number) const noexcept {
+      return chunk(frame_number)[frame_number % column_chunk_frames];
+    }
+
+    uint64_t get_thread_id(uint64_t frame_number) const noexcept {
+      return chunk(frame_number)[column_chunk_frames + frame_number % column_chunk_frames];
+    }
+
+    frame_kind get_kind(uint64_t frame_number) const noexcept {
+      const uint8_t *kinds = reinterpret_cast<const uint8_t *>(chunk(frame_number) + 2 * column_chunk_frames);
+      return (frame_kind) kinds[frame_number % column_chunk_frames];
+    }
+
+    /** Append the numbers of the frames in [first, last) that match
+        [filter] to [frames], in increasing order. */
+    void scan(const column_filter &filter,
+              std::vector<uint64_t> &frames,
+              uint64_t first = 0,
+              uint64_t last = ~0ULL) const;
+
+    /** Returns the name of the columns that belong to
+        [trace_filename]. */
+    static std::string filename_for(const std::string &trace_filename);
+
+  private:
+
+    IndexedTrace trace;
+
+    /** Mapped columns file, or its contents in [owned] where files
+        can not be mapped. */
+    const uint8_t *map;
+    uint64_t map_size;
+    std::vector<uint64_t> owned;
+
+    /** Return the chunk holding [frame_number]. */
+    const uint64_t *chunk(uint64_t frame_number) const noexcept {
+      return reinterpret_cast<const uint64_t *>(map + columns_header_size + (frame_number / column_chunk_frames) * column_chunk_size);
+    }
+
+    FrameColumns(const FrameColumns &) = delete;
+    FrameColumns &operator=(const FrameColumns &) = delete;
+  };
+
+  /** Writes the columns of a trace, one frame after the other. */
+  class FrameColumnsWriter {
+
+  public:
+
+    /** Creates a writer for the columns in [filename]. They are
+        written to a temporary file, that replaces [filename] in
+        [finish]. */
+    FrameColumnsWriter(const std::string &filename);
+
+    /** Removes the temporary file if the columns were not
+        finished. */
+    ~FrameColumnsWriter(void) noexcept;
+
+    /** Add the columns of the next frame. */
+    void add(uint64_t pc, uint64_t thread_id, frame_kind kind);
+
+    /** Add the columns of [f]. */
+    void add(const frame &f);
+
+    /** Add the columns of a frame serialized in the [len] bytes at
+        [data]. */
+    void add_raw(const uint8_t *data, uint64_t len);
+
+    /** Write the last chunk and the header, that records [trace],
+        and move the columns into place. */
+    void finish(const IndexedTrace &trace);
+
+  private:
+
+    std::string filename;
+    std::string tmp_filename;
+    FILE *ofs;
+
+    /** Number of frames added. */
+    uint64_t num_frames;
+
+    /** The chunk being filled, laid out as in the file. */
+    std::vector<uint64_t> chunk;
+
+    void write_chunk(void);
+
+    FrameColumnsWriter(const FrameColumnsWriter &) = delete;
+    FrameColumnsWriter &operator=(const FrameColumnsWriter &) = delete;
+  };
+};
+
+#endif
@@ -3,9 +3,17 @@
  */
 
 #include "trace.container.hpp"
+#include "trace.codec.hpp"
+#include <algorithm>
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 #include <string>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define WRITE(x) { if (fwrite(&(x), sizeof(x), 1, ofs) != 1) { throw (TraceException("Unable to write to trace")); } }
 #define READ(x) { if (fread(&(x), sizeof(x), 1, ifs) != 1) { throw (TraceException("Unable to read from trace")); } }
@@ -45,10 +53,38 @@ namespace SerializedTrace {
                                              const meta_frame& meta,
                                              frame_architecture arch,
                                              uint64_t machine,
-                                             uint64_t frames_per_toc_entry_in)
-    : num_frames (0)
+                                             uint64_t frames_per_toc_entry_in,
+                                             uint64_t buffer_size_in,
+                                             uint64_t trace_version_in,
+                                             block_codec codec_in)
+    : ofs(NULL)
+    , num_frames (0)
     , frames_per_toc_entry (frames_per_toc_entry_in)
-    , ofs(open_trace(filename,arch,machine,3LL)) {
+    , buffer_size (buffer_size_in)
+    , buf (buffer_size_in)
+    , buf_len (0)
+    , trace_version (trace_version_in)
+    , codec (codec_in)
+    , block_len (0)
+    , block_frames (0)
+    , filename (filename)
+    , summaries (NULL)
+    , key_interval (0)
+    , key_aligned (false)
+    , key_memory (false)
+    , frames_since_key (0) {
+    if (trace_version < lowest_supported_version ||
+        trace_version > highest_supported_version) {
+      throw (TraceException("Unsupported trace version"));
+    }
+    if (codec != block_codec_none && trace_version < blocked_trace_version) {
+      throw (TraceException("Only traces of version 4 and above can be compressed"));
+    }
+    if (!codec_supported(codec)) {
+      throw (TraceException("Block codec " + std::to_string(codec) + " is not supported by this build"));
+    }
+    ofs = open_trace(filename, arch, machine, trace_version);
+
     std::string meta_data;
     if (!(meta.SerializeToString(&meta_data))) {
       throw TraceException("Unable to serialize meta frame to ostream");
@@ -59,117 +95,489 @@ namespace SerializedTrace {
     if (fwrite(meta_data.c_str(), 1, meta_size, ofs) != meta_size) {
       throw (TraceException("Unable to write meta frame to trace file"));
     }
+    offset = meta_offset + meta_size;
   }
 
   void TraceContainerWriter::add(const frame &f) {
+    if (key_state) {
+      add_key_frame_if_due();
+    }
+    TRACE_STATS_ADD(stats.frames_serialized, 1);
+    if (trace_version >= encoded_trace_version) {
+      begin_encoding();
+      frame_kind kind;
+      {
+        TRACE_STATS_TIME(stats.serialize_time);
+        kind = encoder.encode(f, encoded);
+      }
+      add_encoded(kind);
+    } else {
+      uint64_t len = f.ByteSizeLong();
+      uint8_t *p = begin_frame(sizeof(len) + len);
+      memcpy(p, &len, sizeof(len));
+      {
+        TRACE_STATS_TIME(stats.serialize_time);
+        f.SerializeWithCachedSizesToArray(p + sizeof(len));
+      }
+      end_frame(serialized_frame_kind(p + sizeof(len), len));
+    }
+    describe_frame(f);
+  }
+
+  void TraceContainerWriter::add_raw(const uint8_t *data, uint64_t len) {
+    if (len == 0) {
+      throw (TraceException("Unable to add zero-length frame"));
+    }
+    if (key_state) {
+      add_key_frame_if_due();
+    }
+    if (trace_version >= encoded_trace_version) {
+      TRACE_STATS_ADD(stats.frames_serialized, 1);
+      begin_encoding();
+      frame_kind kind;
+      {
+        TRACE_STATS_TIME(stats.serialize_time);
+        kind = encoder.encode_raw(data, len, encoded);
+      }
+      add_encoded(kind);
+    } else {
+      uint8_t *p = begin_frame(sizeof(len) + len);
+      memcpy(p, &len, sizeof(len));
+      memcpy(p + sizeof(len), data, len);
+      end_frame(serialized_frame_kind(data, len));
+    }
+    if (summaries || key_state) {
+      if (!parsed.ParseFromArray(data, len)) {
+        throw (TraceException("Unable to parse from string"));
+      }
+      describe_frame(parsed);
+    } else if (columns) {
+      /* The columns only need a few fields. */
+      columns->add_raw(data, len);
+    }
+  }
+
+  void TraceContainerWriter::begin_encoding(void) {
+    /* Every block starts with empty dictionaries, the same condition
+       under which [begin_frame] starts a new block. */
+    if (num_frames % frames_per_toc_entry == 0) {
+      encoder.reset();
+    }
+    encoded.clear();
+  }
+
+  void TraceContainerWriter::add_encoded(frame_kind kind) {
+    uint8_t *p = begin_frame(encoded.size());
+    memcpy(p, encoded.data(), encoded.size());
+    end_frame(kind);
+  }
+
+  void TraceContainerWriter::describe_frame(const frame &f) {
+    if (columns) {
+      columns->add(f);
+    }
+    if (summaries) {
+      summary.add(f);
+    }
+    if (key_state) {
+      key_state->apply(f);
+      frames_since_key = f.has_key_frame() ? 0 : frames_since_key + 1;
+    }
+  }
+
+  void TraceContainerWriter::write_key_frames(uint64_t interval, bool align_to_toc,
+                                              bool with_memory) {
+    if (num_frames > 0) {
+      throw (TraceException("Key frames must be requested before the first frame"));
+    }
+    if (interval == 0) {
+      throw (TraceException("Key frames need a positive interval"));
+    }
+    key_state.reset(new MachineState);
+    key_interval = interval;
+    key_aligned = align_to_toc;
+    key_memory = with_memory;
+    frames_since_key = 0;
+  }
+
+  void TraceContainerWriter::add_key_frame_if_due(void) {
+    if (frames_since_key < key_interval ||
+        (key_aligned && num_frames % frames_per_toc_entry != 0)) {
+      return;
+    }
+    frame key;
+    key_state->to_key_frame(key, key_memory);
+    /* No other key frame is due while this one is added. */
+    frames_since_key = 0;
+    add(key);
+  }
+
+  void TraceContainerWriter::write_columns(void) {
+    if (num_frames > 0) {
+      throw (TraceException("Frame columns must be requested before the first frame"));
+    }
+    columns.reset(new FrameColumnsWriter(FrameColumns::filename_for(filename)));
+  }
+
+  void TraceContainerWriter::write_block_summaries(void) {
+    if (num_frames > 0) {
+      throw (TraceException("Block summaries must be requested before the first frame"));
+    }
+    if (trace_version < blocked_trace_version) {
+      throw (TraceException("Only traces of version 4 and above have block summaries"));
+    }
+    if (!summaries) {
+      summaries = tmpfile();
+      if (!summaries) {
+        throw (TraceException("Unable to create a temporary file for block summaries"));
+      }
+      summary.clear();
+    }
+  }
+
+  uint8_t *TraceContainerWriter::begin_frame(uint64_t len) {
     if (num_frames > 0 && (num_frames % frames_per_toc_entry) == 0) {
-      toc.push_back(TELL(ofs));
+      if (trace_version >= blocked_trace_version) {
+        emit_block();
+      }
+      toc.push_back(offset);
+    }
+    if (trace_version >= blocked_trace_version && block_frames == 0) {
+      toc_block b = { num_frames, offset, 0, { 0 } };
+      blocks.push_back(b);
     }
     num_frames++;
 
-    std::string s;
-    if (!(f.SerializeToString(&s))) {
-      throw (TraceException("Unable to serialize frame to ostream"));
+    if (trace_version < blocked_trace_version) {
+      return reserve(len);
+    }
+
+    if (block.size() < block_len + len) {
+      TRACE_STATS_ADD(stats.buffer_reallocations, 1);
+      block.resize(std::max<uint64_t>(block.size() * 2, block_len + len));
     }
-    uint64_t len = s.length();
-    WRITE(len);
-    if (fwrite(s.c_str(), 1, len, ofs) != len) {
+    uint8_t *p = block.data() + block_len;
+    block_len += len;
+    block_frames++;
+    return p;
+  }
+
+  void TraceContainerWriter::end_frame(frame_kind kind) {
+    if (trace_version >= blocked_trace_version) {
+      blocks.back().kind_counts[kind]++;
+    }
+    if (buf_len >= buffer_size) {
+      write_buffer();
+    }
+  }
+
+  void TraceContainerWriter::emit_block(void) {
+    if (block_frames == 0) {
+      return;
+    }
+    TRACE_STATS_ADD(stats.blocks, 1);
+
+    uint64_t bound = compress_bound(codec, block_len);
+    uint8_t *p = reserve(block_header_size + bound);
+    uint64_t stored;
+    {
+      TRACE_STATS_TIME(stats.block_time);
+      stored = compress_block(codec, block.data(), block_len,
+                              p + block_header_size, bound);
+    }
+    unreserve(bound - stored);
+
+    uint64_t header[block_header_size / sizeof(uint64_t)] = {
+      (uint64_t) codec,
+      block_frames,
+      block_len,
+      stored
+    };
+    memcpy(p, header, sizeof(header));
+    blocks.back().size = block_header_size + stored;
+
+    if (summaries) {
+      if (fwrite(&summary, sizeof(summary), 1, summaries) != 1) {
+        throw (TraceException("Unable to write block summary"));
+      }
+      summary.clear();
+    }
+
+    block_len = 0;
+    block_frames = 0;
+  }
+
+  void TraceContainerWriter::flush() {
+    write_buffer();
+    if (fflush(ofs) != 0) {
       throw (TraceException("Unable to write frame to trace file"));
     }
   }
 
+  void TraceContainerWriter::add_batch(const std::vector<frame> &frames) {
+    for (std::vector<frame>::const_iterator i = frames.begin(); i != frames.end(); ++i) {
+      add(*i);
+    }
+  }
+
+  bool TraceContainerWriter::can_add_block(void) const noexcept {
+    return trace_version >= blocked_trace_version
+      && num_frames % frames_per_toc_entry == 0
+      && !columns && !summaries && !key_state;
+  }
+
+  void TraceContainerWriter::add_block(const uint8_t *data, uint64_t len, const toc_block &record) {
+    if (!can_add_block()) {
+      throw (TraceException("Unable to add a whole block at frame " + std::to_string(num_frames)));
+    }
+    uint64_t header[block_header_size / sizeof(uint64_t)];
+    if (len < sizeof(header)) {
+      throw (TraceException("Truncated block"));
+    }
+    memcpy(header, data, sizeof(header));
+    if (header[1] != frames_per_toc_entry || header[3] != len - block_header_size ||
+        record.num_frames() != frames_per_toc_entry) {
+      throw (TraceException("Malformed block"));
+    }
+
+    /* Finish the current block, as [begin_frame] would. */
+    if (num_frames > 0) {
+      emit_block();
+      toc.push_back(offset);
+    }
+    toc_block b = record;
+    b.first_frame = num_frames;
+    b.offset = offset;
+    b.size = len;
+    blocks.push_back(b);
+    memcpy(reserve(len), data, len);
+    num_frames += frames_per_toc_entry;
+
+    if (buf_len >= buffer_size) {
+      write_buffer();
+    }
+  }
+
+  uint8_t *TraceContainerWriter::reserve(uint64_t len) {
+    if (buf_len + len > buf.size()) {
+      write_buffer();
+      if (len > buf.size()) {
+        TRACE_STATS_ADD(stats.buffer_reallocations, 1);
+        buf.resize(len);
+      }
+    }
+    uint8_t *p = buf.data() + buf_len;
+    buf_len += len;
+    offset += len;
+    return p;
+  }
+
+  void TraceContainerWriter::unreserve(uint64_t len) {
+    buf_len -= len;
+    offset -= len;
+  }
+
+  void TraceContainerWriter::write_buffer() {
+    if (buf_len > 0) {
+      TRACE_STATS_ADD(stats.bytes_written, buf_len);
+      TRACE_STATS_TIME(stats.io_time);
+      if (fwrite(buf.data(), 1, buf_len, ofs) != buf_len) {
+        throw (TraceException("Unable to write frame to trace file"));
+      }
+    }
+    buf_len = 0;
+  }
+
   void TraceContainerWriter::finish() {
-    uint64_t toc_offset = TELL(ofs);
+    emit_block();
+    write_buffer();
+    uint64_t toc_offset = offset;
     // if we have a positive offset, then the device is seekable, so
     // we will write the TOC, otherwise we will skip it.
-    if (toc_offset > 0) {
-      assert ((num_frames - 1) / frames_per_toc_entry == toc.size());
-      WRITE(frames_per_toc_entry);
-      for (std::vector<uint64_t>::size_type i = 0; i < toc.size(); i++) {
-        WRITE(toc[i]);
-      }
+    if (TELL(ofs) > 0) {
+      assert (num_frames == 0 ? toc.empty() : (num_frames - 1) / frames_per_toc_entry == toc.size());
+      // Update the header before the TOC is appended, so that a
+      // reader following the trace as it grows knows where the frames
+      // end by the time it sees the TOC.
       SEEK(ofs, num_trace_frames_offset);
       WRITE(num_frames);
       SEEK(ofs, toc_offset_offset);
       WRITE(toc_offset);
+      SEEK(ofs, toc_offset);
+      WRITE(frames_per_toc_entry);
+      for (std::vector<uint64_t>::size_type i = 0; i < toc.size(); i++) {
+        WRITE(toc[i]);
+      }
+      if (trace_version >= blocked_trace_version) {
+        write_block_table();
+      }
     }
 
+    IndexedTrace trace;
+    trace.trace_version = trace_version;
+    trace.num_frames = num_frames;
+    trace.toc_offset = toc_offset;
+    trace.trace_size = TELL(ofs);
+
     if (fclose(ofs) != 0) {
       throw TraceException("Error while closing the trace");
     }
     ofs = NULL;
+
+    if (columns) {
+      columns->finish(trace);
+      columns.reset();
+    }
+    if (summaries) {
+      fclose(summaries);
+      summaries = NULL;
+    }
   }
 
-  TraceContainerReader::TraceContainerReader(std::string filename)
-  {
-    ifs = fopen(filename.c_str(), "rb");
-    if (!ifs) { throw (TraceException("Unable to open trace for reading")); }
+  void TraceContainerWriter::write_block_table(void) {
+    std::vector<toc_block> groups = group_blocks(blocks);
+    const std::vector<toc_block> *sections[] = { &blocks, &groups };
+    const uint64_t tags[] = { toc_section_blocks, toc_section_groups };
 
-    /* Verify the magic number. */
-    uint64_t magic_number_read;
-    READ(magic_number_read);
-    if (magic_number_read != magic_number) {
-      throw (TraceException("Magic number not found in trace"));
+    for (int i = 0; i < 2; i++) {
+      uint64_t size = sections[i]->size() * sizeof(toc_block);
+      WRITE(tags[i]);
+      WRITE(size);
+      if (size > 0 && fwrite(sections[i]->data(), size, 1, ofs) != 1) {
+        throw (TraceException("Unable to write block table to trace"));
+      }
     }
 
-    READ(trace_version);
-    if (trace_version > highest_supported_version ||
-        trace_version < lowest_supported_version) {
-      throw (TraceException("Unsupported trace version"));
+    if (summaries) {
+      /* Copy the summaries over from the temporary file. */
+      uint64_t tag = toc_section_summaries;
+      uint64_t size = blocks.size() * sizeof(block_summary);
+      WRITE(tag);
+      WRITE(size);
+      rewind(summaries);
+      std::vector<uint8_t> copy(1 << 20);
+      while (size > 0) {
+        size_t len = std::min<uint64_t>(size, copy.size());
+        if (fread(copy.data(), 1, len, summaries) != len ||
+            fwrite(copy.data(), 1, len, ofs) != len) {
+          throw (TraceException("Unable to write block summaries to trace"));
+        }
+        size -= len;
+      }
     }
+  }
 
-    uint64_t archt;
-    READ(archt);
-    arch = (frame_architecture) archt;
-
-    READ(mach);
-
-    /* Read number of trace frames. */
-    READ(num_frames);
+  TraceContainerReader::TraceContainerReader(std::string filename_in)
+    : filename (filename_in)
+    , block_data (NULL)
+    , block_size (0)
+    , block_pos (0)
+  {
+    ifs = fopen(filename.c_str(), "rb");
+    if (!ifs) { throw (TraceException("Unable to open trace for reading")); }
 
-    /* Find offset of toc. */
-    uint64_t toc_offset;
-    READ(toc_offset);
+    /* Read the whole header at once. */
+    uint8_t header_data[meta_offset];
+    if (fread(header_data, sizeof(header_data), 1, ifs) != 1) {
+      throw (TraceException("Unable to read trace header"));
+    }
+    trace_header header = decode_trace_header(header_data);
+    trace_version = header.trace_version;
+    arch = header.arch;
+    mach = header.machine;
+    num_frames = header.num_frames;
+    toc_offset = header.toc_offset;
 
-    uint64_t meta_size;
-    READ(meta_size);
+    /* The meta frame is only read by [get_meta]. */
+    meta_size = header.meta_size;
+    meta_parsed = false;
     first_frame_offset = meta_offset + meta_size;
 
-    std::vector<uint8_t> meta_buf(meta_size);
-    if (fread(meta_buf.data(), 1, meta_buf.size(), ifs) != meta_buf.size()) {
-      throw (TraceException("Unable to read meta frame"));
-    }
-    if (!meta.ParseFromArray(meta_buf.data(), meta_buf.size())) {
-      throw (TraceException("Unable to parse meta frame"));
-    }
-
     /* Find the toc. */
     SEEK(ifs, toc_offset);
 
     /* Read number of frames per toc entry. */
     READ(frames_per_toc_entry);
+    if (frames_per_toc_entry == 0) {
+      throw(TraceException("The table of contents is malformed."));
+    }
 
-    size_t add = (num_frames % frames_per_toc_entry != 0) ? 1 : 0;
-    /* Read each toc entry. */
-    for (int i = 0; i < (num_frames / frames_per_toc_entry) + add; i++) {
-      uint64_t offset;
-      READ(offset);
-      toc.push_back(offset);
+    /* There is no toc entry for frames [0,m), so the writer emits
+       one entry for each of m, 2m, ..., up to the last frame. The
+       entries are read when a seek needs them. */
+    toc_entries = num_frames > 0 ? (num_frames - 1) / frames_per_toc_entry : 0;
+    uint64_t toc_end = toc_offset + sizeof(frames_per_toc_entry) + toc_entries * sizeof(uint64_t);
+
+    if (SEEKNAME(ifs, 0, SEEK_END) != 0) {
+      throw(TraceException("Unable to find the end of the trace"));
     }
+    trace_size = TELL(ifs);
 
-    /* We should be at the end of the file now. */
-    traceoff_t us = TELL(ifs);
-    traceoff_t end = SEEKNAME(ifs, 0, SEEK_END);
-    if (us != TELL(ifs) || end != 0) {
+    /* Version 4 traces continue with sections, older ones should end
+       with the toc. */
+    if (trace_version >= blocked_trace_version) {
+      read_sections(toc_end);
+    } else if (toc_end != trace_size) {
       throw(TraceException("The table of contents is malformed."));
     }
 
     /* Seek to the first frame. */
-    seek(0);
+    current_frame = 0;
+    position_valid = true;
+    seek_offset(first_frame_offset);
+  }
+
+  trace_header decode_trace_header(const uint8_t *data) {
+    uint64_t fields[meta_offset / sizeof(uint64_t)];
+    memcpy(fields, data, sizeof(fields));
+
+    if (fields[magic_number_offset / sizeof(uint64_t)] != magic_number) {
+      throw (TraceException("Magic number not found in trace"));
+    }
+    trace_header header;
+    header.trace_version = fields[trace_version_offset / sizeof(uint64_t)];
+    if (header.trace_version > highest_supported_version ||
+        header.trace_version < lowest_supported_version) {
+      throw (TraceException("Unsupported trace version"));
+    }
+    header.arch = (frame_architecture) fields[frame_arch_offset / sizeof(uint64_t)];
+    header.machine = fields[frame_machine_offset / sizeof(uint64_t)];
+    header.num_frames = fields[num_trace_frames_offset / sizeof(uint64_t)];
+    header.toc_offset = fields[toc_offset_offset / sizeof(uint64_t)];
+    header.meta_size = fields[meta_size_offset / sizeof(uint64_t)];
+    return header;
+  }
+
+  trace_header probe(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open trace for reading"));
+    }
+    uint8_t data[meta_offset];
+    bool ok = fread(data, sizeof(data), 1, f) == 1;
+    fclose(f);
+    if (!ok) {
+      throw (TraceException("Unable to read trace header"));
+    }
+    return decode_trace_header(data);
+  }
+
+  const meta_frame *TraceContainerReader::get_meta(void) const {
+    if (!meta_parsed) {
+      std::vector<uint8_t> meta_buf(meta_size);
+      read_at(meta_offset, meta_buf.data(), meta_buf.size());
+      if (!meta.ParseFromArray(meta_buf.data(), meta_buf.size())) {
+        throw (TraceException("Unable to parse meta frame"));
+      }
+      meta_parsed = true;
+    }
+    return &meta;
   }
 
   TraceContainerReader::~TraceContainerReader(void) noexcept {
-    /* Nothing yet. */
+    if (ifs) {
+      fclose(ifs);
+    }
   }
 
   uint64_t TraceContainerReader::get_num_frames(void) noexcept {
@@ -195,25 +603,39 @@ namespace SerializedTrace {
   void TraceContainerReader::seek(uint64_t frame_number) {
     /* First, make sure the frame is in range. */
     check_end_of_trace_num(frame_number, "seek() to non-existant frame");
+    TRACE_STATS_ADD(stats.seeks, 1);
+
+    if (index) {
+      current_frame = frame_number;
+      position_valid = true;
+      seek_offset(index->offset(frame_number));
+      return;
+    }
 
     /* Find the closest toc entry, if any. */
     uint64_t toc_number = frame_number / frames_per_toc_entry;
 
-    if (toc_number == 0) {
+    if (position_valid && frame_number >= current_frame &&
+        toc_number == current_frame / frames_per_toc_entry) {
+      /* Skip ahead from the frame pointer, which keeps the current
+         block of a version 4 trace. */
+    } else if (toc_number == 0) {
       current_frame = 0;
-      SEEK(ifs, first_frame_offset);
+      position_valid = true;
+      seek_offset(first_frame_offset);
+      reset_block();
     } else {
       current_frame = toc_number * frames_per_toc_entry;
+      position_valid = true;
       /* Use toc_number - 1 because there is no toc for frames [0,m). */
-      SEEK(ifs, toc[toc_number - 1]);
+      seek_offset(toc_entry(toc_number - 1));
+      reset_block();
     }
 
+    TRACE_STATS_ADD(stats.seek_skips, frame_number - current_frame);
     while (current_frame != frame_number) {
-      /* Read frame length and skip that far ahead. */
-      uint64_t frame_len;
-      READ(frame_len);
-      SEEK(ifs, (uint64_t)TELL(ifs) + frame_len);
-      current_frame++;
+      skip_frame_data();
+      advance_frame();
     }
   }
 
@@ -221,43 +643,218 @@ namespace SerializedTrace {
     /* Make sure we are in bounds. */
     check_end_of_trace("get_frame() on non-existant frame");
 
+    std::unique_ptr<frame> f(new frame);
+    next(*f);
+
+    return f;
+  }
+
+  std::unique_ptr<std::vector<frame> > TraceContainerReader::get_frames(uint64_t requested_frames) {
+    check_end_of_trace("get_frames() on non-existant frame");
+
+    std::unique_ptr<std::vector<frame> > frames(new std::vector<frame>);
+    frames->reserve(std::min(requested_frames, num_frames - current_frame));
+    for (uint64_t i = 0; i < requested_frames && current_frame < num_frames; i++) {
+      frames->emplace_back();
+      next(frames->back());
+    }
+
+    return frames;
+  }
+
+  bool TraceContainerReader::next(frame &into) {
+    if (end_of_trace()) {
+      return false;
+    }
+
     uint64_t frame_len;
-    READ(frame_len);
-    if (frame_len == 0) {
-      throw (TraceException("Read zero-length frame at offset " + std::to_string(TELL(ifs))));
+    const uint8_t *data = read_frame_data(frame_len);
+    {
+      TRACE_STATS_TIME(stats.parse_time);
+      if (!(into.ParseFromArray(data, frame_len))) {
+        throw (TraceException("Unable to parse from string"));
+      }
     }
+    TRACE_STATS_ADD(stats.frames_parsed, 1);
+    advance_frame();
 
-    std::vector<uint8_t> buf(frame_len);
+    return true;
+  }
 
-    /* Read the frame into buf. */
-    if (fread(buf.data(), 1, frame_len, ifs) != frame_len) {
-      throw (TraceException("Unable to read frame from trace"));
+  bool TraceContainerReader::next(frame &into, uint32_t fields) {
+    if (end_of_trace()) {
+      return false;
     }
 
-    std::unique_ptr<frame> f(new frame);
-    if (!(f->ParseFromArray(buf.data(), buf.size()))) {
-      throw (TraceException("Unable to parse from string"));
+    uint64_t frame_len;
+    const uint8_t *data = read_frame_data(frame_len);
+    {
+      TRACE_STATS_TIME(stats.parse_time);
+      parse_frame_fields(data, frame_len, fields, into);
     }
-    current_frame++;
+    TRACE_STATS_ADD(stats.frames_parsed, 1);
+    advance_frame();
 
-    return f;
+    return true;
   }
 
-  std::unique_ptr<std::vector<frame> > TraceContainerReader::get_frames(uint64_t requested_frames) {
+  bool TraceContainerReader::next_scanned(scanned_frame &into, uint32_t fields) {
+    if (end_of_trace()) {
+      return false;
+    }
+
+    uint64_t frame_len;
+    const uint8_t *data = read_frame_data(frame_len);
+    if (!scan_frame(data, frame_len, fields, into)) {
+      throw (TraceException("Unable to scan frame " + std::to_string(current_frame)));
+    }
+    advance_frame();
+
+    return true;
+  }
+
+  void TraceContainerReader::for_each_frame(const std::function<bool(const frame &)> &visit) {
+    frame f;
+    while (next(f)) {
+      if (!visit(f)) {
+        break;
+      }
+    }
+  }
+
+  uint64_t TraceContainerReader::get_frames(uint64_t requested_frames,
+                                            google::protobuf::Arena &arena,
+                                            std::vector<frame *> &frames) {
     check_end_of_trace("get_frames() on non-existant frame");
 
-    std::unique_ptr<std::vector<frame> > frames(new std::vector<frame>);
+    frames.clear();
     for (uint64_t i = 0; i < requested_frames && current_frame < num_frames; i++) {
-      frames->push_back(*(get_frame()));
+      frame *f = google::protobuf::Arena::CreateMessage<frame>(&arena);
+      next(*f);
+      frames.push_back(f);
     }
 
-    return frames;
+    return frames.size();
+  }
+
+  uint64_t TraceContainerReader::get_frames(uint64_t requested_frames,
+                                            FlatArena &arena,
+                                            std::vector<FlatFrame> &frames) {
+    check_end_of_trace("get_frames() on non-existant frame");
+
+    arena.reset();
+    frames.clear();
+    for (uint64_t i = 0; i < requested_frames && current_frame < num_frames; i++) {
+      uint64_t frame_len;
+      const uint8_t *data = read_frame_data(frame_len);
+      frames.emplace_back();
+      {
+        TRACE_STATS_TIME(stats.parse_time);
+        if (!decode_flat_frame(data, frame_len, arena, frames.back())) {
+          throw (TraceException("Unable to decode frame " + std::to_string(current_frame)));
+        }
+      }
+      TRACE_STATS_ADD(stats.frames_parsed, 1);
+      advance_frame();
+    }
+
+    return frames.size();
+  }
+
+  const uint8_t *TraceContainerReader::next_raw(uint64_t &len) {
+    if (end_of_trace()) {
+      return NULL;
+    }
+    const uint8_t *data = read_frame_data(len);
+    advance_frame();
+    return data;
+  }
+
+  void TraceContainerReader::read_block(uint64_t block_number, std::vector<uint8_t> &data) {
+    check_end_of_trace_num(block_number * frames_per_toc_entry, "read_block() of non-existant block");
+
+    /* There is no toc entry for the first block. */
+    uint64_t offset = block_number == 0 ? first_frame_offset : toc_entry(block_number - 1);
+    if (!blocked()) {
+      /* The frames end at the next toc entry, or at the toc. */
+      uint64_t end = block_number < toc_entries ? toc_entry(block_number) : toc_offset;
+      if (end < offset || end > trace_size) {
+        throw (TraceException("The table of contents is malformed."));
+      }
+      data.resize(end - offset);
+      read_at(offset, data.data(), data.size());
+      return;
+    }
+    uint64_t header[block_header_size / sizeof(uint64_t)];
+    read_at(offset, header, sizeof(header));
+    if (header[3] > trace_size - offset - sizeof(header)) {
+      throw (TraceException("Block " + std::to_string(block_number) + " extends past the end of the trace"));
+    }
+    data.resize(sizeof(header) + header[3]);
+    read_at(offset, data.data(), data.size());
+  }
+
+  block_codec TraceContainerReader::get_block_codec(void) const {
+    uint64_t codec = block_codec_none;
+    if (blocked() && num_frames > 0) {
+      read_at(first_frame_offset, &codec, sizeof(codec));
+    }
+    return (block_codec) codec;
   }
 
   bool TraceContainerReader::end_of_trace(void) noexcept {
     return end_of_trace_num(current_frame);
   }
 
+  bool TraceContainerReader::find_key_frame(uint64_t frame_number, uint64_t &key) {
+    if (frame_number > num_frames) {
+      throw (TraceException("find_key_frame() past the end of the trace"));
+    }
+    /* Look at the toc entries from the one of the frame before
+       [frame_number] back to the first. */
+    scanned_frame s;
+    for (uint64_t entry = (frame_number + frames_per_toc_entry - 1) / frames_per_toc_entry;
+         entry-- > 0; ) {
+      if (block_table && block_table->get_block(entry).kind_counts[frame_kind_key] == 0) {
+        continue;
+      }
+      uint64_t first = entry * frames_per_toc_entry;
+      uint64_t end = std::min(first + frames_per_toc_entry, frame_number);
+      bool found = false;
+      seek(first);
+      for (uint64_t i = first; i < end; i++) {
+        next_scanned(s, 0);
+        if (s.kind == frame_kind_key) {
+          key = i;
+          found = true;
+        }
+      }
+      if (found) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint64_t TraceContainerReader::reconstruct_state(uint64_t frame_number, MachineState &state) {
+    uint64_t start;
+    if (!find_key_frame(frame_number, start)) {
+      start = 0;
+    }
+    state.clear();
+    if (start < frame_number) {
+      seek(start);
+      frame f;
+      while (current_frame < frame_number) {
+        next(f);
+        state.apply(f);
+      }
+    } else if (frame_number < num_frames) {
+      seek(frame_number);
+    }
+    return start;
+  }
+
   bool TraceContainerReader::end_of_trace_num(uint64_t frame_num) noexcept {
     if (frame_num + 1 > num_frames) {
       return true;
@@ -275,4 +872,347 @@ namespace SerializedTrace {
     void TraceContainerReader::check_end_of_trace(std::string msg) {
       return check_end_of_trace_num(current_frame, msg);
     }
+
+  bool TraceContainerReader::use_frame_index(bool save) {
+    if (blocked()) {
+      return false;
+    }
+
+    std::string index_file = FrameIndex::filename_for(filename);
+    try {
+      index.reset(new FrameIndex(index_file, indexed_trace()));
+      return true;
+    } catch (TraceException &) {
+      /* Missing or stale, build a new one. */
+    }
+
+    uint64_t frame_number = current_frame;
+    std::unique_ptr<FrameIndex> built = build_frame_index();
+    if (save) {
+      try {
+        built->save(index_file);
+      } catch (TraceException &) {
+        /* The directory may be read-only, the index still works
+           from memory. */
+      }
+    }
+    index = std::move(built);
+    if (!end_of_trace_num(frame_number)) {
+      seek(frame_number);
+    }
+    return true;
+  }
+
+  std::unique_ptr<FrameIndex> TraceContainerReader::build_frame_index(void) {
+    if (blocked()) {
+      throw (TraceException("Frame indices are not supported for blocked traces"));
+    }
+
+    std::vector<uint64_t> offsets;
+    offsets.reserve(num_frames);
+
+    current_frame = 0;
+    position_valid = true;
+    seek_offset(first_frame_offset);
+    while (current_frame < num_frames) {
+      offsets.push_back(tell_offset());
+      skip_frame_data();
+      advance_frame();
+    }
+
+    return std::unique_ptr<FrameIndex>(new FrameIndex(indexed_trace(), std::move(offsets)));
+  }
+
+  IndexedTrace TraceContainerReader::indexed_trace(void) const noexcept {
+    IndexedTrace t;
+    t.trace_version = trace_version;
+    t.num_frames = num_frames;
+    t.toc_offset = toc_offset;
+    t.trace_size = trace_size;
+    return t;
+  }
+
+  void TraceContainerReader::seek_offset(uint64_t offset) {
+    SEEK(ifs, offset);
+  }
+
+  const uint8_t *TraceContainerReader::read_data(uint64_t len) {
+    if (read_buf.size() < len) {
+      TRACE_STATS_ADD(stats.buffer_reallocations, 1);
+      read_buf.resize(len);
+    }
+    if (len > 0) {
+      TRACE_STATS_ADD(stats.bytes_read, len);
+      TRACE_STATS_TIME(stats.io_time);
+      if (fread(read_buf.data(), 1, len, ifs) != len) {
+        throw (TraceException("Unable to read from trace"));
+      }
+    }
+    return read_buf.data();
+  }
+
+  void TraceContainerReader::skip_data(uint64_t len) {
+    SEEK(ifs, (uint64_t)TELL(ifs) + len);
+  }
+
+  uint64_t TraceContainerReader::tell_offset(void) {
+    return TELL(ifs);
+  }
+
+  const uint8_t *TraceContainerReader::read_frame_data(uint64_t &frame_len) {
+    position_valid = false;
+    if (!blocked()) {
+      memcpy(&frame_len, read_data(sizeof(frame_len)), sizeof(frame_len));
+      if (frame_len == 0) {
+        throw (TraceException("Read zero-length frame at offset " + std::to_string(tell_offset())));
+      }
+      return read_data(frame_len);
+    }
+
+    if (block_pos == block_size) {
+      load_block();
+    }
+    if (block_size - block_pos < sizeof(frame_len)) {
+      throw (TraceException("Truncated frame in block"));
+    }
+    memcpy(&frame_len, block_data + block_pos, sizeof(frame_len));
+    block_pos += sizeof(frame_len);
+    if (frame_len == 0 || block_size - block_pos < frame_len) {
+      throw (TraceException("Malformed frame length in block"));
+    }
+    const uint8_t *data = block_data + block_pos;
+    block_pos += frame_len;
+    return data;
+  }
+
+  void TraceContainerReader::skip_frame_data(void) {
+    position_valid = false;
+    uint64_t frame_len;
+    if (blocked()) {
+      /* The block has to be decompressed anyway. */
+      read_frame_data(frame_len);
+    } else {
+      /* Read frame length and skip that far ahead. */
+      memcpy(&frame_len, read_data(sizeof(frame_len)), sizeof(frame_len));
+      skip_data(frame_len);
+    }
+  }
+
+  void TraceContainerReader::advance_frame(void) noexcept {
+    current_frame++;
+    position_valid = true;
+  }
+
+  uint64_t TraceContainerReader::toc_entry(uint64_t entry) {
+    uint64_t page_number = entry / toc_page_size;
+    std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator page = toc_pages.find(page_number);
+    if (page == toc_pages.end()) {
+      uint64_t first = page_number * toc_page_size;
+      std::vector<uint64_t> entries(std::min(toc_page_size, toc_entries - first));
+      read_at(toc_offset + sizeof(frames_per_toc_entry) + first * sizeof(uint64_t),
+              entries.data(), entries.size() * sizeof(uint64_t));
+      page = toc_pages.emplace(page_number, std::move(entries)).first;
+    }
+    return page->second[entry % toc_page_size];
+  }
+
+  void TraceContainerReader::read_sections(uint64_t offset) {
+    uint64_t blocks_offset = 0, blocks_size = 0;
+    uint64_t groups_offset = 0, groups_size = 0;
+    uint64_t summaries_offset = 0, summaries_size = 0;
+    bool found_blocks = false, found_groups = false;
+
+    while (offset < trace_size) {
+      uint64_t header[toc_section_header_size / sizeof(uint64_t)];
+      if (trace_size - offset < sizeof(header)) {
+        throw (TraceException("Truncated section after the table of contents"));
+      }
+      read_at(offset, header, sizeof(header));
+      offset += sizeof(header);
+      if (header[1] > trace_size - offset) {
+        throw (TraceException("Truncated section after the table of contents"));
+      }
+      if (header[0] == toc_section_blocks) {
+        found_blocks = true;
+        blocks_offset = offset;
+        blocks_size = header[1];
+      } else if (header[0] == toc_section_groups) {
+        found_groups = true;
+        groups_offset = offset;
+        groups_size = header[1];
+      } else if (header[0] == toc_section_summaries) {
+        summaries_offset = offset;
+        summaries_size = header[1];
+      }
+      offset += header[1];
+    }
+    if (offset != trace_size) {
+      throw(TraceException("The table of contents is malformed."));
+    }
+
+    if (found_blocks && found_groups) {
+      uint64_t num_blocks = blocks_size / sizeof(toc_block);
+      if (blocks_size % sizeof(toc_block) != 0 || groups_size % sizeof(toc_block) != 0 ||
+          num_blocks != (num_frames + frames_per_toc_entry - 1) / frames_per_toc_entry) {
+        throw (TraceException("The block table does not match the trace"));
+      }
+      block_table.reset(new BlockTable([this](uint64_t at, void *dst, uint64_t len) { read_at(at, dst, len); },
+                                       blocks_offset, num_blocks,
+                                       groups_offset, groups_size / sizeof(toc_block)));
+      if (summaries_offset != 0) {
+        if (summaries_size != num_blocks * sizeof(block_summary)) {
+          throw (TraceException("The block summaries do not match the trace"));
+        }
+        block_table->set_summaries(summaries_offset);
+      }
+    }
+  }
+
+  void TraceContainerReader::read_at(uint64_t offset, void *dst, uint64_t len) const {
+    TRACE_STATS_ADD(stats.bytes_read, len);
+    TRACE_STATS_TIME(stats.io_time);
+#ifndef _WIN32
+    /* pread leaves the stream position alone. */
+    uint8_t *p = static_cast<uint8_t *>(dst);
+    while (len > 0) {
+      ssize_t n = pread(fileno(ifs), p, len, offset);
+      if (n <= 0) {
+        throw (TraceException("Unable to read from trace at offset " + std::to_string(offset)));
+      }
+      p += n;
+      offset += n;
+      len -= n;
+    }
+#else
+    traceoff_t pos = TELL(ifs);
+    SEEK(ifs, offset);
+    if (fread(dst, 1, len, ifs) != len) {
+      throw (TraceException("Unable to read from trace at offset " + std::to_string(offset)));
+    }
+    SEEK(ifs, pos);
+#endif
+  }
+
+  void TraceContainerReader::load_block(void) {
+    uint64_t header[block_header_size / sizeof(uint64_t)];
+    memcpy(header, read_data(sizeof(header)), sizeof(header));
+    uint64_t codec = header[0];
+    uint64_t block_frames = header[1];
+    uint64_t raw_size = header[2];
+    uint64_t stored_size = header[3];
+
+    const uint8_t *stored = read_data(stored_size);
+    TRACE_STATS_ADD(stats.blocks, 1);
+    TRACE_STATS_TIME(stats.block_time);
+    if (codec == block_codec_none) {
+      if (stored_size != raw_size) {
+        throw (TraceException("Malformed uncompressed block"));
+      }
+      /* Use the frames in place, this is free for mapped traces. */
+      block_data = stored;
+    } else {
+      if (block_buf.size() < raw_size) {
+        TRACE_STATS_ADD(stats.buffer_reallocations, 1);
+        block_buf.resize(raw_size);
+      }
+      decompress_block(codec, stored, stored_size, block_buf.data(), raw_size);
+      block_data = block_buf.data();
+    }
+    block_size = raw_size;
+    block_pos = 0;
+
+    if (trace_version >= encoded_trace_version) {
+      uint64_t decoded_capacity = decoded_buf.size();
+      block_size = decoder.decode_block(block_data, raw_size, block_frames, decoded_buf);
+      TRACE_STATS_ADD(stats.buffer_reallocations, decoded_buf.size() != decoded_capacity);
+      block_data = decoded_buf.data();
+    }
+  }
+
+  void TraceContainerReader::reset_block(void) noexcept {
+    block_data = NULL;
+    block_size = 0;
+    block_pos = 0;
+  }
+
+#ifndef _WIN32
+  MappedTraceReader::MappedTraceReader(std::string filename,
+                                       uint64_t readahead_in)
+    : TraceContainerReader(filename)
+    , map (NULL)
+    , map_size (0)
+    , pos (0)
+    , readahead (readahead_in)
+  {
+    struct stat st;
+    if (fstat(fileno(ifs), &st) != 0) {
+      throw (TraceException("Unable to stat trace"));
+    }
+    map_size = st.st_size;
+
+    void *addr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(ifs), 0);
+    if (addr == MAP_FAILED) {
+      throw (TraceException("Unable to map trace into memory"));
+    }
+    map = static_cast<const uint8_t *>(addr);
+    madvise(addr, map_size, MADV_SEQUENTIAL);
+
+    /* The descriptor is no longer needed, the mapping keeps the file
+       alive. */
+    fclose(ifs);
+    ifs = NULL;
+
+    seek_offset(first_frame_offset);
+  }
+
+  MappedTraceReader::~MappedTraceReader(void) noexcept {
+    if (map) {
+      munmap(const_cast<uint8_t *>(map), map_size);
+    }
+  }
+
+  void MappedTraceReader::seek_offset(uint64_t offset) {
+    if (offset > map_size) {
+      throw (TraceException("Unable to seek in trace to offset " + std::to_string(offset)));
+    }
+    pos = offset;
+
+    /* madvise wants a page aligned address. */
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+    uint64_t len = std::min(readahead + (offset - start), map_size - start);
+    if (len > 0) {
+      madvise(const_cast<uint8_t *>(map) + start, len, MADV_WILLNEED);
+    }
+  }
+
+  const uint8_t *MappedTraceReader::read_data(uint64_t len) {
+    if (map_size - pos < len) {
+      throw (TraceException("Unable to read " + std::to_string(len) + " bytes past the end of the trace at offset " + std::to_string(pos)));
+    }
+    const uint8_t *data = map + pos;
+    pos += len;
+    TRACE_STATS_ADD(stats.bytes_read, len);
+    return data;
+  }
+
+  void MappedTraceReader::skip_data(uint64_t len) {
+    if (map_size - pos < len) {
+      throw (TraceException("Unable to skip past the end of the trace at offset " + std::to_string(pos)));
+    }
+    pos += len;
+  }
+
+  uint64_t MappedTraceReader::tell_offset(void) {
+    return pos;
+  }
+
+  void MappedTraceReader::read_at(uint64_t offset, void *dst, uint64_t len) const {
+    if (offset > map_size || map_size - offset < len) {
+      throw (TraceException("Unable to read from trace at offset " + std::to_string(offset)));
+    }
+    TRACE_STATS_ADD(stats.bytes_read, len);
+    memcpy(dst, map + offset, len);
+  }
+#endif
 };
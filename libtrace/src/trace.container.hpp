@@ -37,23 +37,56 @@
  *    ...
  *    <uint64_t offset of sizeof(trace frame ceil(n/m))> ]]
  *
- *  One additional feature that might be nice is log_2(n) lookup
- *  time using a hierarchical toc.
+ * Since version 4, frames are grouped into blocks of m frames, the
+ * same frames that a table of contents entry covers, and every block
+ * is stored on its own, optionally compressed:
+ *
+ *  [ <uint64_t block codec>
+ *    <uint64_t number of frames in the block>
+ *    <uint64_t size of the block contents>
+ *    <uint64_t size of the block contents as stored>
+ *    <block contents, compressed with the block codec> ]
+ *
+ * The uncompressed contents of a block are the frames, each preceded
+ * by its size, just as above. The table of contents has the same
+ * layout, but its entries point to the block header of frames m, 2m,
+ * and so on, so that any block can be found and decompressed without
+ * touching the others. The table of contents of a version 4 trace is
+ * followed by a block table that summarizes every block, see
+ * trace.toc.hpp.
+ *
+ * Version 5 traces have the same layout as version 4 traces, but the
+ * frames in their blocks are dictionary and delta encoded, see
+ * trace.encoding.hpp.
+ *
+ * Readers load the entries of the table of contents page by page as
+ * seeks need them, so opening a trace does not depend on its size.
  */
 
 #include <exception>
+#include <functional>
 #include <memory>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <stdio.h>
 #include "frame.piqi.pb.h"
+#include "trace.index.hpp"
+#include "trace.columns.hpp"
+#include "trace.encoding.hpp"
+#include "trace.flat.hpp"
+#include "trace.keyframe.hpp"
+#include "trace.scan.hpp"
+#include "trace.stats.hpp"
+#include "trace.toc.hpp"
 
 namespace SerializedTrace {
 
   const uint64_t magic_number = 7456879624156307493LL;
 
   const uint64_t default_frames_per_toc_entry = 10000;
+  const uint64_t default_write_buffer_size = 4LL << 20;
   const frame_architecture default_arch = frame_arch_i386;
   const uint64_t default_machine = frame_mach_i386_i386;
 
@@ -67,7 +100,25 @@ namespace SerializedTrace {
   const uint64_t meta_offset = 56LL;
 
   const uint64_t lowest_supported_version = 2LL;
-  const uint64_t highest_supported_version = 3LL;
+  const uint64_t highest_supported_version = 5LL;
+
+  /** Version written by default, frames are not grouped in blocks. */
+  const uint64_t default_trace_version = 3LL;
+
+  /** First version that stores frames in blocks. */
+  const uint64_t blocked_trace_version = 4LL;
+
+  const uint64_t block_header_size = 32LL;
+
+  /** Compression of the frame blocks, since version 4. */
+  enum block_codec {
+    block_codec_none = 0,
+    block_codec_zstd = 1,
+    block_codec_lz4 = 2
+  };
+
+  /** Compression level used for zstd blocks. */
+  const int default_zstd_level = 3;
 
 
     class TraceException: public std::exception
@@ -96,16 +147,85 @@ namespace SerializedTrace {
 
     /** Creates a trace container writer that will output to
         [filename]. An entry will be added to the table of contents
-        every [frames_per_toc_entry] entries.*/
+        every [frames_per_toc_entry] entries. Frames are serialized
+        into an output buffer that is written to the file once it
+        holds [buffer_size] bytes; a zero [buffer_size] writes every
+        frame as soon as it is added. Traces of [trace_version] 4
+        store each toc entry worth of frames in a block compressed
+        with [codec]; older versions can not be compressed. Version 5
+        also encodes the frames of each block against each other. */
     TraceContainerWriter(const std::string& filename,
                          const meta_frame& meta,
                          frame_architecture arch = default_arch,
                          uint64_t machine = default_machine,
-                         uint64_t frames_per_toc_entry = default_frames_per_toc_entry);
+                         uint64_t frames_per_toc_entry = default_frames_per_toc_entry,
+                         uint64_t buffer_size = default_write_buffer_size,
+                         uint64_t trace_version = default_trace_version,
+                         block_codec codec = block_codec_none);
 
     /** Add [frame] to the trace. */
     void add(const frame &f);
 
+    /** Add a frame that is already serialized as the [len] bytes at
+        [data]. */
+    void add_raw(const uint8_t *data, uint64_t len);
+
+    /** Add all [frames] to the trace, in order. */
+    void add_batch(const std::vector<frame> &frames);
+
+    /** Return true if [add_block] can add a block now: the trace is
+        blocked, the frames added so far fill whole blocks, and
+        neither frame columns, block summaries nor key frames are
+        written. */
+    bool can_add_block(void) const noexcept;
+
+    /** Add a whole block of [frames_per_toc_entry] frames, stored as
+        the [len] bytes at [data], header included, as read by
+        [TraceContainerReader::read_block] from a trace with the same
+        encoding. The block is written as it is, without
+        decompressing it. [record] gives the number of frames of each
+        kind; its other fields are ignored. */
+    void add_block(const uint8_t *data, uint64_t len, const toc_block &record);
+
+    /** Returns the number of frames added so far. */
+    uint64_t get_num_frames(void) const noexcept { return num_frames; }
+
+    /** Returns the number of frames per toc entry. */
+    uint64_t get_frames_per_toc_entry(void) const noexcept { return frames_per_toc_entry; }
+
+    /** Returns the version of the trace being written. */
+    uint64_t get_trace_version(void) const noexcept { return trace_version; }
+
+    /** Returns the statistics of the writer, which are all zero
+        unless [stats_enabled]. */
+    const trace_stats &get_stats(void) const noexcept { return stats; }
+
+    /** Also write the frame columns of the trace, to
+        [FrameColumns::filename_for] the trace, when it is
+        finished. Must be called before the first frame is added. */
+    void write_columns(void);
+
+    /** Also write a summary of every block of a version 4 trace, that
+        lets queries skip blocks. Must be called before the first frame
+        is added. */
+    void write_block_summaries(void);
+
+    /** Also add a key frame with the machine state, see
+        trace.keyframe.hpp, once [interval] frames were added since
+        the last one. If [align_to_toc] is true, a key frame that
+        falls due waits for the next toc entry, so that it is the
+        first frame of its block. The memory seen so far is part of
+        every key frame only if [with_memory] is true. Key frames
+        count as frames of the trace. Must be called before the first
+        frame is added. */
+    void write_key_frames(uint64_t interval, bool align_to_toc = false,
+                          bool with_memory = true);
+
+    /** Write out the buffered frames and flush the file, so that
+        readers following the trace see them. Frames of a version 4
+        trace become visible when their block is complete. */
+    void flush();
+
     // closes the trace and underlying file stream. If the stream is
     // seekable, the output a table of contents and update the header
     // with an offset to the TOC.
@@ -129,8 +249,123 @@ namespace SerializedTrace {
     /** Frames per toc entry. */
     const uint64_t frames_per_toc_entry;
 
+    /** Offset in the trace of the next byte to be added, including
+        the bytes that are still buffered. */
+    uint64_t offset;
+
+    /** Number of buffered bytes that triggers a write. */
+    const uint64_t buffer_size;
+
+    /** Output buffer, [buf_len] bytes of which are in use. */
+    std::vector<uint8_t> buf;
+    uint64_t buf_len;
+
+    /** Return a pointer to [len] bytes at the end of the output
+        buffer, flushing or growing it as needed. */
+    uint8_t *reserve(uint64_t len);
+
+    /** Give back the last [len] bytes of a [reserve]. */
+    void unreserve(uint64_t len);
+
+    /** Write the output buffer to the file. */
+    void write_buffer(void);
+
+    /** Version of the trace being written. */
+    const uint64_t trace_version;
+
+    /** Compression of the blocks of a version 4 trace. */
+    const block_codec codec;
+
+    /** Frames of the current block, [block_len] bytes of which are in
+        use, and their number. */
+    std::vector<uint8_t> block;
+    uint64_t block_len;
+    uint64_t block_frames;
+
+    /** Account for a new frame of [len] bytes, including its size,
+        and return where to store it. */
+    uint8_t *begin_frame(uint64_t len);
+
+    /** Finish a frame of [kind] started with [begin_frame]. */
+    void end_frame(frame_kind kind);
+
+    /** Write out the current block. */
+    void emit_block(void);
+
+    /** Records of the blocks of a version 4 trace. */
+    std::vector<toc_block> blocks;
+
+    /** Write the block table sections after the toc. */
+    void write_block_table(void);
+
+    /** Name of the trace file. */
+    const std::string filename;
+
+    /** Writer of the frame columns, if requested. */
+    std::unique_ptr<FrameColumnsWriter> columns;
+
+    /** Temporary file holding the summaries of the blocks written so
+        far, if requested, and the summary of the current block. */
+    FILE *summaries;
+    block_summary summary;
+
+    /** Frame reused to parse frames that are added serialized. */
+    frame parsed;
+
+    /** Encoder of the frames of a version 5 trace, and the encoding
+        of the frame being added. */
+    FrameEncoder encoder;
+    std::vector<uint8_t> encoded;
+
+    /** Prepare to encode the next frame into [encoded]. */
+    void begin_encoding(void);
+
+    /** Add the frame of [kind] that was encoded into [encoded]. */
+    void add_encoded(frame_kind kind);
+
+    /** Update the frame columns, block summary and machine state
+        with [f]. */
+    void describe_frame(const frame &f);
+
+    /** Machine state of the frames added so far, if key frames are
+        written, and the settings of [write_key_frames]. */
+    std::unique_ptr<MachineState> key_state;
+    uint64_t key_interval;
+    bool key_aligned;
+    bool key_memory;
+
+    /** Number of frames added since the last key frame. */
+    uint64_t frames_since_key;
+
+    /** Add a key frame if one is due before the next frame. */
+    void add_key_frame_if_due(void);
+
+    /** Statistics of the writer. */
+    trace_stats stats;
+
+  };
+
+  /** The fields of a trace header. The number of frames and the
+      offset of the toc are 0 until the writer has finished. */
+  struct trace_header {
+    uint64_t trace_version;
+    frame_architecture arch;
+    uint64_t machine;
+    uint64_t num_frames;
+    uint64_t toc_offset;
+    uint64_t meta_size;
   };
 
+  /** Decode the [meta_offset] bytes of a trace header at [data].
+      Throws [TraceException] if they are not the header of a trace
+      version this library can read. */
+  trace_header decode_trace_header(const uint8_t *data);
+
+  /** Read and check only the header of the trace in [filename], to
+      learn its version, architecture, and number of frames without
+      opening it with a reader. */
+  trace_header probe(const std::string &filename);
+
   class TraceContainerReader {
 
   public:
@@ -139,7 +374,7 @@ namespace SerializedTrace {
     TraceContainerReader(std::string filename);
 
     /** Destructor. */
-    ~TraceContainerReader(void) noexcept;
+    virtual ~TraceContainerReader(void) noexcept;
 
     /** Returns the number of frames in the trace. */
     uint64_t get_num_frames(void) noexcept;
@@ -156,6 +391,9 @@ namespace SerializedTrace {
     /** Returns trace version. */
     uint64_t get_trace_version(void) noexcept;
 
+    /** Returns the name of the trace file. */
+    const std::string &get_filename(void) const noexcept { return filename; }
+
     /** Seek to frame number [frame_number]. The frame is numbered
      * 0. */
     void seek(uint64_t frame_number);;
@@ -172,17 +410,121 @@ namespace SerializedTrace {
         frame pointer will point to an invalid frame. */
     std::unique_ptr<std::vector<frame> > get_frames(uint64_t num_frames);
 
+    /** Parse the frame pointed to by the frame pointer into [into],
+        reusing the storage [into] already owns, and advance the frame
+        pointer by one. Returns false, leaving [into] untouched, if
+        the frame pointer is at the end of the trace. */
+    bool next(frame &into);
+
+    /** Like [next], but only parse the [fields], a mask of
+        [frame_field]s, of standard frames, as [parse_frame_fields]
+        does. */
+    bool next(frame &into, uint32_t fields);
+
+    /** Scan the frame pointed to by the frame pointer for the
+        [fields], a mask of [frame_field]s, into [into], without
+        parsing it, and advance the frame pointer by one. The pointers
+        of [into] are valid until the frame pointer moves again.
+        Returns false at the end of the trace. */
+    bool next_scanned(scanned_frame &into, uint32_t fields);
+
+    /** Call [visit] on every frame from the frame pointer to the end
+        of the trace, or until [visit] returns false. A single frame
+        object is reused for all calls, so [visit] must copy anything
+        it wants to keep. */
+    void for_each_frame(const std::function<bool(const frame &)> &visit);
+
+    /** Like [get_frames], but the frames are allocated on [arena] and
+        their pointers are stored in [frames], which is cleared
+        first. The frames live until the arena is reset or
+        destroyed. Returns the number of frames read. */
+    uint64_t get_frames(uint64_t num_frames,
+                        google::protobuf::Arena &arena,
+                        std::vector<frame *> &frames);
+
+    /** Like [get_frames], but the frames are decoded straight from
+        their serialized bytes into [FlatFrame]s, stored in [frames],
+        which is cleared first. [arena] is reset first and holds the
+        operands and bytes of the frames until it is reset again, so
+        one arena can serve every batch. Returns the number of frames
+        read. */
+    uint64_t get_frames(uint64_t num_frames,
+                        FlatArena &arena,
+                        std::vector<FlatFrame> &frames);
+
     /** Return true if frame pointer is at the end of the trace. */
     bool end_of_trace(void) noexcept;
 
-    const meta_frame *get_meta(void) const { return &meta; }
+    /** Find the last key frame before frame [frame_number] and store
+        its number in [key]. Returns false if there is none. Blocks
+        without key frames are skipped using the block table of
+        version 4 traces; other traces are scanned backwards one toc
+        entry at a time. Moves the frame pointer. */
+    bool find_key_frame(uint64_t frame_number, uint64_t &key);
+
+    /** Store in [state] the machine state just before frame
+        [frame_number], which may be the number of frames of the
+        trace, by replaying the frames from the last key frame before
+        it, or from the first frame if there is none. Returns the
+        number of the frame the replay started from. The frame pointer
+        is left at [frame_number]. */
+    uint64_t reconstruct_state(uint64_t frame_number, MachineState &state);
+
+    /** Return the serialized frame pointed to by the frame pointer
+        without parsing it, and store its size in [len], or return
+        NULL at the end of the trace. Advances the frame pointer by
+        one. The bytes are valid until the frame pointer moves
+        again. */
+    const uint8_t *next_raw(uint64_t &len);
+
+    /** Read block [block_number] of a version 4 trace as it is
+        stored, header included, into [data], without moving the
+        frame pointer. For older traces, read the frames of toc entry
+        [block_number] instead, each preceded by its size. */
+    void read_block(uint64_t block_number, std::vector<uint8_t> &data);
+
+    /** Returns the codec of the first block of a version 4 trace,
+        [block_codec_none] for older traces. */
+    block_codec get_block_codec(void) const;
+
+    /** Make [seek] jump directly to frames using a dense frame
+        index. The index is read from the file next to the trace. If
+        there is none or it is stale, it is built by scanning the
+        trace and, if [save] is true, stored for later readers. The
+        frame pointer is preserved. Returns false, and does nothing,
+        for version 4 traces, where seeks only skip frames of a
+        decompressed block. */
+    bool use_frame_index(bool save = true);
+
+    /** Scan the trace and return the offset of every frame. The
+        frame pointer is left at the end of the trace. Not available
+        for version 4 traces. */
+    std::unique_ptr<FrameIndex> build_frame_index(void);
+
+    /** Return the meta frame, which is read and parsed by the first
+        call. */
+    const meta_frame *get_meta(void) const;
+
+    /** Return the block table of a version 4 trace, or NULL if the
+        trace has none. */
+    BlockTable *get_block_table(void) noexcept { return block_table.get(); }
+
+    /** Describe this trace for a frame index or frame columns. */
+    IndexedTrace indexed_trace(void) const noexcept;
+
+    /** Returns the statistics of the reader, which are all zero
+        unless [stats_enabled]. */
+    const trace_stats &get_stats(void) const noexcept { return stats; }
 
   protected:
+    /** Name of the trace file. */
+    std::string filename;
+
     /** File to read trace from. */
     FILE *ifs;
 
-    /** The toc entries from the trace. */
-    std::vector<uint64_t> toc;
+    /** Number of toc entries in the trace. */
+    uint64_t toc_entries;
 
     /** Trace version. */
     uint64_t trace_version;
@@ -196,17 +538,38 @@ namespace SerializedTrace {
     /** Base address in file where frames begin */
     uint64_t first_frame_offset;
 
+    /** Offset of the toc. */
+    uint64_t toc_offset;
+
+    /** Size of the trace file. */
+    uint64_t trace_size;
+
+    /** Dense frame index, if in use. */
+    std::unique_ptr<FrameIndex> index;
+
     /** CPU architecture. */
     frame_architecture arch;
 
     /** Machine type. */
     uint64_t mach;
 
-    meta_frame meta;
+    /** Size of the meta frame, and the meta frame once it has been
+        parsed by [get_meta]. */
+    uint64_t meta_size;
+    mutable meta_frame meta;
+    mutable bool meta_parsed;
 
     /** Current frame number. */
     uint64_t current_frame;
 
+    /** False while the stream may be inside a frame, after a read
+        that did not reach [advance_frame]. [seek] then repositions
+        from the toc instead of skipping ahead. */
+    bool position_valid;
+
+    /** Statistics of the reader, updated by [read_at] as well. */
+    mutable trace_stats stats;
+
     /** Return true if [frame_num] is at the end of the trace. */
     bool end_of_trace_num(uint64_t frame_num) noexcept;
 
@@ -216,7 +579,133 @@ namespace SerializedTrace {
     /** Raise exception if frame pointer is at the end of the trace. */
     void check_end_of_trace(std::string msg);
 
+    /** Position the underlying stream at byte [offset] of the
+        trace. */
+    virtual void seek_offset(uint64_t offset);
+
+    /** Return a pointer to the next [len] bytes of the stream and
+        advance past them. The pointer is valid until the next
+        call. */
+    virtual const uint8_t *read_data(uint64_t len);
+
+    /** Advance the stream by [len] bytes. */
+    virtual void skip_data(uint64_t len);
+
+    /** Return the offset of the stream position. */
+    virtual uint64_t tell_offset(void);
+
+    /** Read [len] bytes at [offset] into [dst], without moving the
+        stream position. */
+    virtual void read_at(uint64_t offset, void *dst, uint64_t len) const;
+
+    /** Read the length of the next frame and return a pointer to its
+        [frame_len] serialized bytes. The pointer is valid until the
+        next call. */
+    const uint8_t *read_frame_data(uint64_t &frame_len);
+
+    /** Skip the next frame without parsing it. */
+    void skip_frame_data(void);
+
+    /** Count the frame just read or skipped. */
+    void advance_frame(void) noexcept;
+
+
+  private:
+    /** Scratch buffer reused by [read_data]. */
+    std::vector<uint8_t> read_buf;
+
+    /** Contents of the current block of a version 4 trace, either
+        pointing into the stream, into [block_buf] or, for version 5,
+        into [decoded_buf]. */
+    const uint8_t *block_data;
+    uint64_t block_size;
+
+    /** Offset of the next frame in [block_data]. */
+    uint64_t block_pos;
+
+    /** Decompressed contents of the current block. */
+    std::vector<uint8_t> block_buf;
+
+    /** Decoder of the blocks of a version 5 trace, and the decoded
+        contents of the current block. */
+    FrameDecoder decoder;
+    std::vector<uint8_t> decoded_buf;
+
+    /** Pages of toc entries read so far, by page number. */
+    std::unordered_map<uint64_t, std::vector<uint64_t> > toc_pages;
+
+    /** Block table of a version 4 trace, if any. */
+    std::unique_ptr<BlockTable> block_table;
+
+    /** Return toc entry [entry], reading its page if needed. */
+    uint64_t toc_entry(uint64_t entry);
+
+    /** Read the sections that start at [offset], after the toc. */
+    void read_sections(uint64_t offset);
+
+    /** Return true if the frames are grouped in blocks. */
+    bool blocked(void) const noexcept {
+      return trace_version >= blocked_trace_version;
+    }
+
+    /** Read and decompress the block at the stream position. */
+    void load_block(void);
+
+    /** Forget the current block after moving the stream. */
+    void reset_block(void) noexcept;
+
   };
+
+#ifndef _WIN32
+  /** Size of the region that is prefetched with [MADV_WILLNEED]
+      after each seek. */
+  const uint64_t default_mapped_readahead = 16LL << 20;
+
+  /** A trace reader that maps the whole trace into memory and parses
+   * frames directly out of the mapped region, instead of copying
+   * each frame through stdio. Provides the same interface as
+   * [TraceContainerReader]. */
+  class MappedTraceReader: public TraceContainerReader {
+
+  public:
+
+    /** Creates a trace reader that maps [filename]. [readahead]
+        bytes following the frame pointer are requested from the
+        kernel on every seek. */
+    MappedTraceReader(std::string filename,
+                      uint64_t readahead = default_mapped_readahead);
+
+    /** Unmaps the trace. */
+    ~MappedTraceReader(void) noexcept;
+
+  protected:
+
+    void seek_offset(uint64_t offset);
+
+    const uint8_t *read_data(uint64_t len);
+
+    void skip_data(uint64_t len);
+
+    uint64_t tell_offset(void);
+
+    void read_at(uint64_t offset, void *dst, uint64_t len) const;
+
+  private:
+
+    /** Start of the mapped trace. */
+    const uint8_t *map;
+
+    /** Size of the mapping, i.e., of the trace file. */
+    uint64_t map_size;
+
+    /** Offset of the stream position in the mapping. */
+    uint64_t pos;
+
+    /** Number of bytes to prefetch after a seek. */
+    const uint64_t readahead;
+
+  };
+#endif
 };
 
 #endif
@@ -0,0 +1,127 @@
+/**
+ * Implementation of trace slicing, splitting and merging.
+ */
+
+#include "trace.copy.hpp"
+#include <algorithm>
+#include <memory>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    /** Return a writer for [dst] that writes traces like the one of
+        [reader]. */
+    std::unique_ptr<TraceContainerWriter> writer_like(TraceContainerReader &reader,
+                                                      const std::string &dst) {
+      return std::unique_ptr<TraceContainerWriter>(
+        new TraceContainerWriter(dst, *reader.get_meta(), reader.get_arch(), reader.get_machine(),
+                                 reader.get_frames_per_toc_entry(), default_write_buffer_size,
+                                 reader.get_trace_version(), reader.get_block_codec()));
+    }
+
+    /** Return true if blocks of traces of [src_version] can be added
+        to traces of [dst_version] as they are. */
+    bool same_block_encoding(uint64_t src_version, uint64_t dst_version) noexcept {
+      return src_version >= blocked_trace_version && dst_version >= blocked_trace_version
+        && (src_version >= encoded_trace_version) == (dst_version >= encoded_trace_version);
+    }
+  }
+
+  uint64_t copy_frames(TraceContainerReader &reader,
+                       TraceContainerWriter &writer,
+                       uint64_t first,
+                       uint64_t last) {
+    last = std::min(last, reader.get_num_frames());
+    if (first >= last) {
+      return 0;
+    }
+
+    uint64_t m = reader.get_frames_per_toc_entry();
+    BlockTable *table = reader.get_block_table();
+    bool whole_blocks = table
+      && m == writer.get_frames_per_toc_entry()
+      && same_block_encoding(reader.get_trace_version(), writer.get_trace_version());
+
+    std::vector<uint8_t> stored;
+    bool positioned = false;
+    uint64_t i = first;
+    while (i < last) {
+      if (whole_blocks && i % m == 0 && last - i >= m && writer.can_add_block()) {
+        reader.read_block(i / m, stored);
+        writer.add_block(stored.data(), stored.size(), table->get_block(i / m));
+        i += m;
+        positioned = false;
+        continue;
+      }
+
+      if (!positioned) {
+        reader.seek(i);
+        positioned = true;
+      }
+      uint64_t len;
+      const uint8_t *data = reader.next_raw(len);
+      writer.add_raw(data, len);
+      i++;
+    }
+    return last - first;
+  }
+
+  uint64_t slice_trace(const std::string &src, const std::string &dst,
+                       uint64_t first, uint64_t last) {
+    TraceContainerReader reader(src);
+    std::unique_ptr<TraceContainerWriter> writer = writer_like(reader, dst);
+    uint64_t n = copy_frames(reader, *writer, first, last);
+    writer->finish();
+    return n;
+  }
+
+  std::vector<std::string> split_trace(const std::string &src,
+                                       const std::string &dst_prefix,
+                                       uint64_t num_shards) {
+    if (num_shards == 0) {
+      throw (TraceException("Unable to split a trace into zero shards"));
+    }
+    TraceContainerReader reader(src);
+    uint64_t n = reader.get_num_frames();
+    uint64_t shard_size = (n + num_shards - 1) / num_shards;
+    if (reader.get_trace_version() >= blocked_trace_version) {
+      uint64_t m = reader.get_frames_per_toc_entry();
+      shard_size = (shard_size + m - 1) / m * m;
+    }
+
+    std::vector<std::string> names;
+    for (uint64_t shard = 0; shard < num_shards; shard++) {
+      names.push_back(dst_prefix + "." + std::to_string(shard));
+      std::unique_ptr<TraceContainerWriter> writer = writer_like(reader, names.back());
+      uint64_t first = std::min(n, shard * shard_size);
+      copy_frames(reader, *writer, first, std::min(n, first + shard_size));
+      writer->finish();
+    }
+    return names;
+  }
+
+  uint64_t merge_traces(const std::vector<std::string> &srcs, const std::string &dst) {
+    if (srcs.empty()) {
+      throw (TraceException("No traces to merge"));
+    }
+    std::unique_ptr<TraceContainerWriter> writer;
+    frame_architecture arch = frame_arch_unknown;
+    uint64_t machine = 0;
+    uint64_t n = 0;
+
+    for (std::vector<std::string>::const_iterator src = srcs.begin(); src != srcs.end(); ++src) {
+      TraceContainerReader reader(*src);
+      if (!writer) {
+        writer = writer_like(reader, dst);
+        arch = reader.get_arch();
+        machine = reader.get_machine();
+      } else if (reader.get_arch() != arch || reader.get_machine() != machine) {
+        throw (TraceException("Unable to merge " + *src + ", its architecture differs from " + srcs.front()));
+      }
+      n += copy_frames(reader, *writer);
+    }
+    writer->finish();
+    return n;
+  }
+};
@@ -0,0 +1,55 @@
+#ifndef TRACE_COPY_HPP
+#define TRACE_COPY_HPP
+
+/**
+ * Slicing, splitting and merging of traces.
+ *
+ * Frames are moved as the serialized bytes the reader returns, and are
+ * only parsed when the destination needs their contents: a version 5
+ * trace encodes its standard frames, and frame columns and block
+ * summaries describe them. Where a range covers whole blocks of a
+ * blocked trace, and the destination has the same number of frames per
+ * toc entry and the same frame encoding, the blocks are copied as they
+ * are stored, without even decompressing them.
+ *
+ * The destination traces get a new table of contents and header, and
+ * the meta frame, architecture, machine, version, frames per toc entry
+ * and block codec of their source.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** Add frames [first, last) of [reader] to [writer]. Moves the frame
+      pointer of [reader]. Returns the number of frames added. */
+  uint64_t copy_frames(TraceContainerReader &reader,
+                       TraceContainerWriter &writer,
+                       uint64_t first = 0,
+                       uint64_t last = ~0ULL);
+
+  /** Write frames [first, last) of the trace in [src] to a new trace
+      in [dst]. Returns the number of frames written. */
+  uint64_t slice_trace(const std::string &src, const std::string &dst,
+                       uint64_t first, uint64_t last);
+
+  /** Split the trace in [src] into [num_shards] traces of consecutive
+      frames, named [dst_prefix] followed by ".0", ".1", and so on,
+      and return their names. Shards of a blocked trace start at block
+      boundaries, so that all blocks are copied whole; the last shards
+      of a small trace may be empty. */
+  std::vector<std::string> split_trace(const std::string &src,
+                                       const std::string &dst_prefix,
+                                       uint64_t num_shards);
+
+  /** Concatenate the traces in [srcs] into a new trace in [dst]. The
+      traces must have the same architecture and machine. The
+      destination is written like the first trace. Returns the number
+      of frames written. */
+  uint64_t merge_traces(const std::vector<std::string> &srcs, const std::string &dst);
+};
+
+#endif
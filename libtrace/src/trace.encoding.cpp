@@ -0,0 +1,464 @@
+/**
+ * Implementation of the frame encoding of version 5 traces.
+ */
+
+#include "trace.encoding.hpp"
+#include "trace.container.hpp"
+#include <algorithm>
+#include <string.h>
+#include <string>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    /** Keys of the length delimited fields of the frame schema, see
+        frame.piqi.proto. */
+    const uint8_t key_field_1 = (1 << 3) | 2;
+    const uint8_t key_field_2 = (2 << 3) | 2;
+    const uint8_t key_field_3 = (3 << 3) | 2;
+    const uint8_t key_field_4 = (4 << 3) | 2;
+    const uint8_t key_field_5 = (5 << 3) | 2;
+    const uint8_t key_field_6 = (6 << 3) | 2;
+
+    /** Keys of the varint fields. */
+    const uint8_t key_varint_1 = 1 << 3;
+    const uint8_t key_varint_2 = 2 << 3;
+    const uint8_t key_varint_3 = 3 << 3;
+    const uint8_t key_varint_4 = 4 << 3;
+
+    /** Size of a serialized operand usage, four booleans. */
+    const uint64_t usage_size = 8;
+
+    uint64_t zigzag(uint64_t v) noexcept {
+      return (v << 1) ^ (0 - (v >> 63));
+    }
+
+    uint64_t unzigzag(uint64_t v) noexcept {
+      return (v >> 1) ^ (0 - (v & 1));
+    }
+
+    /** The encoding of sint32 fields. */
+    uint32_t zigzag32(int32_t n) noexcept {
+      uint32_t v = n;
+      return (v << 1) ^ (0U - (v >> 31));
+    }
+
+    void put_varint(uint64_t v, std::vector<uint8_t> &out) {
+      while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+      }
+      out.push_back((uint8_t) v);
+    }
+
+    void put_bytes(const void *data, uint64_t len, std::vector<uint8_t> &out) {
+      const uint8_t *p = static_cast<const uint8_t *>(data);
+      out.insert(out.end(), p, p + len);
+    }
+
+    uint64_t varint_size(uint64_t v) noexcept {
+      uint64_t n = 1;
+      while (v >= 0x80) {
+        v >>= 7;
+        n++;
+      }
+      return n;
+    }
+
+    uint8_t *write_varint(uint8_t *p, uint64_t v) noexcept {
+      while (v >= 0x80) {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+      }
+      *p++ = (uint8_t) v;
+      return p;
+    }
+
+    /** Size of a length delimited field with [len] bytes of
+        contents. */
+    uint64_t field_size(uint64_t len) noexcept {
+      return 1 + varint_size(len) + len;
+    }
+
+    /** Write the key and length of a length delimited field. */
+    uint8_t *write_field(uint8_t *p, uint8_t key, uint64_t len) noexcept {
+      *p++ = key;
+      return write_varint(p, len);
+    }
+
+    uint8_t *write_bytes(uint8_t *p, uint8_t key, const uint8_t *data, uint64_t len) noexcept {
+      p = write_field(p, key, len);
+      memcpy(p, data, len);
+      return p + len;
+    }
+
+    /** Return true if every operand of [s] is either a memory or a
+        register operand, which the encoding requires. */
+    bool encodable(const std_frame &s) noexcept {
+      const operand_value_list *lists[] = { &s.operand_pre_list(), &s.operand_post_list() };
+      for (int l = 0; l < 2; l++) {
+        for (int i = 0; i < lists[l]->elem_size(); i++) {
+          const operand_info_specific &spec = lists[l]->elem(i).operand_info_specific();
+          if (spec.has_mem_operand() == spec.has_reg_operand()) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    /** Reads the encoded contents of a block. */
+    struct encoded_input {
+      const uint8_t *p;
+      const uint8_t *end;
+
+      uint64_t varint(void) {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+          if (p == end) {
+            break;
+          }
+          uint8_t b = *p++;
+          v |= (uint64_t) (b & 0x7f) << shift;
+          if (!(b & 0x80)) {
+            return v;
+          }
+        }
+        throw (TraceException("Malformed number in encoded block"));
+      }
+
+      const uint8_t *bytes(uint64_t len) {
+        if ((uint64_t) (end - p) < len) {
+          throw (TraceException("Truncated encoded block"));
+        }
+        const uint8_t *data = p;
+        p += len;
+        return data;
+      }
+
+      /** Read a dictionary number, adding the entry that follows it
+          if it is new. */
+      std::pair<const uint8_t *, uint64_t> entry(std::vector<std::pair<const uint8_t *, uint64_t> > &dictionary) {
+        uint64_t number = varint();
+        if (number == dictionary.size()) {
+          uint64_t len = varint();
+          dictionary.push_back(std::make_pair(bytes(len), len));
+        } else if (number > dictionary.size()) {
+          throw (TraceException("Undefined dictionary entry " + std::to_string(number) + " in encoded block"));
+        }
+        return dictionary[number];
+      }
+    };
+
+    /** Return [len] bytes at the end of the first [used] bytes of
+        [dst], growing it as needed. */
+    uint8_t *grow(std::vector<uint8_t> &dst, uint64_t &used, uint64_t len) {
+      if (dst.size() < used + len) {
+        dst.resize(std::max<uint64_t>(dst.size() * 2, used + len));
+      }
+      uint8_t *p = dst.data() + used;
+      used += len;
+      return p;
+    }
+  }
+
+  FrameEncoder::FrameEncoder(void)
+    : num_instructions (0)
+    , prev_address (0)
+    , prev_mem_address (0)
+  { }
+
+  void FrameEncoder::reset(void) {
+    instructions.clear();
+    num_instructions = 0;
+    strings.clear();
+    prev_address = 0;
+    prev_mem_address = 0;
+  }
+
+  frame_kind FrameEncoder::encode(const frame &f, std::vector<uint8_t> &out) {
+    if (f.has_std_frame() && encodable(f.std_frame())) {
+      out.push_back(encoded_frame_std);
+      put_std_frame(f.std_frame(), out);
+      return frame_kind_std;
+    }
+
+    uint64_t len = f.ByteSizeLong();
+    out.push_back(encoded_frame_plain);
+    put_varint(len, out);
+    uint64_t at = out.size();
+    out.resize(at + len);
+    f.SerializeWithCachedSizesToArray(out.data() + at);
+    return serialized_frame_kind(out.data() + at, len);
+  }
+
+  frame_kind FrameEncoder::encode_raw(const uint8_t *data, uint64_t len, std::vector<uint8_t> &out) {
+    frame_kind kind = serialized_frame_kind(data, len);
+    if (kind == frame_kind_std) {
+      if (!parsed.ParseFromArray(data, len)) {
+        throw (TraceException("Unable to parse from string"));
+      }
+      return encode(parsed, out);
+    }
+    put_plain(data, len, out);
+    return kind;
+  }
+
+  void FrameEncoder::put_plain(const uint8_t *data, uint64_t len, std::vector<uint8_t> &out) {
+    out.push_back(encoded_frame_plain);
+    put_varint(len, out);
+    put_bytes(data, len, out);
+  }
+
+  void FrameEncoder::put_string(const std::string &s, std::vector<uint8_t> &out) {
+    std::unordered_map<std::string, uint64_t>::const_iterator i = strings.find(s);
+    if (i != strings.end()) {
+      put_varint(i->second, out);
+      return;
+    }
+    uint64_t number = strings.size();
+    put_varint(number, out);
+    put_varint(s.size(), out);
+    put_bytes(s.data(), s.size(), out);
+    strings.emplace(s, number);
+  }
+
+  void FrameEncoder::put_std_frame(const std_frame &s, std::vector<uint8_t> &out) {
+    put_varint(zigzag(s.address() - prev_address), out);
+    prev_address = s.address();
+    put_varint(s.thread_id(), out);
+
+    std::unordered_map<uint64_t, std::pair<uint64_t, std::string> >::iterator i = instructions.find(s.address());
+    if (i != instructions.end() && i->second.second == s.rawbytes()) {
+      put_varint(i->second.first, out);
+    } else {
+      put_varint(num_instructions, out);
+      put_varint(s.rawbytes().size(), out);
+      put_bytes(s.rawbytes().data(), s.rawbytes().size(), out);
+      instructions[s.address()] = std::make_pair(num_instructions, s.rawbytes());
+      num_instructions++;
+    }
+
+    put_varint((s.has_operand_post_list() ? encoded_std_post_list : 0)
+               | (s.has_mode() ? encoded_std_mode : 0), out);
+    if (s.has_mode()) {
+      put_string(s.mode(), out);
+    }
+    put_operands(s.operand_pre_list(), out);
+    if (s.has_operand_post_list()) {
+      put_operands(s.operand_post_list(), out);
+    }
+  }
+
+  void FrameEncoder::put_operands(const operand_value_list &list, std::vector<uint8_t> &out) {
+    put_varint(list.elem_size(), out);
+    for (int i = 0; i < list.elem_size(); i++) {
+      const operand_info &o = list.elem(i);
+      const operand_info_specific &spec = o.operand_info_specific();
+      const operand_usage &usage = o.operand_usage();
+      const taint_info &taint = o.taint_info();
+
+      uint64_t flags =
+        (spec.has_mem_operand() ? encoded_operand_mem : 0)
+        | (usage.read() ? encoded_operand_read : 0)
+        | (usage.written() ? encoded_operand_written : 0)
+        | (usage.index() ? encoded_operand_index : 0)
+        | (usage.base() ? encoded_operand_base : 0)
+        | (taint.has_no_taint() ? encoded_operand_has_no_taint : 0)
+        | (taint.no_taint() ? encoded_operand_no_taint : 0)
+        | (taint.has_taint_id() ? encoded_operand_has_taint_id : 0)
+        | (taint.has_taint_multiple() ? encoded_operand_has_taint_multiple : 0)
+        | (taint.taint_multiple() ? encoded_operand_taint_multiple : 0);
+      put_varint(flags, out);
+
+      if (spec.has_mem_operand()) {
+        uint64_t address = spec.mem_operand().address();
+        put_varint(zigzag(address - prev_mem_address), out);
+        prev_mem_address = address;
+      } else {
+        put_string(spec.reg_operand().name(), out);
+      }
+      put_varint(zigzag((uint64_t) (int64_t) o.bit_length()), out);
+      if (taint.has_taint_id()) {
+        put_varint(taint.taint_id(), out);
+      }
+      put_varint(o.value().size(), out);
+      put_bytes(o.value().data(), o.value().size(), out);
+    }
+  }
+
+  uint64_t FrameDecoder::operand_size(const operand &o) noexcept {
+    uint64_t specific = o.flags & encoded_operand_mem
+      ? field_size(1 + varint_size(o.address))
+      : field_size(field_size(o.name_len));
+    uint64_t taint =
+      (o.flags & encoded_operand_has_no_taint ? 2 : 0)
+      + (o.flags & encoded_operand_has_taint_id ? 1 + varint_size(o.taint_id) : 0)
+      + (o.flags & encoded_operand_has_taint_multiple ? 2 : 0);
+    return field_size(specific)
+      + 1 + varint_size(zigzag32(o.bit_length))
+      + field_size(usage_size)
+      + field_size(taint)
+      + field_size(o.value_len);
+  }
+
+  uint8_t *FrameDecoder::write_operand(uint8_t *p, const operand &o) noexcept {
+    /* The fields of operand_info, operand_info_specific,
+       operand_usage and taint_info, in the order of their numbers. */
+    if (o.flags & encoded_operand_mem) {
+      uint64_t mem = 1 + varint_size(o.address);
+      p = write_field(p, key_field_1, field_size(mem));
+      p = write_field(p, key_field_1, mem);
+      *p++ = key_varint_1;
+      p = write_varint(p, o.address);
+    } else {
+      uint64_t reg = field_size(o.name_len);
+      p = write_field(p, key_field_1, field_size(reg));
+      p = write_field(p, key_field_2, reg);
+      p = write_bytes(p, key_field_1, o.name, o.name_len);
+    }
+
+    *p++ = key_varint_2;
+    p = write_varint(p, zigzag32(o.bit_length));
+
+    p = write_field(p, key_field_3, usage_size);
+    *p++ = key_varint_1;
+    *p++ = (o.flags & encoded_operand_read) ? 1 : 0;
+    *p++ = key_varint_2;
+    *p++ = (o.flags & encoded_operand_written) ? 1 : 0;
+    *p++ = key_varint_3;
+    *p++ = (o.flags & encoded_operand_index) ? 1 : 0;
+    *p++ = key_varint_4;
+    *p++ = (o.flags & encoded_operand_base) ? 1 : 0;
+
+    uint64_t taint =
+      (o.flags & encoded_operand_has_no_taint ? 2 : 0)
+      + (o.flags & encoded_operand_has_taint_id ? 1 + varint_size(o.taint_id) : 0)
+      + (o.flags & encoded_operand_has_taint_multiple ? 2 : 0);
+    p = write_field(p, key_field_4, taint);
+    if (o.flags & encoded_operand_has_no_taint) {
+      *p++ = key_varint_1;
+      *p++ = (o.flags & encoded_operand_no_taint) ? 1 : 0;
+    }
+    if (o.flags & encoded_operand_has_taint_id) {
+      *p++ = key_varint_2;
+      p = write_varint(p, o.taint_id);
+    }
+    if (o.flags & encoded_operand_has_taint_multiple) {
+      *p++ = key_varint_3;
+      *p++ = (o.flags & encoded_operand_taint_multiple) ? 1 : 0;
+    }
+
+    return write_bytes(p, key_field_5, o.value, o.value_len);
+  }
+
+  uint64_t FrameDecoder::decode_block(const uint8_t *src, uint64_t len, uint64_t num_frames,
+                                      std::vector<uint8_t> &dst) {
+    encoded_input in = { src, src + len };
+    uint64_t used = 0;
+    uint64_t prev_address = 0;
+    uint64_t prev_mem_address = 0;
+    instructions.clear();
+    strings.clear();
+
+    /* Read an operand list into [operands], and return its
+       serialized size. */
+    auto read_operands = [&](void) -> uint64_t {
+      uint64_t count = in.varint();
+      uint64_t size = 0;
+      for (uint64_t i = 0; i < count; i++) {
+        operand o;
+        o.flags = in.varint();
+        o.address = 0;
+        o.name = NULL;
+        o.name_len = 0;
+        if (o.flags & encoded_operand_mem) {
+          o.address = prev_mem_address + unzigzag(in.varint());
+          prev_mem_address = o.address;
+        } else {
+          std::pair<const uint8_t *, uint64_t> name = in.entry(strings);
+          o.name = name.first;
+          o.name_len = name.second;
+        }
+        o.bit_length = (int32_t) unzigzag(in.varint());
+        o.taint_id = (o.flags & encoded_operand_has_taint_id) ? in.varint() : 0;
+        o.value_len = in.varint();
+        o.value = in.bytes(o.value_len);
+        o.size = operand_size(o);
+        size += field_size(o.size);
+        operands.push_back(o);
+      }
+      return size;
+    };
+
+    for (uint64_t n = 0; n < num_frames; n++) {
+      uint8_t type = *in.bytes(1);
+      if (type == encoded_frame_plain) {
+        uint64_t frame_len = in.varint();
+        const uint8_t *data = in.bytes(frame_len);
+        uint8_t *p = grow(dst, used, sizeof(frame_len) + frame_len);
+        memcpy(p, &frame_len, sizeof(frame_len));
+        memcpy(p + sizeof(frame_len), data, frame_len);
+        continue;
+      }
+      if (type != encoded_frame_std) {
+        throw (TraceException("Unknown frame encoding " + std::to_string(type)));
+      }
+
+      uint64_t address = prev_address + unzigzag(in.varint());
+      prev_address = address;
+      uint64_t thread_id = in.varint();
+      std::pair<const uint8_t *, uint64_t> rawbytes = in.entry(instructions);
+      uint64_t flags = in.varint();
+      std::pair<const uint8_t *, uint64_t> mode(NULL, 0);
+      if (flags & encoded_std_mode) {
+        mode = in.entry(strings);
+      }
+
+      operands.clear();
+      uint64_t pre_size = read_operands();
+      uint64_t num_pre = operands.size();
+      uint64_t post_size = (flags & encoded_std_post_list) ? read_operands() : 0;
+
+      uint64_t std_size = 1 + varint_size(address)
+        + 1 + varint_size(thread_id)
+        + field_size(rawbytes.second)
+        + field_size(pre_size)
+        + ((flags & encoded_std_post_list) ? field_size(post_size) : 0)
+        + ((flags & encoded_std_mode) ? field_size(mode.second) : 0);
+      uint64_t frame_len = field_size(std_size);
+
+      uint8_t *p = grow(dst, used, sizeof(frame_len) + frame_len);
+      memcpy(p, &frame_len, sizeof(frame_len));
+      p += sizeof(frame_len);
+
+      p = write_field(p, key_field_1, std_size);
+      *p++ = key_varint_1;
+      p = write_varint(p, address);
+      *p++ = key_varint_2;
+      p = write_varint(p, thread_id);
+      p = write_bytes(p, key_field_3, rawbytes.first, rawbytes.second);
+      p = write_field(p, key_field_4, pre_size);
+      for (uint64_t i = 0; i < num_pre; i++) {
+        p = write_field(p, key_field_1, operands[i].size);
+        p = write_operand(p, operands[i]);
+      }
+      if (flags & encoded_std_post_list) {
+        p = write_field(p, key_field_5, post_size);
+        for (uint64_t i = num_pre; i < operands.size(); i++) {
+          p = write_field(p, key_field_1, operands[i].size);
+          p = write_operand(p, operands[i]);
+        }
+      }
+      if (flags & encoded_std_mode) {
+        p = write_bytes(p, key_field_6, mode.first, mode.second);
+      }
+    }
+
+    if (in.p != in.end) {
+      throw (TraceException("Trailing data in encoded block"));
+    }
+    return used;
+  }
+};
@@ -0,0 +1,183 @@
+#ifndef TRACE_ENCODING_HPP
+#define TRACE_ENCODING_HPP
+
+/**
+ * Dictionary and delta encoding of the frames of version 5 traces.
+ *
+ * Loops execute the same instructions over and over, and every
+ * standard frame repeats the bytes of its instruction and the names
+ * of the registers it uses. Since version 5, the contents of a block
+ * are encoded frames instead of serialized ones. Each encoded frame
+ * starts with a byte that is either
+ *
+ *  - [encoded_frame_plain], followed by the size of the serialized
+ *    frame and the frame itself, or
+ *
+ *  - [encoded_frame_std], followed by a standard frame:
+ *
+ *  [ <address - address of the previous standard frame, signed>
+ *    <thread id>
+ *    <instruction number>
+ *    <flags, see [encoded_std_flag]>
+ *    <string number of the mode, if any>
+ *    <operands read>
+ *    <operands written, if any> ]
+ *
+ * An operand list is the number of operands followed by the operands:
+ *
+ *  [ <operand flags, see [encoded_operand_flag]>
+ *    <string number of the register name, or the memory address -
+ *     the previous memory operand address, signed>
+ *    <bit length, signed>
+ *    <taint id, if any>
+ *    <size of the value>
+ *    <value> ]
+ *
+ * All numbers are varints, and signed numbers are zigzag encoded.
+ *
+ * The instruction bytes and strings form two dictionaries, numbered
+ * in the order in which the block first uses them. A number equal to
+ * the size of its dictionary adds an entry, whose size and bytes
+ * follow the number. The writer reuses the entry of an instruction
+ * for every frame at the same address with the same bytes. Every
+ * block starts with empty dictionaries and previous addresses of 0,
+ * so that it can still be decoded on its own.
+ *
+ * Decoding turns the contents back into the serialized frames of a
+ * version 4 block, which readers then parse as usual. Fields that the
+ * frame schema does not define are not kept.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "frame.piqi.pb.h"
+#include "trace.toc.hpp"
+
+namespace SerializedTrace {
+
+  /** First version that encodes the frames of its blocks. */
+  const uint64_t encoded_trace_version = 5LL;
+
+  /** The first byte of an encoded frame. */
+  enum encoded_frame_type {
+    encoded_frame_plain = 0,
+    encoded_frame_std = 1
+  };
+
+  /** Flags of an encoded standard frame. */
+  enum encoded_std_flag {
+    encoded_std_post_list = 1 << 0,
+    encoded_std_mode = 1 << 1
+  };
+
+  /** Flags of an encoded operand. */
+  enum encoded_operand_flag {
+    encoded_operand_mem = 1 << 0,
+    encoded_operand_read = 1 << 1,
+    encoded_operand_written = 1 << 2,
+    encoded_operand_index = 1 << 3,
+    encoded_operand_base = 1 << 4,
+    encoded_operand_has_no_taint = 1 << 5,
+    encoded_operand_no_taint = 1 << 6,
+    encoded_operand_has_taint_id = 1 << 7,
+    encoded_operand_has_taint_multiple = 1 << 8,
+    encoded_operand_taint_multiple = 1 << 9
+  };
+
+  /** Encodes the frames of a block, one after the other. */
+  class FrameEncoder {
+
+  public:
+
+    FrameEncoder(void);
+
+    /** Start a new block, with empty dictionaries. */
+    void reset(void);
+
+    /** Append the encoding of [f] to [out], and return the kind of
+        [f]. */
+    frame_kind encode(const frame &f, std::vector<uint8_t> &out);
+
+    /** Append the encoding of the frame serialized in the [len] bytes
+        at [data] to [out], and return its kind. Only standard frames
+        are parsed. */
+    frame_kind encode_raw(const uint8_t *data, uint64_t len, std::vector<uint8_t> &out);
+
+  private:
+
+    /** Number and bytes of the last instruction seen at each
+        address, and the number of instructions. */
+    std::unordered_map<uint64_t, std::pair<uint64_t, std::string> > instructions;
+    uint64_t num_instructions;
+
+    /** Number of every string seen. */
+    std::unordered_map<std::string, uint64_t> strings;
+
+    uint64_t prev_address;
+    uint64_t prev_mem_address;
+
+    /** Frame reused to parse standard frames in [encode_raw]. */
+    frame parsed;
+
+    /** Append [s] to [out] as a string number. */
+    void put_string(const std::string &s, std::vector<uint8_t> &out);
+
+    /** Append [list] to [out]. */
+    void put_operands(const operand_value_list &list, std::vector<uint8_t> &out);
+
+    /** Append [s] to [out]. */
+    void put_std_frame(const std_frame &s, std::vector<uint8_t> &out);
+
+    /** Append the [len] serialized bytes at [data] to [out] as a
+        plain frame. */
+    void put_plain(const uint8_t *data, uint64_t len, std::vector<uint8_t> &out);
+  };
+
+  /** Decodes the blocks of a version 5 trace. */
+  class FrameDecoder {
+
+  public:
+
+    /** Decode the [len] bytes of block contents at [src], which hold
+        [num_frames] encoded frames, into [dst], each frame preceded by
+        its uint64_t size. [dst] is grown as needed. Returns the size
+        of the decoded contents. Throws [TraceException] if the
+        contents are malformed. */
+    uint64_t decode_block(const uint8_t *src, uint64_t len, uint64_t num_frames,
+                          std::vector<uint8_t> &dst);
+
+  private:
+
+    /** The dictionaries of the current block, pointing into the
+        block contents. */
+    std::vector<std::pair<const uint8_t *, uint64_t> > instructions;
+    std::vector<std::pair<const uint8_t *, uint64_t> > strings;
+
+    /** A decoded operand, and the size of its serialized form. */
+    struct operand {
+      uint64_t flags;
+      uint64_t address;
+      const uint8_t *name;
+      uint64_t name_len;
+      int32_t bit_length;
+      uint64_t taint_id;
+      const uint8_t *value;
+      uint64_t value_len;
+      uint64_t size;
+    };
+
+    /** The operands of the current frame. */
+    std::vector<operand> operands;
+
+    /** Return the serialized size of [o]. */
+    static uint64_t operand_size(const operand &o) noexcept;
+
+    /** Serialize [o] at [p], and return the end of it. */
+    static uint8_t *write_operand(uint8_t *p, const operand &o) noexcept;
+  };
+};
+
+#endif
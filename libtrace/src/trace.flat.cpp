@@ -0,0 +1,267 @@
+/**
+ * Implementation of flat frames.
+ */
+
+#include "trace.flat.hpp"
+#include <algorithm>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    /** Count the operands of the serialized operand list [data]. */
+    bool count_operands(const uint8_t *data, uint64_t len, uint64_t &count) noexcept {
+      count = 0;
+      if (!data) {
+        return true;
+      }
+      wire_input input(data, len);
+      wire_field f;
+      while (!input.at_end()) {
+        if (!input.next(f)) {
+          return false;
+        }
+        if (f.number == 1 && f.type == wire_bytes) {
+          count++;
+        }
+      }
+      return true;
+    }
+
+    /** Decode the serialized [operand_info_specific] in [f]. */
+    bool decode_specific(const wire_field &f, FlatArena &arena, FlatOperand &into) {
+      wire_input input(f.data, f.len);
+      wire_field option;
+      while (!input.at_end()) {
+        if (!input.next(option)) {
+          return false;
+        }
+        if (option.type != wire_bytes || (option.number != 1 && option.number != 2)) {
+          continue;
+        }
+        bool mem = option.number == 1;
+        if (mem) {
+          into.flags |= flat_operand_mem;
+        }
+        wire_input operand(option.data, option.len);
+        wire_field g;
+        while (!operand.at_end()) {
+          if (!operand.next(g)) {
+            return false;
+          }
+          if (g.number != 1) {
+            continue;
+          }
+          if (mem && g.type == wire_varint) {
+            into.address = g.value;
+          } else if (!mem && g.type == wire_bytes) {
+            into.name = reinterpret_cast<const char *>(arena.copy(g.data, g.len));
+            into.name_len = g.len;
+          }
+        }
+      }
+      return true;
+    }
+
+    /** Decode the serialized [operand_usage] in [f]. */
+    bool decode_usage(const wire_field &f, FlatOperand &into) noexcept {
+      static const uint32_t flags[] = {
+        0, flat_operand_read, flat_operand_written, flat_operand_index, flat_operand_base
+      };
+      wire_input input(f.data, f.len);
+      wire_field g;
+      while (!input.at_end()) {
+        if (!input.next(g)) {
+          return false;
+        }
+        if (g.type == wire_varint && g.number >= 1 && g.number <= 4) {
+          into.flags = g.value ? into.flags | flags[g.number] : into.flags & ~flags[g.number];
+        }
+      }
+      return true;
+    }
+
+    /** Decode the serialized [taint_info] in [f]. */
+    bool decode_taint(const wire_field &f, FlatOperand &into) noexcept {
+      wire_input input(f.data, f.len);
+      wire_field g;
+      while (!input.at_end()) {
+        if (!input.next(g)) {
+          return false;
+        }
+        if (g.type != wire_varint) {
+          continue;
+        }
+        if (g.number == 1) {
+          into.flags = g.value ? into.flags | flat_operand_no_taint : into.flags & ~flat_operand_no_taint;
+        } else if (g.number == 2) {
+          into.flags |= flat_operand_taint_id;
+          into.taint_id = g.value;
+        } else if (g.number == 3) {
+          into.flags = g.value
+            ? into.flags | flat_operand_taint_multiple : into.flags & ~flat_operand_taint_multiple;
+        }
+      }
+      return true;
+    }
+
+    /** Decode the serialized [operand_info] in [f] into [into]. */
+    bool decode_operand(const wire_field &f, uint32_t flags, FlatArena &arena,
+                        FlatOperand &into) {
+      into.flags = flags;
+      into.bit_length = 0;
+      into.address = 0;
+      into.name = NULL;
+      into.name_len = 0;
+      into.value = NULL;
+      into.value_len = 0;
+      into.taint_id = 0;
+
+      wire_input input(f.data, f.len);
+      wire_field g;
+      while (!input.at_end()) {
+        if (!input.next(g)) {
+          return false;
+        }
+        if (g.type == wire_varint) {
+          if (g.number == 2) {
+            /* A zigzag encoded sint32. */
+            into.bit_length = (int32_t) ((g.value >> 1) ^ (0 - (g.value & 1)));
+          }
+          continue;
+        }
+        if (g.type != wire_bytes) {
+          continue;
+        }
+        bool ok = true;
+        switch (g.number) {
+        case 1:
+          ok = decode_specific(g, arena, into);
+          break;
+        case 3:
+          ok = decode_usage(g, into);
+          break;
+        case 4:
+          ok = decode_taint(g, into);
+          break;
+        case 5:
+          into.value = arena.copy(g.data, g.len);
+          into.value_len = g.len;
+          break;
+        }
+        if (!ok) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /** Decode the serialized operand list [data] into [into]. */
+    bool decode_operands(const uint8_t *data, uint64_t len, uint32_t flags,
+                         FlatArena &arena, FlatOperand *into) {
+      if (!data) {
+        return true;
+      }
+      wire_input input(data, len);
+      wire_field f;
+      while (!input.at_end()) {
+        if (!input.next(f)) {
+          return false;
+        }
+        if (f.number == 1 && f.type == wire_bytes && !decode_operand(f, flags, arena, *into++)) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+
+  FlatArena::FlatArena(uint64_t chunk_size_in)
+    : chunk_size (std::max<uint64_t>(chunk_size_in, 1))
+    , current (0)
+    , used (0)
+    , used_before (0)
+  { }
+
+  void *FlatArena::allocate(uint64_t size, uint64_t align) {
+    for (;;) {
+      if (current == chunks.size()) {
+        chunk c;
+        c.size = std::max(chunk_size, size + align);
+        c.data.reset(new uint8_t[c.size]);
+        chunks.push_back(std::move(c));
+      }
+      chunk &c = chunks[current];
+      uint64_t start = (used + align - 1) & ~(align - 1);
+      if (start <= c.size && size <= c.size - start) {
+        used = start + size;
+        return c.data.get() + start;
+      }
+      /* The rest of this chunk stays unused until the next reset. */
+      used_before += used;
+      used = 0;
+      current++;
+    }
+  }
+
+  const uint8_t *FlatArena::copy(const uint8_t *data, uint64_t len) {
+    if (len == 0) {
+      return NULL;
+    }
+    uint8_t *p = static_cast<uint8_t *>(allocate(len, 1));
+    std::copy(data, data + len, p);
+    return p;
+  }
+
+  void FlatArena::reset(void) noexcept {
+    current = 0;
+    used = 0;
+    used_before = 0;
+  }
+
+  uint64_t FlatArena::get_bytes_used(void) const noexcept {
+    return used_before + used;
+  }
+
+  uint64_t FlatArena::get_capacity(void) const noexcept {
+    uint64_t capacity = 0;
+    for (std::vector<chunk>::const_iterator i = chunks.begin(); i != chunks.end(); ++i) {
+      capacity += i->size;
+    }
+    return capacity;
+  }
+
+  bool decode_flat_frame(const uint8_t *data, uint64_t len, FlatArena &arena,
+                         FlatFrame &into) {
+    scanned_frame s;
+    if (!scan_frame(data, len, frame_field_address | frame_field_thread_id
+                    | frame_field_rawbytes | frame_field_operands, s)) {
+      return false;
+    }
+    into.kind = s.kind;
+    into.address = s.address;
+    into.thread_id = s.thread_id;
+    into.rawbytes = arena.copy(s.rawbytes, s.rawbytes_len);
+    into.rawbytes_len = s.rawbytes_len;
+
+    uint64_t num_pre, num_post;
+    if (!count_operands(s.operand_pre_list, s.operand_pre_list_len, num_pre) ||
+        !count_operands(s.operand_post_list, s.operand_post_list_len, num_post)) {
+      return false;
+    }
+    FlatOperand *operands = NULL;
+    if (num_pre + num_post > 0) {
+      operands = static_cast<FlatOperand *>(
+        arena.allocate((num_pre + num_post) * sizeof(FlatOperand), alignof(FlatOperand)));
+    }
+    if (!decode_operands(s.operand_pre_list, s.operand_pre_list_len, 0, arena, operands) ||
+        !decode_operands(s.operand_post_list, s.operand_post_list_len, flat_operand_post,
+                         arena, operands + num_pre)) {
+      return false;
+    }
+    into.operands = operands;
+    into.num_operands = num_pre + num_post;
+    into.num_pre_operands = num_pre;
+    return true;
+  }
+};
@@ -0,0 +1,136 @@
+#ifndef TRACE_FLAT_HPP
+#define TRACE_FLAT_HPP
+
+/**
+ * Flat frames: frames decoded into plain structures instead of
+ * protobuf messages.
+ *
+ * A parsed [frame] is a tree of separately allocated messages and
+ * strings, one per operand, so analyses that walk many frames spend
+ * their time chasing pointers. A [FlatFrame] keeps the fields most
+ * analyses use inline, and points to an array of [FlatOperand]s. The
+ * operands, register names, values and instruction bytes of a batch
+ * of frames are allocated one after another in a [FlatArena], which
+ * is reset, not freed, between batches, so reading a trace this way
+ * allocates nothing once the arena has grown to the size of a batch.
+ *
+ * [decode_flat_frame] reads the protobuf wire format of a frame
+ * directly, like [scan_frame]; no [frame] message is built.
+ */
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+#include "trace.columns.hpp"
+#include "trace.scan.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t default_flat_arena_chunk = 1LL << 20;
+
+  /** Flags of a [FlatOperand]. */
+  enum flat_operand_flag {
+    /** Memory operand, else register operand. */
+    flat_operand_mem = 1 << 0,
+    flat_operand_read = 1 << 1,
+    flat_operand_written = 1 << 2,
+    flat_operand_index = 1 << 3,
+    flat_operand_base = 1 << 4,
+    /** Set for the operands of the post list. */
+    flat_operand_post = 1 << 5,
+    flat_operand_no_taint = 1 << 6,
+    /** Tainted from the single source [taint_id]. */
+    flat_operand_taint_id = 1 << 7,
+    flat_operand_taint_multiple = 1 << 8
+  };
+
+  /** An operand of a [FlatFrame]. */
+  struct FlatOperand {
+    /** [flat_operand_flag]s. */
+    uint32_t flags;
+    int32_t bit_length;
+    /** The address of memory operands, 0 for registers. */
+    uint64_t address;
+    /** The name of register operands, not NUL terminated. */
+    const char *name;
+    uint64_t name_len;
+    const uint8_t *value;
+    uint64_t value_len;
+    uint64_t taint_id;
+  };
+
+  /** A decoded frame. Only the kind, address and thread id of frames
+      other than standard frames are decoded; their other fields need
+      a [frame]. */
+  struct FlatFrame {
+    frame_kind kind;
+    /** 0 if the frame has none. */
+    uint64_t address;
+    /** [no_thread_id] if the frame has none. */
+    uint64_t thread_id;
+    const uint8_t *rawbytes;
+    uint64_t rawbytes_len;
+    /** The operands of the pre list, followed by those of the post
+        list. */
+    const FlatOperand *operands;
+    uint64_t num_operands;
+    uint64_t num_pre_operands;
+  };
+
+  /** A bump allocator for the contents of [FlatFrame]s. */
+  class FlatArena {
+
+  public:
+
+    /** Creates an empty arena that grows by at least [chunk_size]
+        bytes at a time. */
+    FlatArena(uint64_t chunk_size = default_flat_arena_chunk);
+
+    /** Returns [size] bytes aligned to [align], a power of 2, that
+        live until the arena is reset or destroyed. */
+    void *allocate(uint64_t size, uint64_t align);
+
+    /** Returns a copy of the [len] bytes at [data]. */
+    const uint8_t *copy(const uint8_t *data, uint64_t len);
+
+    /** Release everything allocated so far. The memory is kept for
+        the next allocations. */
+    void reset(void) noexcept;
+
+    /** Returns the number of bytes allocated since the last reset. */
+    uint64_t get_bytes_used(void) const noexcept;
+
+    /** Returns the number of bytes the arena holds. */
+    uint64_t get_capacity(void) const noexcept;
+
+  private:
+
+    struct chunk {
+      std::unique_ptr<uint8_t[]> data;
+      uint64_t size;
+    };
+
+    uint64_t chunk_size;
+    std::vector<chunk> chunks;
+
+    /** The chunk allocations come from, and how much of it is
+        used. */
+    uint64_t current;
+    uint64_t used;
+
+    /** Bytes used in the chunks before [current]. */
+    uint64_t used_before;
+
+    FlatArena(const FlatArena &) = delete;
+    FlatArena &operator=(const FlatArena &) = delete;
+  };
+
+  /** Decode the frame serialized in the [len] bytes at [data] into
+      [into], allocating its operands and bytes in [arena], so they do
+      not point into [data]. Returns false if the frame is
+      malformed. */
+  bool decode_flat_frame(const uint8_t *data, uint64_t len, FlatArena &arena,
+                         FlatFrame &into);
+};
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * Implementation of the dense frame index.
+ */
+
+#include "trace.index.hpp"
+#include "trace.container.hpp"
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace SerializedTrace {
+
+  FrameIndex::FrameIndex(const std::string &filename, const IndexedTrace &expected)
+    : entries (NULL)
+    , map (NULL)
+    , map_size (0)
+  {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open frame index " + filename));
+    }
+
+    uint64_t header[index_header_size / sizeof(uint64_t)];
+    if (fread(header, sizeof(header), 1, f) != 1) {
+      fclose(f);
+      throw (TraceException("Unable to read frame index header"));
+    }
+    trace.trace_version = header[2];
+    trace.num_frames = header[3];
+    trace.toc_offset = header[4];
+    trace.trace_size = header[5];
+    if (header[0] != index_magic_number || header[1] != index_version ||
+        !(trace == expected)) {
+      fclose(f);
+      throw (TraceException("Frame index " + filename + " does not match the trace"));
+    }
+
+    uint64_t size = index_header_size + trace.num_frames * sizeof(uint64_t);
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size != size) {
+      fclose(f);
+      throw (TraceException("Frame index " + filename + " is truncated"));
+    }
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    fclose(f);
+    if (addr == MAP_FAILED) {
+      throw (TraceException("Unable to map frame index " + filename));
+    }
+    /* Lookups are random. */
+    madvise(addr, size, MADV_RANDOM);
+    map = addr;
+    map_size = size;
+    entries = reinterpret_cast<const uint64_t *>(static_cast<const uint8_t *>(addr) + index_header_size);
+#else
+    owned.resize(trace.num_frames);
+    size_t read = fread(owned.data(), sizeof(uint64_t), owned.size(), f);
+    fclose(f);
+    if (read != owned.size()) {
+      throw (TraceException("Frame index " + filename + " is truncated"));
+    }
+    entries = owned.data();
+#endif
+  }
+
+  FrameIndex::FrameIndex(const IndexedTrace &trace_in, std::vector<uint64_t> &&offsets)
+    : trace (trace_in)
+    , map (NULL)
+    , map_size (0)
+    , owned (std::move(offsets))
+  {
+    if (owned.size() != trace.num_frames) {
+      throw (TraceException("Frame index does not cover all frames"));
+    }
+    entries = owned.data();
+  }
+
+  FrameIndex::~FrameIndex(void) noexcept {
+#ifndef _WIN32
+    if (map) {
+      munmap(map, map_size);
+    }
+#endif
+  }
+
+  void FrameIndex::save(const std::string &filename) const {
+    std::string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+      throw (TraceException("Unable to open frame index " + tmp + " for writing"));
+    }
+
+    uint64_t header[index_header_size / sizeof(uint64_t)] = {
+      index_magic_number,
+      index_version,
+      trace.trace_version,
+      trace.num_frames,
+      trace.toc_offset,
+      trace.trace_size
+    };
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1
+      && fwrite(entries, sizeof(uint64_t), trace.num_frames, f) == trace.num_frames;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+      remove(tmp.c_str());
+      throw (TraceException("Unable to write frame index " + filename));
+    }
+  }
+
+  std::string FrameIndex::filename_for(const std::string &trace_filename) {
+    return trace_filename + ".idx";
+  }
+};
@@ -0,0 +1,100 @@
+#ifndef TRACE_INDEX_HPP
+#define TRACE_INDEX_HPP
+
+/**
+ * A dense frame index, stored next to a trace, that maps every frame
+ * number to the offset of the frame in the trace. With the index,
+ * [TraceContainerReader::seek] jumps straight to a frame instead of
+ * skipping over up to [frames_per_toc_entry - 1] frames.
+ *
+ * The index format, all numbers in the byte order of the trace:
+ *
+ * [<uint64_t index magic number>
+ *  <uint64_t index version number>
+ *  <uint64_t trace version number>
+ *  <uint64_t n = number of trace frames>
+ *  <uint64_t offset of the trace toc>
+ *  <uint64_t size of the trace file>
+ *  <uint64_t offset of sizeof(trace frame 0)>
+ *  ..............
+ *  <uint64_t offset of sizeof(trace frame n - 1)>]
+ *
+ * The trace fields of the header are compared with the trace when
+ * the index is opened, so a stale index is rejected.
+ */
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace SerializedTrace {
+
+  const uint64_t index_magic_number = 0x7864692d656d6172LL;
+  const uint64_t index_version = 1LL;
+  const uint64_t index_header_size = 48LL;
+
+  /** Describes the trace an index belongs to. */
+  struct IndexedTrace {
+    uint64_t trace_version;
+    uint64_t num_frames;
+    uint64_t toc_offset;
+    uint64_t trace_size;
+
+    bool operator==(const IndexedTrace &t) const {
+      return trace_version == t.trace_version
+        && num_frames == t.num_frames
+        && toc_offset == t.toc_offset
+        && trace_size == t.trace_size;
+    }
+  };
+
+  class FrameIndex {
+
+  public:
+
+    /** Opens the index in [filename]. Throws [TraceException] if it
+        can not be read or was not built for [trace]. */
+    FrameIndex(const std::string &filename, const IndexedTrace &trace);
+
+    /** Creates an in-memory index from [offsets]. */
+    FrameIndex(const IndexedTrace &trace, std::vector<uint64_t> &&offsets);
+
+    ~FrameIndex(void) noexcept;
+
+    /** Returns the offset of the length of frame [frame_number]. */
+    uint64_t offset(uint64_t frame_number) const noexcept {
+      return entries[frame_number];
+    }
+
+    /** Returns the number of indexed frames. */
+    uint64_t get_num_frames(void) const noexcept {
+      return trace.num_frames;
+    }
+
+    /** Writes the index to [filename]. The index is written to a
+        temporary file first, so readers never see a partial index. */
+    void save(const std::string &filename) const;
+
+    /** Returns the name of the index that belongs to [trace_filename]. */
+    static std::string filename_for(const std::string &trace_filename);
+
+  private:
+
+    IndexedTrace trace;
+
+    /** The offsets, either pointing into [map] or into [owned]. */
+    const uint64_t *entries;
+
+    /** Mapped index file, if any. */
+    void *map;
+    uint64_t map_size;
+
+    std::vector<uint64_t> owned;
+
+    FrameIndex(const FrameIndex &) = delete;
+    FrameIndex &operator=(const FrameIndex &) = delete;
+  };
+};
+
+#endif
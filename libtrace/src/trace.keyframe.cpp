@@ -0,0 +1,150 @@
+/**
+ * Implementation of machine state and key frames.
+ */
+
+#include "trace.keyframe.hpp"
+#include "trace.columns.hpp"
+
+namespace SerializedTrace {
+
+  namespace {
+
+    void add_value(value_list *values, const std::string &name, const register_value &r) {
+      value_info *v = values->add_elem();
+      v->mutable_operand_info_specific()->mutable_reg_operand()->set_name(name);
+      v->set_bit_length(r.bit_length);
+      v->set_value(r.value);
+    }
+
+    void add_registers(value_list *values, const MachineState::register_file &regs) {
+      for (MachineState::register_file::const_iterator i = regs.begin(); i != regs.end(); ++i) {
+        add_value(values, i->first, i->second);
+      }
+    }
+
+    /** Add the bytes of [memory] as runs of consecutive addresses, of
+        at most [key_frame_memory_run] bytes each. */
+    void add_memory(value_list *values, const std::map<uint64_t, uint8_t> &memory) {
+      std::map<uint64_t, uint8_t>::const_iterator i = memory.begin();
+      while (i != memory.end()) {
+        uint64_t address = i->first;
+        std::string run;
+        do {
+          run.push_back((char) i->second);
+          ++i;
+        } while (i != memory.end() && i->first == address + run.size()
+                 && run.size() < key_frame_memory_run);
+
+        value_info *v = values->add_elem();
+        v->mutable_operand_info_specific()->mutable_mem_operand()->set_address(address);
+        v->set_bit_length(8 * run.size());
+        v->set_value(run);
+      }
+    }
+  }
+
+  void MachineState::clear(void) {
+    registers.clear();
+    memory.clear();
+  }
+
+  void MachineState::apply(const frame &f) {
+    if (f.has_std_frame()) {
+      const std_frame &s = f.std_frame();
+      apply(s.operand_pre_list(), s.thread_id());
+      /* Values after the instruction override those before it. */
+      if (s.has_operand_post_list()) {
+        apply(s.operand_post_list(), s.thread_id());
+      }
+    } else if (f.has_key_frame()) {
+      const tagged_value_lists &lists = f.key_frame().tagged_value_lists();
+      for (int i = 0; i < lists.elem_size(); i++) {
+        const tagged_value_list &l = lists.elem(i);
+        uint64_t thread_id = l.value_source_tag().has_thread_id()
+          ? l.value_source_tag().thread_id() : no_thread_id;
+        const value_list &values = l.value_list();
+        for (int j = 0; j < values.elem_size(); j++) {
+          const value_info &v = values.elem(j);
+          const operand_info_specific &where = v.operand_info_specific();
+          if (where.has_mem_operand()) {
+            set_memory(where.mem_operand().address(), v.value());
+          } else if (where.has_reg_operand()) {
+            set_register(thread_id, where.reg_operand().name(), v.bit_length(), v.value());
+          }
+        }
+      }
+    }
+  }
+
+  void MachineState::apply(const operand_value_list &operands, uint64_t thread_id) {
+    for (int i = 0; i < operands.elem_size(); i++) {
+      const operand_info &o = operands.elem(i);
+      const operand_info_specific &where = o.operand_info_specific();
+      if (where.has_mem_operand()) {
+        set_memory(where.mem_operand().address(), o.value());
+      } else if (where.has_reg_operand()) {
+        set_register(thread_id, where.reg_operand().name(), o.bit_length(), o.value());
+      }
+    }
+  }
+
+  const register_value *MachineState::get_register(uint64_t thread_id, const std::string &name) const {
+    std::map<uint64_t, register_file>::const_iterator t = registers.find(thread_id);
+    if (t == registers.end()) {
+      return NULL;
+    }
+    register_file::const_iterator r = t->second.find(name);
+    return r == t->second.end() ? NULL : &r->second;
+  }
+
+  bool MachineState::get_memory(uint64_t address, uint8_t &byte) const {
+    std::map<uint64_t, uint8_t>::const_iterator i = memory.find(address);
+    if (i == memory.end()) {
+      return false;
+    }
+    byte = i->second;
+    return true;
+  }
+
+  void MachineState::to_key_frame(frame &into, bool with_memory) const {
+    into.Clear();
+    tagged_value_lists *lists = into.mutable_key_frame()->mutable_tagged_value_lists();
+    for (std::map<uint64_t, register_file>::const_iterator i = registers.begin();
+         i != registers.end(); ++i) {
+      if (i->first != no_thread_id) {
+        tagged_value_list *l = lists->add_elem();
+        l->mutable_value_source_tag()->set_thread_id(i->first);
+        add_registers(l->mutable_value_list(), i->second);
+      }
+    }
+
+    std::map<uint64_t, register_file>::const_iterator shared = registers.find(no_thread_id);
+    bool has_shared = shared != registers.end();
+    if (has_shared || (with_memory && !memory.empty())) {
+      tagged_value_list *l = lists->add_elem();
+      l->mutable_value_source_tag()->set_no_thread_id(true);
+      if (has_shared) {
+        add_registers(l->mutable_value_list(), shared->second);
+      }
+      if (with_memory) {
+        add_memory(l->mutable_value_list(), memory);
+      }
+    }
+  }
+
+  void MachineState::set_register(uint64_t thread_id, const std::string &name,
+                                  int32_t bit_length, const std::string &value) {
+    register_value &r = registers[thread_id][name];
+    r.bit_length = bit_length;
+    r.value = value;
+  }
+
+  void MachineState::set_memory(uint64_t address, const std::string &value) {
+    std::map<uint64_t, uint8_t>::iterator hint = memory.lower_bound(address);
+    for (std::string::size_type i = 0; i < value.size(); i++) {
+      hint = memory.insert(hint, std::make_pair(address + i, (uint8_t) value[i]));
+      hint->second = (uint8_t) value[i];
+      ++hint;
+    }
+  }
+};
@@ -0,0 +1,94 @@
+#ifndef TRACE_KEYFRAME_HPP
+#define TRACE_KEYFRAME_HPP
+
+/**
+ * Machine state and key frames.
+ *
+ * The operands of standard frames record the values of the registers
+ * and memory that each instruction reads and writes. Replaying them
+ * in order gives the last known value of every register of every
+ * thread, and of every byte of memory touched so far: the machine
+ * state at a frame.
+ *
+ * Replaying from the first frame to reach a frame deep in a trace is
+ * slow, so writers can store the whole state every so often in a key
+ * frame, see [TraceContainerWriter::write_key_frames]. A key frame has
+ * one tagged value list per thread with its registers, and one list
+ * without a thread id with the memory and the registers of frames
+ * that had no thread. [TraceContainerReader::reconstruct_state] then
+ * only replays the frames since the last key frame.
+ *
+ * Byte i of a memory value is taken to be at its address plus i, the
+ * order in which tracers of little-endian machines record values.
+ */
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include "frame.piqi.pb.h"
+
+namespace SerializedTrace {
+
+  /** Largest number of bytes of memory that a key frame stores in a
+      single value. */
+  const uint64_t key_frame_memory_run = 256LL;
+
+  /** The last value of a register. */
+  struct register_value {
+    /** Size in bits, as recorded by the tracer. */
+    int32_t bit_length;
+    std::string value;
+  };
+
+  class MachineState {
+
+  public:
+
+    typedef std::map<std::string, register_value> register_file;
+
+    /** Forget everything. */
+    void clear(void);
+
+    /** Update the state with the operands of [f], if it is a
+        standard frame, or with the values of [f], if it is a key
+        frame. Other frames do not change the state. */
+    void apply(const frame &f);
+
+    /** Update the registers of [thread_id] and the memory with the
+        operands in [operands]. */
+    void apply(const operand_value_list &operands, uint64_t thread_id);
+
+    /** Return the last value of register [name] of [thread_id], or
+        NULL if it was never seen. */
+    const register_value *get_register(uint64_t thread_id, const std::string &name) const;
+
+    /** Return the registers seen so far, by thread id, with
+        [no_thread_id] for registers of key frames without a
+        thread. */
+    const std::map<uint64_t, register_file> &get_registers(void) const noexcept { return registers; }
+
+    /** Store the last value of the byte at [address] in [byte].
+        Returns false if it was never seen. */
+    bool get_memory(uint64_t address, uint8_t &byte) const;
+
+    /** Return the bytes of memory seen so far, by address. */
+    const std::map<uint64_t, uint8_t> &get_memory(void) const noexcept { return memory; }
+
+    /** Store the state in [into] as a key frame, with the memory if
+        [with_memory] is true. Applying the key frame to an empty
+        state gives back this state. */
+    void to_key_frame(frame &into, bool with_memory = true) const;
+
+  private:
+
+    std::map<uint64_t, register_file> registers;
+    std::map<uint64_t, uint8_t> memory;
+
+    void set_register(uint64_t thread_id, const std::string &name,
+                      int32_t bit_length, const std::string &value);
+
+    void set_memory(uint64_t address, const std::string &value);
+  };
+};
+
+#endif
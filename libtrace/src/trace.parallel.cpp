@@ -0,0 +1,185 @@
+/**
+ * Implementation of parallel trace decoding.
+ */
+
+#include "trace.parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    /** State shared by the workers of one scan. */
+    struct scan {
+      const std::string &filename;
+      const frame_callback &callback;
+      const delivery_order order;
+
+      /** If set, segments are handed to it instead of frames to
+          [callback]. */
+      const segment_callback *segments;
+      uint64_t num_frames;
+      uint64_t frames_per_segment;
+      uint64_t num_segments;
+
+      /** Next segment to be claimed by a worker. */
+      std::atomic<uint64_t> next_segment;
+
+      /** Set when a worker fails, so that the others stop early. */
+      std::atomic<bool> failed;
+      std::exception_ptr error;
+
+      /** In ordered mode, the segment whose frames are to be
+          delivered next. Guarded by [mutex]. */
+      uint64_t turn;
+      std::mutex mutex;
+      std::condition_variable turn_changed;
+
+      scan(const std::string &filename_in,
+           const frame_callback &callback_in,
+           delivery_order order_in)
+        : filename (filename_in)
+        , callback (callback_in)
+        , order (order_in)
+        , segments (NULL)
+        , next_segment (0)
+        , failed (false)
+        , turn (0)
+      { }
+
+      void fail(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed.store(true);
+        turn_changed.notify_all();
+      }
+    };
+
+    std::unique_ptr<TraceContainerReader> open_reader(const std::string &filename) {
+#ifndef _WIN32
+      return std::unique_ptr<TraceContainerReader>(new MappedTraceReader(filename));
+#else
+      return std::unique_ptr<TraceContainerReader>(new TraceContainerReader(filename));
+#endif
+    }
+
+    void deliver_unordered(scan &s, TraceContainerReader &r,
+                           uint64_t first, uint64_t last) {
+      frame f;
+      for (uint64_t i = first; i < last && !s.failed.load(); i++) {
+        r.next(f);
+        s.callback(i, f);
+      }
+    }
+
+    void deliver_ordered(scan &s, TraceContainerReader &r,
+                         std::vector<frame> &batch,
+                         uint64_t segment, uint64_t first, uint64_t last) {
+      /* Decode the whole segment while earlier segments are still
+         being delivered, reusing the frames of the previous batch. */
+      uint64_t count = last - first;
+      if (batch.size() < count) {
+        batch.resize(count);
+      }
+      for (uint64_t i = 0; i < count; i++) {
+        r.next(batch[i]);
+      }
+
+      std::unique_lock<std::mutex> lock(s.mutex);
+      s.turn_changed.wait(lock, [&] { return s.turn == segment || s.failed.load(); });
+      if (s.failed.load()) {
+        return;
+      }
+      lock.unlock();
+
+      for (uint64_t i = 0; i < count; i++) {
+        s.callback(first + i, batch[i]);
+      }
+
+      lock.lock();
+      s.turn++;
+      s.turn_changed.notify_all();
+    }
+
+    void work(scan &s, unsigned worker) {
+      try {
+        std::unique_ptr<TraceContainerReader> r = open_reader(s.filename);
+        std::vector<frame> batch;
+        for (;;) {
+          uint64_t segment = s.next_segment.fetch_add(1);
+          if (segment >= s.num_segments || s.failed.load()) {
+            return;
+          }
+          uint64_t first = segment * s.frames_per_segment;
+          uint64_t last = std::min(first + s.frames_per_segment, s.num_frames);
+          r->seek(first);
+          if (s.segments) {
+            (*s.segments)(worker, *r, first, last);
+          } else if (s.order == delivery_ordered) {
+            deliver_ordered(s, *r, batch, segment, first, last);
+          } else {
+            deliver_unordered(s, *r, first, last);
+          }
+        }
+      } catch (...) {
+        s.fail();
+      }
+    }
+
+    void run(scan &s, TraceContainerReader &reader, unsigned num_threads) {
+      s.num_frames = reader.get_num_frames();
+      s.frames_per_segment = reader.get_frames_per_toc_entry();
+      s.num_segments = (s.num_frames + s.frames_per_segment - 1) / s.frames_per_segment;
+
+      if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      num_threads = std::min<uint64_t>(num_threads, std::max<uint64_t>(s.num_segments, 1));
+
+      std::vector<std::thread> workers;
+      for (unsigned i = 0; i < num_threads; i++) {
+        workers.push_back(std::thread(work, std::ref(s), i));
+      }
+      for (std::vector<std::thread>::iterator i = workers.begin(); i != workers.end(); ++i) {
+        i->join();
+      }
+
+      if (s.error) {
+        std::rethrow_exception(s.error);
+      }
+    }
+  }
+
+  void parallel_for_each_frame(TraceContainerReader &reader,
+                               unsigned num_threads,
+                               const frame_callback &callback,
+                               delivery_order order) {
+    scan s(reader.get_filename(), callback, order);
+    run(s, reader, num_threads);
+  }
+
+  void parallel_for_each_segment(TraceContainerReader &reader,
+                                 unsigned num_threads,
+                                 const segment_callback &callback) {
+    frame_callback none;
+    scan s(reader.get_filename(), none, delivery_unordered);
+    s.segments = &callback;
+    run(s, reader, num_threads);
+  }
+
+  void parallel_for_each_frame(const std::string &filename,
+                               unsigned num_threads,
+                               const frame_callback &callback,
+                               delivery_order order) {
+    TraceContainerReader reader(filename);
+    parallel_for_each_frame(reader, num_threads, callback, order);
+  }
+};
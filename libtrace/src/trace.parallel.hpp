@@ -0,0 +1,68 @@
+#ifndef TRACE_PARALLEL_HPP
+#define TRACE_PARALLEL_HPP
+
+/**
+ * Parallel decoding of a trace.
+ *
+ * The table of contents splits a trace into segments of
+ * [frames_per_toc_entry] frames that can be located without reading
+ * the frames before them. The functions below hand these segments to
+ * a pool of worker threads, each with a reader of its own, so that
+ * a scan of the whole trace scales with the number of cores.
+ */
+
+#include <functional>
+#include <string>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** How frames are handed to the callback. */
+  enum delivery_order {
+    /** The callback is called concurrently from all workers, in no
+        particular order. It must be thread safe. */
+    delivery_unordered,
+    /** The callback is called from one thread at a time, in frame
+        order. Segments are still decoded in parallel, each worker
+        buffers a segment until it is its turn to deliver. */
+    delivery_ordered
+  };
+
+  /** Receives a frame and its number. The frame is only valid for
+      the duration of the call. */
+  typedef std::function<void(uint64_t, const frame &)> frame_callback;
+
+  /** Receives the number of the calling worker, a reader whose frame
+      pointer is at frame [first], and the end [last] of the segment
+      of frames [first, last) to read from it. */
+  typedef std::function<void(unsigned, TraceContainerReader &, uint64_t, uint64_t)> segment_callback;
+
+  /** Call [callback] on every frame of the trace in [filename], using
+      [num_threads] workers, or one per core if [num_threads] is 0.
+      If a worker fails, the others stop and the first exception is
+      rethrown. */
+  void parallel_for_each_frame(const std::string &filename,
+                               unsigned num_threads,
+                               const frame_callback &callback,
+                               delivery_order order = delivery_unordered);
+
+  /** Same as above, for the trace read by [reader]. The frame pointer
+      of [reader] is not moved. */
+  void parallel_for_each_frame(TraceContainerReader &reader,
+                               unsigned num_threads,
+                               const frame_callback &callback,
+                               delivery_order order = delivery_unordered);
+
+  /** Call [callback] on every segment of the trace read by [reader],
+      concurrently from [num_threads] workers, or one per core if
+      [num_threads] is 0, for callers that read the frames themselves,
+      say with [TraceContainerReader::next_raw]. Worker numbers start
+      at 0 and stay below that number of workers. Each worker claims
+      segments in increasing order. The frame pointer of [reader] is
+      not moved. */
+  void parallel_for_each_segment(TraceContainerReader &reader,
+                                 unsigned num_threads,
+                                 const segment_callback &callback);
+};
+
+#endif
@@ -0,0 +1,263 @@
+/**
+ * Implementation of the prefetching trace reader.
+ */
+
+#include "trace.prefetch.hpp"
+#include <algorithm>
+#include <string.h>
+#include "trace.codec.hpp"
+
+namespace SerializedTrace {
+
+  PrefetchingTraceReader::PrefetchingTraceReader(const std::string &filename,
+                                                 unsigned num_parsers,
+                                                 uint64_t queue_segments)
+    : reader (new TraceContainerReader(filename))
+    , current_frame (0)
+    , parse_segment (0)
+    , stopping (false)
+  {
+    /* Everything the consumer may ask for is read before the I/O
+       thread takes over the reader. */
+    meta = reader->get_meta();
+    arch = reader->get_arch();
+    machine = reader->get_machine();
+    trace_version = reader->get_trace_version();
+    num_frames = reader->get_num_frames();
+    frames_per_segment = reader->get_frames_per_toc_entry();
+    num_segments = (num_frames + frames_per_segment - 1) / frames_per_segment;
+
+    ring.resize(std::max<uint64_t>(queue_segments, 2));
+    for (std::vector<segment>::iterator i = ring.begin(); i != ring.end(); ++i) {
+      i->state = segment_free;
+      i->number = 0;
+      i->num_frames = 0;
+    }
+
+    if (num_parsers == 0) {
+      num_parsers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_parsers = std::min<uint64_t>(num_parsers, std::max<uint64_t>(num_segments, 1));
+
+    try {
+      io_thread = std::thread(&PrefetchingTraceReader::read_segments, this);
+      for (unsigned i = 0; i < num_parsers; i++) {
+        parsers.push_back(std::thread(&PrefetchingTraceReader::parse_segments, this));
+      }
+    } catch (...) {
+      stop();
+      throw;
+    }
+  }
+
+  PrefetchingTraceReader::~PrefetchingTraceReader(void) noexcept {
+    stop();
+  }
+
+  PrefetchingTraceReader::segment &PrefetchingTraceReader::current_segment(void) {
+    uint64_t number = current_frame / frames_per_segment;
+    segment &s = ring[number % ring.size()];
+    if (current_frame % frames_per_segment == 0) {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] {
+          return error || (s.state == segment_parsed && s.number == number);
+        });
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+    return s;
+  }
+
+  void PrefetchingTraceReader::advance(segment &s) {
+    current_frame++;
+    if (current_frame % frames_per_segment == 0 || current_frame == num_frames) {
+      /* Hand the slot back to the I/O thread. */
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        s.state = segment_free;
+      }
+      changed.notify_all();
+    }
+  }
+
+  bool PrefetchingTraceReader::next(frame &into) {
+    if (end_of_trace()) {
+      return false;
+    }
+
+    segment &s = current_segment();
+    into.Swap(&s.frames[current_frame % frames_per_segment]);
+    advance(s);
+    return true;
+  }
+
+  void PrefetchingTraceReader::for_each_frame(const std::function<bool(const frame &)> &visit) {
+    while (!end_of_trace()) {
+      segment &s = current_segment();
+      bool more = visit(s.frames[current_frame % frames_per_segment]);
+      advance(s);
+      if (!more) {
+        break;
+      }
+    }
+  }
+
+  std::unique_ptr<frame> PrefetchingTraceReader::get_frame(void) {
+    if (end_of_trace()) {
+      throw (TraceException("get_frame() on non-existant frame"));
+    }
+    std::unique_ptr<frame> f(new frame);
+    next(*f);
+    return f;
+  }
+
+  void PrefetchingTraceReader::read_segments(void) {
+    try {
+      for (uint64_t number = 0; number < num_segments; number++) {
+        segment &s = ring[number % ring.size()];
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&] { return stopping || s.state == segment_free; });
+          if (stopping) {
+            return;
+          }
+        }
+
+        /* Nobody else touches a free slot. */
+        s.number = number;
+        s.num_frames = std::min(frames_per_segment, num_frames - number * frames_per_segment);
+        reader->read_block(number, s.data);
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          s.state = segment_read;
+        }
+        changed.notify_all();
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  void PrefetchingTraceReader::parse_segments(void) {
+    FrameDecoder decoder;
+    std::vector<uint8_t> buf, decoded;
+    try {
+      for (;;) {
+        uint64_t number;
+        segment *s;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (stopping || parse_segment >= num_segments) {
+            return;
+          }
+          number = parse_segment++;
+          s = &ring[number % ring.size()];
+          /* The slot may still hold an earlier segment, being parsed
+             by another thread or waiting for the consumer. */
+          changed.wait(lock, [&] {
+              return stopping || (s->state == segment_read && s->number == number);
+            });
+          if (stopping) {
+            return;
+          }
+        }
+
+        parse(*s, decoder, buf, decoded);
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          s->state = segment_parsed;
+        }
+        changed.notify_all();
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  void PrefetchingTraceReader::parse(segment &s, FrameDecoder &decoder,
+                                     std::vector<uint8_t> &buf, std::vector<uint8_t> &decoded) {
+    const uint8_t *data = s.data.data();
+    uint64_t len = s.data.size();
+
+    if (trace_version >= blocked_trace_version) {
+      uint64_t header[block_header_size / sizeof(uint64_t)];
+      if (len < sizeof(header)) {
+        throw (TraceException("Truncated block"));
+      }
+      memcpy(header, data, sizeof(header));
+      uint64_t codec = header[0];
+      uint64_t raw_size = header[2];
+      uint64_t stored_size = header[3];
+      if (header[1] != s.num_frames || stored_size != len - sizeof(header)) {
+        throw (TraceException("Malformed block " + std::to_string(s.number)));
+      }
+      data += sizeof(header);
+      if (codec == block_codec_none) {
+        if (stored_size != raw_size) {
+          throw (TraceException("Malformed uncompressed block"));
+        }
+      } else {
+        if (buf.size() < raw_size) {
+          buf.resize(raw_size);
+        }
+        decompress_block(codec, data, stored_size, buf.data(), raw_size);
+        data = buf.data();
+      }
+      len = raw_size;
+
+      if (trace_version >= encoded_trace_version) {
+        len = decoder.decode_block(data, raw_size, s.num_frames, decoded);
+        data = decoded.data();
+      }
+    }
+
+    if (s.frames.size() < s.num_frames) {
+      s.frames.resize(s.num_frames);
+    }
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < s.num_frames; i++) {
+      uint64_t frame_len;
+      if (len - pos < sizeof(frame_len)) {
+        throw (TraceException("Truncated frame in segment " + std::to_string(s.number)));
+      }
+      memcpy(&frame_len, data + pos, sizeof(frame_len));
+      pos += sizeof(frame_len);
+      if (frame_len == 0 || len - pos < frame_len) {
+        throw (TraceException("Malformed frame length in segment " + std::to_string(s.number)));
+      }
+      if (!s.frames[i].ParseFromArray(data + pos, frame_len)) {
+        throw (TraceException("Unable to parse from string"));
+      }
+      pos += frame_len;
+    }
+  }
+
+  void PrefetchingTraceReader::fail(void) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      stopping = true;
+    }
+    changed.notify_all();
+  }
+
+  void PrefetchingTraceReader::stop(void) noexcept {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    if (io_thread.joinable()) {
+      io_thread.join();
+    }
+    for (std::vector<std::thread>::iterator i = parsers.begin(); i != parsers.end(); ++i) {
+      i->join();
+    }
+    parsers.clear();
+  }
+};
@@ -0,0 +1,181 @@
+#ifndef TRACE_PREFETCH_HPP
+#define TRACE_PREFETCH_HPP
+
+/**
+ * A pipelined front end for reading a trace from start to end.
+ *
+ * [TraceContainerReader::next] alternates between waiting for the
+ * disk and parsing frames on the caller's thread. The prefetching
+ * reader splits this work into three stages that run concurrently:
+ *
+ *  - an I/O thread reads the trace one toc entry worth of frames, a
+ *    segment, at a time, as stored, with a single read: whole blocks
+ *    for traces of version 4 and above, the serialized frames for
+ *    older ones;
+ *
+ *  - a pool of parser threads decompresses and decodes the blocks
+ *    and parses the frames of each segment;
+ *
+ *  - the consumer visits the parsed frames, in order, with
+ *    [for_each_frame], or takes them with [next].
+ *
+ * Segments go through a ring of [queue_segments] slots. The I/O
+ * thread waits when the ring is full, so at most that many segments
+ * are held in memory, and the consumer waits when the next segment
+ * is not parsed yet. The buffer and the frames of a slot are reused
+ * for the segments that go through it, so frames only allocate the
+ * first time through the ring.
+ *
+ * This only pays off when the parsers have cores of their own: with
+ * one or two cores, the threads compete with the consumer and the
+ * reader is slower than [TraceContainerReader::next]. Use it only
+ * after measuring it with benchtrace --prefetch on the target
+ * machine.
+ */
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t default_prefetch_segments = 8;
+
+  class PrefetchingTraceReader {
+
+  public:
+
+    /** Starts reading the trace in [filename] ahead of the consumer,
+        with [num_parsers] parser threads, or one per core if
+        [num_parsers] is 0, and room for [queue_segments] segments,
+        at least 2. */
+    PrefetchingTraceReader(const std::string &filename,
+                           unsigned num_parsers = 0,
+                           uint64_t queue_segments = default_prefetch_segments);
+
+    /** Stops the threads. */
+    ~PrefetchingTraceReader(void) noexcept;
+
+    /** Returns the number of frames in the trace. */
+    uint64_t get_num_frames(void) const noexcept { return num_frames; }
+
+    /** Returns the number of frames per toc entry, the size of a
+        segment. */
+    uint64_t get_frames_per_toc_entry(void) const noexcept { return frames_per_segment; }
+
+    /** Returns the architecture of the trace. */
+    frame_architecture get_arch(void) const noexcept { return arch; }
+
+    /** Returns the machine type (sub-architecture) of the trace. */
+    uint64_t get_machine(void) const noexcept { return machine; }
+
+    /** Returns the meta frame. */
+    const meta_frame *get_meta(void) const noexcept { return meta; }
+
+    /** Return true once every frame has been taken. */
+    bool end_of_trace(void) const noexcept { return current_frame >= num_frames; }
+
+    /** Move the next frame into [into], whose previous contents may
+        be reused for later frames, waiting for it to be parsed if
+        needed. Returns false at the end of the trace. Throws the
+        first exception raised while reading or parsing. */
+    bool next(frame &into);
+
+    /** Call [visit] on every frame from the next one to the end of
+        the trace, or until [visit] returns false, without copying
+        them. A frame is only valid during its call. Throws like
+        [next]. */
+    void for_each_frame(const std::function<bool(const frame &)> &visit);
+
+    /** Return the next frame. Throws [TraceException] at the end of
+        the trace. */
+    std::unique_ptr<frame> get_frame(void);
+
+  private:
+
+    /** What a segment slot holds. */
+    enum segment_state {
+      /** Free, to be filled by the I/O thread. */
+      segment_free,
+      /** Read, to be parsed. */
+      segment_read,
+      /** Parsed, to be taken by the consumer. */
+      segment_parsed
+    };
+
+    struct segment {
+      segment_state state;
+      uint64_t number;
+      /** The segment as stored: a block, header included, or the
+          frames, each preceded by its uint64_t size. */
+      std::vector<uint8_t> data;
+      /** Its frames, [num_frames] of which are in use. */
+      std::vector<frame> frames;
+      uint64_t num_frames;
+    };
+
+    /** Reader used by the I/O thread only, once it has started. */
+    std::unique_ptr<TraceContainerReader> reader;
+
+    const meta_frame *meta;
+    frame_architecture arch;
+    uint64_t machine;
+    uint64_t trace_version;
+    uint64_t num_frames;
+    uint64_t frames_per_segment;
+    uint64_t num_segments;
+
+    /** The ring of segments; segment [n] goes to slot [n % size]. */
+    std::vector<segment> ring;
+
+    /** Number of the next frame the consumer takes. */
+    uint64_t current_frame;
+
+    /** Return the slot of the frame the consumer takes next, waiting
+        for it to be parsed. */
+    segment &current_segment(void);
+
+    /** Count the frame just taken, and free its slot after the last
+        frame of the segment. */
+    void advance(segment &s);
+
+    /** Guards the fields below and the state of the segments. */
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    /** Next segment to be claimed by a parser. */
+    uint64_t parse_segment;
+
+    /** Set by the destructor, or when a thread fails. */
+    bool stopping;
+    std::exception_ptr error;
+
+    std::thread io_thread;
+    std::vector<std::thread> parsers;
+
+    /** The I/O thread loop. */
+    void read_segments(void);
+
+    /** The parser thread loop. */
+    void parse_segments(void);
+
+    /** Parse the frames of [s] from its data. [buf] and [decoded]
+        are scratch buffers of the calling thread. */
+    void parse(segment &s, FrameDecoder &decoder,
+               std::vector<uint8_t> &buf, std::vector<uint8_t> &decoded);
+
+    /** Record the exception being handled and stop the threads. */
+    void fail(void);
+
+    /** Stop and join the threads. */
+    void stop(void) noexcept;
+  };
+};
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * Implementation of trace queries.
+ */
+
+#include "trace.query.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    const uint32_t all_kinds = (1U << num_frame_kinds) - 1;
+
+    /** Kinds of frames that have a program counter or thread. */
+    const uint32_t located_kinds =
+      (1U << frame_kind_std) | (1U << frame_kind_syscall) | (1U << frame_kind_exception);
+
+    /** Return the mask of the frame kinds that may match [query]. */
+    uint32_t query_kinds(const trace_query &query) {
+      uint32_t kinds = all_kinds;
+      if (query.match_pc || query.match_thread) {
+        kinds &= located_kinds;
+      }
+      if (query.match_store) {
+        kinds &= 1U << frame_kind_std;
+      }
+      if (query.match_syscall) {
+        kinds &= 1U << frame_kind_syscall;
+      }
+      return kinds;
+    }
+
+    bool stores_to(const std_frame &s, uint64_t address) {
+      const operand_value_list *lists[] = { &s.operand_pre_list(), &s.operand_post_list() };
+      for (int l = 0; l < 2; l++) {
+        for (int i = 0; i < lists[l]->elem_size(); i++) {
+          uint64_t low, high;
+          if (operand_store(lists[l]->elem(i), low, high) && low <= address && address <= high) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+  }
+
+  bool query_matches(const trace_query &query, const frame &f) {
+    if (query.match_pc) {
+      uint64_t pc;
+      if (!frame_pc(f, pc) || pc < query.pc_low || pc >= query.pc_high) {
+        return false;
+      }
+    }
+    if (query.match_thread) {
+      uint64_t pc, thread_id;
+      frame_kind kind;
+      frame_columns_of(f, pc, thread_id, kind);
+      if (thread_id == no_thread_id || thread_id != query.thread_id) {
+        return false;
+      }
+    }
+    if (query.match_store) {
+      if (!f.has_std_frame() || !stores_to(f.std_frame(), query.store_address)) {
+        return false;
+      }
+    }
+    if (query.match_syscall) {
+      if (!f.has_syscall_frame() || f.syscall_frame().number() != query.syscall_number) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool query_excludes(const trace_query &query, const block_summary &summary) {
+    return (query.match_pc && !summary.may_have_pc(query.pc_low, query.pc_high))
+      || (query.match_thread && !summary.may_have_thread(query.thread_id))
+      || (query.match_store && !summary.may_store_to(query.store_address))
+      || (query.match_syscall && !summary.may_have_syscall(query.syscall_number));
+  }
+
+  uint64_t run_query(TraceContainerReader &reader,
+                     const trace_query &query,
+                     const query_callback &visit,
+                     const FrameColumns *columns) {
+    uint64_t matches = 0;
+    uint64_t first = query.first_frame;
+    uint64_t last = std::min(query.last_frame, reader.get_num_frames());
+    uint32_t kinds = query_kinds(query);
+    if (first >= last || kinds == 0 || (query.match_pc && query.pc_low >= query.pc_high)) {
+      return 0;
+    }
+
+    column_filter filter;
+    filter.kinds = kinds;
+    if (query.match_pc) {
+      filter.pc_low = query.pc_low;
+      filter.pc_high = query.pc_high;
+    }
+    if (query.match_thread) {
+      filter.match_thread = true;
+      filter.thread_id = query.thread_id;
+    }
+
+    BlockTable *table = reader.get_block_table();
+    uint64_t m = reader.get_frames_per_toc_entry();
+    std::vector<uint64_t> candidates;
+    scanned_frame scanned;
+    frame f;
+
+    /* Go through the trace one toc entry, or block, at a time. */
+    for (uint64_t block = first / m; block * m < last; block++) {
+      uint64_t block_first = std::max(first, block * m);
+      uint64_t block_last = std::min(last, (block + 1) * m);
+
+      if (table) {
+        const toc_block &b = table->get_block(block);
+        bool has_kind = false;
+        for (int k = 0; k < num_frame_kinds; k++) {
+          has_kind |= ((kinds >> k) & 1) && b.kind_counts[k] > 0;
+        }
+        if (!has_kind) {
+          continue;
+        }
+        if (table->has_summaries() && query_excludes(query, table->get_summary(block))) {
+          continue;
+        }
+      }
+
+      if (columns) {
+        candidates.clear();
+        columns->scan(filter, candidates, block_first, block_last);
+        for (std::vector<uint64_t>::iterator i = candidates.begin(); i != candidates.end(); ++i) {
+          reader.seek(*i);
+          reader.next(f);
+          if (query_matches(query, f)) {
+            matches++;
+            if (!visit(*i, f)) {
+              return matches;
+            }
+          }
+        }
+      } else {
+        reader.seek(block_first);
+        for (uint64_t i = block_first; i < block_last; i++) {
+          /* Rule frames out on their columns before parsing them. */
+          uint64_t len;
+          const uint8_t *data = reader.next_raw(len);
+          if (!scan_frame(data, len, frame_fields_located, scanned)) {
+            throw (TraceException("Unable to scan frame " + std::to_string(i)));
+          }
+          if (!filter.matches(scanned.address, scanned.thread_id, scanned.kind)) {
+            continue;
+          }
+          if (!f.ParseFromArray(data, len)) {
+            throw (TraceException("Unable to parse from string"));
+          }
+          if (query_matches(query, f)) {
+            matches++;
+            if (!visit(i, f)) {
+              return matches;
+            }
+          }
+        }
+      }
+    }
+    return matches;
+  }
+};
@@ -0,0 +1,88 @@
+#ifndef TRACE_QUERY_HPP
+#define TRACE_QUERY_HPP
+
+/**
+ * Queries that select the frames of a trace by program counter,
+ * thread, memory stores and system calls.
+ *
+ * A query only decodes the frames that may match. Blocks of a
+ * version 4 trace are skipped with the block table and, if the trace
+ * has them, the block summaries. Within the remaining frames, the
+ * frame columns of the trace, if given, select the frames that match
+ * on program counter, thread and kind before any of them is decoded.
+ * Without columns, these fields are scanned from the serialized
+ * frames, and only the frames that match on them are parsed.
+ */
+
+#include <functional>
+#include <stdint.h>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** The conditions of a query, all of which a frame has to meet. By
+      default, every frame matches. */
+  struct trace_query {
+    /** Only match frames in [first_frame, last_frame). */
+    uint64_t first_frame;
+    uint64_t last_frame;
+
+    /** If [match_pc] is true, only match frames with a program
+        counter in [pc_low, pc_high). */
+    bool match_pc;
+    uint64_t pc_low;
+    uint64_t pc_high;
+
+    /** If [match_thread] is true, only match frames of
+        [thread_id]. */
+    bool match_thread;
+    uint64_t thread_id;
+
+    /** If [match_store] is true, only match standard frames that
+        write to the byte at [store_address]. */
+    bool match_store;
+    uint64_t store_address;
+
+    /** If [match_syscall] is true, only match system calls number
+        [syscall_number]. */
+    bool match_syscall;
+    uint64_t syscall_number;
+
+    trace_query(void)
+      : first_frame (0)
+      , last_frame (~0ULL)
+      , match_pc (false)
+      , pc_low (0)
+      , pc_high (0)
+      , match_thread (false)
+      , thread_id (0)
+      , match_store (false)
+      , store_address (0)
+      , match_syscall (false)
+      , syscall_number (0)
+    { }
+  };
+
+  /** Called with the number and contents of every matching frame.
+      Returns false to stop the query. */
+  typedef std::function<bool(uint64_t, const frame &)> query_callback;
+
+  /** Return true if [f] meets the conditions of [query], other than
+      the frame range. */
+  bool query_matches(const trace_query &query, const frame &f);
+
+  /** Return true if no frame of a block with [summary] can meet the
+      conditions of [query]. */
+  bool query_excludes(const trace_query &query, const block_summary &summary);
+
+  /** Call [visit] on every frame of [reader] that matches [query], in
+      order. [columns], if not NULL, must be the frame columns of the
+      trace. Moves the frame pointer of [reader]. Returns the number
+      of matching frames that were visited. */
+  uint64_t run_query(TraceContainerReader &reader,
+                     const trace_query &query,
+                     const query_callback &visit,
+                     const FrameColumns *columns = NULL);
+};
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * Implementation of the frame scanner.
+ */
+
+#include "trace.scan.hpp"
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  namespace {
+
+    /** The fields each kind of frame may have. */
+    uint32_t kind_fields(frame_kind kind) noexcept {
+      switch (kind) {
+      case frame_kind_std:
+        return frame_field_address | frame_field_thread_id | frame_field_rawbytes
+          | frame_field_operands | frame_field_mode;
+      case frame_kind_syscall:
+        return frame_field_address | frame_field_thread_id | frame_field_syscall_number;
+      case frame_kind_exception:
+        return frame_field_address | frame_field_thread_id;
+      default:
+        return 0;
+      }
+    }
+
+    /** Return the [frame_field] that field [number] of a frame of
+        [kind] holds, or 0 if none, and whether it is length
+        delimited in [bytes]. */
+    uint32_t field_of(frame_kind kind, uint32_t number, bool &bytes) noexcept {
+      bytes = false;
+      if (kind == frame_kind_std) {
+        switch (number) {
+        case 1: return frame_field_address;
+        case 2: return frame_field_thread_id;
+        case 3: bytes = true; return frame_field_rawbytes;
+        case 4: bytes = true; return frame_field_operands;
+        case 5: bytes = true; return frame_field_operands;
+        case 6: bytes = true; return frame_field_mode;
+        }
+      } else if (kind == frame_kind_syscall) {
+        switch (number) {
+        case 1: return frame_field_address;
+        case 2: return frame_field_thread_id;
+        case 3: return frame_field_syscall_number;
+        }
+      } else if (kind == frame_kind_exception) {
+        switch (number) {
+        case 2: return frame_field_thread_id;
+        case 3: return frame_field_address;
+        }
+      }
+      return 0;
+    }
+
+    /** Store field [f], which holds [field], in [into]. */
+    void store_field(uint32_t field, const wire_field &f, scanned_frame &into) noexcept {
+      switch (field) {
+      case frame_field_address:
+        into.address = f.value;
+        break;
+      case frame_field_thread_id:
+        into.thread_id = f.value;
+        break;
+      case frame_field_rawbytes:
+        into.rawbytes = f.data;
+        into.rawbytes_len = f.len;
+        break;
+      case frame_field_operands:
+        into.operand_pre_list = f.data;
+        into.operand_pre_list_len = f.len;
+        break;
+      case frame_field_mode:
+        into.mode = f.data;
+        into.mode_len = f.len;
+        break;
+      case frame_field_syscall_number:
+        into.syscall_number = f.value;
+        break;
+      }
+    }
+  }
+
+  bool scan_frame(const uint8_t *data, uint64_t len, uint32_t fields,
+                  scanned_frame &into) noexcept {
+    into.kind = frame_kind_unknown;
+    into.fields = 0;
+    into.address = 0;
+    into.thread_id = no_thread_id;
+    into.rawbytes = NULL;
+    into.rawbytes_len = 0;
+    into.operand_pre_list = NULL;
+    into.operand_pre_list_len = 0;
+    into.operand_post_list = NULL;
+    into.operand_post_list_len = 0;
+    into.mode = NULL;
+    into.mode_len = 0;
+    into.syscall_number = 0;
+
+    /* Like [serialized_frame_kind], the first field, which holds the
+       variant, gives the kind. */
+    wire_input frame_input(data, len);
+    wire_field variant;
+    if (!frame_input.next(variant) || variant.type != wire_bytes) {
+      return false;
+    }
+    if (variant.number >= num_frame_kinds) {
+      return true;
+    }
+    into.kind = (frame_kind) variant.number;
+
+    uint32_t wanted = fields & kind_fields(into.kind);
+    /* Operands are only complete at the end of the frame, where the
+       post list may follow. */
+    bool to_end = (wanted & frame_field_operands) != 0;
+    wire_input input(variant.data, variant.len);
+    wire_field f;
+    while ((to_end || (into.fields & wanted) != wanted) && !input.at_end()) {
+      if (!input.next(f)) {
+        return false;
+      }
+      bool bytes;
+      uint32_t field = field_of(into.kind, f.number, bytes);
+      if (!(field & wanted) || f.type != (bytes ? wire_bytes : wire_varint)) {
+        continue;
+      }
+      if (into.kind == frame_kind_std && f.number == 5) {
+        if (!into.operand_post_list) {
+          into.operand_post_list = f.data;
+          into.operand_post_list_len = f.len;
+        }
+      } else if (!(into.fields & field)) {
+        into.fields |= field;
+        store_field(field, f, into);
+      }
+    }
+    return true;
+  }
+
+  void parse_frame_fields(const uint8_t *data, uint64_t len, uint32_t fields,
+                          frame &into) {
+    scanned_frame s;
+    if (!scan_frame(data, len, fields, s)) {
+      throw (TraceException("Unable to scan frame"));
+    }
+    if (s.kind != frame_kind_std) {
+      if (!into.ParseFromArray(data, len)) {
+        throw (TraceException("Unable to parse from string"));
+      }
+      return;
+    }
+
+    into.Clear();
+    std_frame *f = into.mutable_std_frame();
+    if (s.fields & frame_field_address) {
+      f->set_address(s.address);
+    }
+    if (s.fields & frame_field_thread_id) {
+      f->set_thread_id(s.thread_id);
+    }
+    if (s.fields & frame_field_rawbytes) {
+      f->set_rawbytes(s.rawbytes, s.rawbytes_len);
+    }
+    operand_value_list *pre = f->mutable_operand_pre_list();
+    if (fields & frame_field_operands) {
+      if ((s.operand_pre_list &&
+           !pre->ParseFromArray(s.operand_pre_list, s.operand_pre_list_len)) ||
+          (s.operand_post_list &&
+           !f->mutable_operand_post_list()->ParseFromArray(s.operand_post_list,
+                                                           s.operand_post_list_len))) {
+        throw (TraceException("Unable to parse operands"));
+      }
+    }
+    if (s.fields & frame_field_mode) {
+      f->set_mode(reinterpret_cast<const char *>(s.mode), s.mode_len);
+    }
+  }
+};
@@ -0,0 +1,183 @@
+#ifndef TRACE_SCAN_HPP
+#define TRACE_SCAN_HPP
+
+/**
+ * Partial decoding of serialized frames.
+ *
+ * Parsing a standard frame decodes both of its operand lists,
+ * including the value of every operand, even when the caller only
+ * wants its address. The scanner below walks the protobuf wire format
+ * of a frame instead, and pulls out only the fields selected by a
+ * mask of [frame_field]s. It stops as soon as it has found them, so
+ * that asking for the address and thread id of a standard frame never
+ * touches its operands.
+ *
+ * Fields that a frame repeats, which the library never writes, are
+ * taken from their first occurrence.
+ */
+
+#include <stdint.h>
+#include "frame.piqi.pb.h"
+#include "trace.columns.hpp"
+#include "trace.toc.hpp"
+
+namespace SerializedTrace {
+
+  /** Fields that can be pulled out of a frame. */
+  enum frame_field {
+    /** The address of standard and system call frames, and the
+        source address of exception frames. */
+    frame_field_address = 1 << 0,
+    frame_field_thread_id = 1 << 1,
+    /** The instruction bytes of standard frames. */
+    frame_field_rawbytes = 1 << 2,
+    /** The operand lists of standard frames. */
+    frame_field_operands = 1 << 3,
+    /** The mode of standard frames. */
+    frame_field_mode = 1 << 4,
+    /** The number of system call frames. */
+    frame_field_syscall_number = 1 << 5,
+
+    /** The fields of the frame columns. */
+    frame_fields_located = frame_field_address | frame_field_thread_id,
+    frame_fields_all = (1 << 6) - 1
+  };
+
+  /** The fields of a scanned frame. The pointers point into the
+      serialized frame. */
+  struct scanned_frame {
+    frame_kind kind;
+
+    /** The [frame_field]s that were asked for and found. Fields not
+        found keep the values below. */
+    uint32_t fields;
+
+    /** 0 if not found. */
+    uint64_t address;
+
+    /** [no_thread_id] if not found. */
+    uint64_t thread_id;
+
+    const uint8_t *rawbytes;
+    uint64_t rawbytes_len;
+
+    /** The serialized [operand_value_list]s. */
+    const uint8_t *operand_pre_list;
+    uint64_t operand_pre_list_len;
+    const uint8_t *operand_post_list;
+    uint64_t operand_post_list_len;
+
+    const uint8_t *mode;
+    uint64_t mode_len;
+
+    uint64_t syscall_number;
+  };
+
+  /** Protobuf wire types. */
+  enum wire_type {
+    wire_varint = 0,
+    wire_fixed64 = 1,
+    wire_bytes = 2,
+    wire_fixed32 = 5
+  };
+
+  /** A field of a serialized message. */
+  struct wire_field {
+    uint32_t number;
+    uint32_t type;
+    /** The value of varint and fixed fields. */
+    uint64_t value;
+    /** The contents of length delimited fields. */
+    const uint8_t *data;
+    uint64_t len;
+  };
+
+  /** Reads the fields of a serialized message, one at a time. */
+  class wire_input {
+
+  public:
+
+    wire_input(const uint8_t *data, uint64_t len)
+      : p (data)
+      , end (data + len)
+    { }
+
+    bool at_end(void) const noexcept { return p == end; }
+
+    /** Read the next field into [f]. Returns false if it is
+        malformed. */
+    bool next(wire_field &f) noexcept {
+      uint64_t key;
+      if (!varint(key) || (key >> 3) == 0 || (key >> 3) > 0xffffffffULL) {
+        return false;
+      }
+      f.number = key >> 3;
+      f.type = key & 7;
+      switch (f.type) {
+      case wire_varint:
+        return varint(f.value);
+      case wire_fixed64:
+        return fixed(f.value, 8);
+      case wire_fixed32:
+        return fixed(f.value, 4);
+      case wire_bytes:
+        if (!varint(f.len) || f.len > (uint64_t) (end - p)) {
+          return false;
+        }
+        f.data = p;
+        p += f.len;
+        return true;
+      default:
+        return false;
+      }
+    }
+
+  private:
+
+    const uint8_t *p;
+    const uint8_t *end;
+
+    bool varint(uint64_t &v) noexcept {
+      v = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end) {
+          return false;
+        }
+        uint8_t b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool fixed(uint64_t &v, int size) noexcept {
+      if (end - p < size) {
+        return false;
+      }
+      v = 0;
+      for (int i = 0; i < size; i++) {
+        v |= (uint64_t) p[i] << (8 * i);
+      }
+      p += size;
+      return true;
+    }
+  };
+
+  /** Scan the frame serialized in the [len] bytes at [data] for the
+      [fields], a mask of [frame_field]s, and store them in [into].
+      Returns false if the frame is malformed. */
+  bool scan_frame(const uint8_t *data, uint64_t len, uint32_t fields,
+                  scanned_frame &into) noexcept;
+
+  /** Parse only the [fields] of the frame serialized in the [len]
+      bytes at [data] into [into]. Fields of a standard frame that
+      were not asked for are left empty; the other kinds of frames are
+      parsed whole. Throws [TraceException] if the frame is
+      malformed. */
+  void parse_frame_fields(const uint8_t *data, uint64_t len, uint32_t fields,
+                          frame &into);
+};
+
+#endif
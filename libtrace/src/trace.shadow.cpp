@@ -0,0 +1,335 @@
+/**
+ * Implementation of shadow memory.
+ */
+
+#include "trace.shadow.hpp"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <unordered_map>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    bool seek_file(FILE *f, uint64_t offset) {
+#ifdef _WIN32
+      return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+      return fseeko(f, offset, SEEK_SET) == 0;
+#endif
+    }
+
+    bool version_before(const shadow_version &a, const shadow_version &b) {
+      return a.page < b.page || (a.page == b.page && a.snapshot < b.snapshot);
+    }
+
+    void set_byte(shadow_page &p, uint64_t address, uint8_t byte) {
+      uint64_t i = address & (shadow_page_size - 1);
+      p.bytes[i] = byte;
+      p.known[i >> 3] |= 1 << (i & 7);
+    }
+
+    /** Replays the memory operands of the frames of a trace. */
+    class memory_replay {
+
+    public:
+
+      /** Call [store] with the address and value of every memory
+          operand of the frame at the frame pointer of [reader], in the
+          order of [MachineState::apply], and with the memory values of
+          key frames. Advances the frame pointer. */
+      template <typename Store>
+      void next(TraceContainerReader &reader, Store store) {
+        uint64_t len;
+        const uint8_t *data = reader.next_raw(len);
+        scanned_frame s;
+        if (!data || !scan_frame(data, len, frame_field_operands, s)) {
+          throw (TraceException("Unable to scan frame"));
+        }
+        if (s.kind == frame_kind_std) {
+          replay(s.operand_pre_list, s.operand_pre_list_len, store);
+          replay(s.operand_post_list, s.operand_post_list_len, store);
+        } else if (s.kind == frame_kind_key) {
+          if (!key.ParseFromArray(data, len)) {
+            throw (TraceException("Unable to parse from string"));
+          }
+          const tagged_value_lists &lists = key.key_frame().tagged_value_lists();
+          for (int i = 0; i < lists.elem_size(); i++) {
+            const value_list &values = lists.elem(i).value_list();
+            for (int j = 0; j < values.elem_size(); j++) {
+              const value_info &v = values.elem(j);
+              if (v.operand_info_specific().has_mem_operand()) {
+                store(v.operand_info_specific().mem_operand().address(), v.value());
+              }
+            }
+          }
+        }
+      }
+
+    private:
+
+      operand_value_list operands;
+      frame key;
+
+      template <typename Store>
+      void replay(const uint8_t *data, uint64_t len, Store store) {
+        if (!data) {
+          return;
+        }
+        if (!operands.ParseFromArray(data, len)) {
+          throw (TraceException("Unable to parse operands"));
+        }
+        for (int i = 0; i < operands.elem_size(); i++) {
+          const operand_info &o = operands.elem(i);
+          if (o.operand_info_specific().has_mem_operand()) {
+            store(o.operand_info_specific().mem_operand().address(), o.value());
+          }
+        }
+      }
+    };
+
+    /** The state of [ShadowMemory::build]. */
+    class shadow_builder {
+
+    public:
+
+      shadow_builder(FILE *out_in)
+        : out (out_in)
+        , end (shadow_header_size)
+      { }
+
+      void store(uint64_t address, const std::string &value) {
+        shadow_page *p = NULL;
+        uint64_t current = 0;
+        for (std::string::size_type i = 0; i < value.size(); i++) {
+          uint64_t page = (address + i) >> shadow_page_bits;
+          if (!p || page != current) {
+            p = &page_for(page);
+            current = page;
+          }
+          set_byte(*p, address + i, value[i]);
+        }
+      }
+
+      /** Write the pages changed since the last snapshot as versions
+          of snapshot [snapshot]. */
+      void snapshot(uint64_t snapshot) {
+        if (dirty.empty()) {
+          return;
+        }
+        if (!seek_file(out, end)) {
+          throw (TraceException("Unable to seek in shadow memory"));
+        }
+        for (std::unordered_map<uint64_t, std::unique_ptr<shadow_page> >::iterator i = dirty.begin();
+             i != dirty.end(); ++i) {
+          if (fwrite(i->second.get(), sizeof(shadow_page), 1, out) != 1) {
+            throw (TraceException("Unable to write shadow memory"));
+          }
+          shadow_version v = { i->first, snapshot, end };
+          versions.push_back(v);
+          latest[i->first] = end;
+          end += sizeof(shadow_page);
+        }
+        dirty.clear();
+      }
+
+      FILE *out;
+
+      /** Offset of the end of the page images. */
+      uint64_t end;
+
+      std::vector<shadow_version> versions;
+
+    private:
+
+      /** The pages changed since the last snapshot. */
+      std::unordered_map<uint64_t, std::unique_ptr<shadow_page> > dirty;
+
+      /** The offset of the last version of every page. */
+      std::unordered_map<uint64_t, uint64_t> latest;
+
+      /** Return page [page] for writing, reading its last version
+          back if it has one. */
+      shadow_page &page_for(uint64_t page) {
+        std::unique_ptr<shadow_page> &p = dirty[page];
+        if (!p) {
+          p.reset(new shadow_page);
+          std::unordered_map<uint64_t, uint64_t>::iterator i = latest.find(page);
+          if (i == latest.end()) {
+            memset(p.get(), 0, sizeof(shadow_page));
+          } else if (!seek_file(out, i->second) || fread(p.get(), sizeof(shadow_page), 1, out) != 1) {
+            throw (TraceException("Unable to read back shadow memory"));
+          }
+        }
+        return *p;
+      }
+    };
+  }
+
+  ShadowMemory::ShadowMemory(TraceContainerReader &reader_in, const std::string &filename)
+    : reader (reader_in)
+    , f (NULL)
+  {
+    f = fopen(filename.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open shadow memory " + filename));
+    }
+
+    uint64_t header[shadow_header_size / sizeof(uint64_t)];
+    if (fread(header, sizeof(header), 1, f) != 1) {
+      fclose(f);
+      throw (TraceException("Unable to read shadow memory header"));
+    }
+    trace.trace_version = header[2];
+    trace.num_frames = header[3];
+    trace.toc_offset = header[4];
+    trace.trace_size = header[5];
+    frames_per_snapshot = header[6];
+    if (header[0] != shadow_magic_number || header[1] != shadow_version_number ||
+        !(trace == reader.indexed_trace()) || frames_per_snapshot == 0) {
+      fclose(f);
+      throw (TraceException("Shadow memory " + filename + " does not match the trace"));
+    }
+
+    versions.resize(header[7]);
+    if (!seek_file(f, header[8]) ||
+        fread(versions.data(), sizeof(shadow_version), versions.size(), f) != versions.size()) {
+      fclose(f);
+      throw (TraceException("Shadow memory " + filename + " is truncated"));
+    }
+  }
+
+  ShadowMemory::~ShadowMemory(void) noexcept {
+    fclose(f);
+  }
+
+  uint64_t ShadowMemory::read(uint64_t frame_number, uint64_t address, uint64_t len,
+                              uint8_t *bytes, bool *known) {
+    if (frame_number > trace.num_frames) {
+      throw (TraceException("read() of memory past the end of the trace"));
+    }
+    if (len == 0) {
+      return 0;
+    }
+    if (address + (len - 1) < address) {
+      throw (TraceException("read() of memory past the end of the address space"));
+    }
+
+    uint64_t snapshot = frame_number / frames_per_snapshot;
+    uint64_t first_page = address >> shadow_page_bits;
+    std::vector<shadow_page> pages(((address + (len - 1)) >> shadow_page_bits) - first_page + 1);
+    for (uint64_t i = 0; i < pages.size(); i++) {
+      load_page(first_page + i, snapshot, pages[i]);
+    }
+
+    uint64_t start = snapshot * frames_per_snapshot;
+    if (start < frame_number) {
+      memory_replay replay;
+      reader.seek(start);
+      for (uint64_t n = start; n < frame_number; n++) {
+        replay.next(reader, [&](uint64_t at, const std::string &value) {
+            for (std::string::size_type i = 0; i < value.size(); i++) {
+              if (at + i - address < len) {
+                set_byte(pages[((at + i) >> shadow_page_bits) - first_page], at + i, value[i]);
+              }
+            }
+          });
+      }
+    }
+
+    uint64_t num_known = 0;
+    for (uint64_t i = 0; i < len; i++) {
+      const shadow_page &p = pages[((address + i) >> shadow_page_bits) - first_page];
+      uint64_t o = (address + i) & (shadow_page_size - 1);
+      known[i] = (p.known[o >> 3] >> (o & 7)) & 1;
+      bytes[i] = known[i] ? p.bytes[o] : 0;
+      num_known += known[i];
+    }
+    return num_known;
+  }
+
+  void ShadowMemory::load_page(uint64_t page, uint64_t snapshot, shadow_page &into) {
+    /* The last version of the page at or before the snapshot. */
+    shadow_version key = { page, snapshot, 0 };
+    std::vector<shadow_version>::const_iterator v =
+      std::upper_bound(versions.begin(), versions.end(), key, version_before);
+    if (v == versions.begin() || (--v)->page != page) {
+      memset(&into, 0, sizeof(into));
+      return;
+    }
+    if (!seek_file(f, v->offset) || fread(&into, sizeof(into), 1, f) != 1) {
+      throw (TraceException("Unable to read page from shadow memory"));
+    }
+  }
+
+  void ShadowMemory::build(TraceContainerReader &reader, const std::string &filename,
+                           uint64_t frames_per_snapshot) {
+    if (frames_per_snapshot == 0) {
+      throw (TraceException("Shadow memory needs a positive number of frames per snapshot"));
+    }
+    std::string tmp = filename + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "w+b");
+    if (!out) {
+      throw (TraceException("Unable to open shadow memory " + tmp + " for writing"));
+    }
+
+    try {
+      shadow_builder builder(out);
+      memory_replay replay;
+      uint64_t num_frames = reader.get_num_frames();
+      if (num_frames > 0) {
+        reader.seek(0);
+      }
+      for (uint64_t n = 0; n < num_frames; n++) {
+        if (n > 0 && n % frames_per_snapshot == 0) {
+          builder.snapshot(n / frames_per_snapshot);
+        }
+        replay.next(reader, [&](uint64_t address, const std::string &value) {
+            builder.store(address, value);
+          });
+      }
+      if (num_frames > 0 && num_frames % frames_per_snapshot == 0) {
+        builder.snapshot(num_frames / frames_per_snapshot);
+      }
+
+      /* Versions were added snapshot by snapshot. */
+      std::stable_sort(builder.versions.begin(), builder.versions.end(),
+                       [](const shadow_version &a, const shadow_version &b) { return a.page < b.page; });
+
+      IndexedTrace trace = reader.indexed_trace();
+      uint64_t header[shadow_header_size / sizeof(uint64_t)] = {
+        shadow_magic_number,
+        shadow_version_number,
+        trace.trace_version,
+        trace.num_frames,
+        trace.toc_offset,
+        trace.trace_size,
+        frames_per_snapshot,
+        builder.versions.size(),
+        builder.end,
+        0
+      };
+      if (!seek_file(out, builder.end) ||
+          fwrite(builder.versions.data(), sizeof(shadow_version), builder.versions.size(), out)
+          != builder.versions.size() ||
+          !seek_file(out, 0) ||
+          fwrite(header, sizeof(header), 1, out) != 1) {
+        throw (TraceException("Unable to write shadow memory " + tmp));
+      }
+    } catch (...) {
+      fclose(out);
+      remove(tmp.c_str());
+      throw;
+    }
+
+    if (fclose(out) != 0 || rename(tmp.c_str(), filename.c_str()) != 0) {
+      remove(tmp.c_str());
+      throw (TraceException("Unable to write shadow memory " + filename));
+    }
+  }
+
+  std::string ShadowMemory::filename_for(const std::string &trace_filename) {
+    return trace_filename + ".shadow";
+  }
+};
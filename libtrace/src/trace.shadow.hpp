@@ -0,0 +1,132 @@
+#ifndef TRACE_SHADOW_HPP
+#define TRACE_SHADOW_HPP
+
+/**
+ * Shadow memory: the contents of memory at any frame of a trace,
+ * rebuilt from the values of its memory operands.
+ *
+ * Memory is tracked in pages of [shadow_page_size] bytes, each with a
+ * bit per byte telling whether any operand has shown that byte yet.
+ * [ShadowMemory::build] scans the trace once and takes a snapshot of
+ * memory every [frames_per_snapshot] frames, before frames 0, k, 2k,
+ * and so on. A snapshot only stores the pages that changed since the
+ * previous one; the other pages are shared with earlier snapshots, so
+ * taking a snapshot costs as much as the pages written since the last
+ * one. While building, only those pages are kept in memory, earlier
+ * versions are read back from the file, so memory use does not grow
+ * with the footprint of the trace.
+ *
+ * To read memory at frame N, [ShadowMemory::read] loads the pages of
+ * the last snapshot at or before N and replays at most k - 1 frames.
+ *
+ * The shadow memory is stored next to the trace, in
+ * [ShadowMemory::filename_for] the trace. Its format, all numbers in
+ * the byte order of the trace:
+ *
+ * [<uint64_t shadow magic number>
+ *  <uint64_t shadow version number>
+ *  <uint64_t trace version number>
+ *  <uint64_t n = number of trace frames>
+ *  <uint64_t offset of the trace toc>
+ *  <uint64_t size of the trace file>
+ *  <uint64_t k = frames per snapshot>
+ *  <uint64_t v = number of page versions>
+ *  <uint64_t offset of the version table>
+ *  <uint64_t 0>
+ *  <page images, each a [shadow_page]>
+ *  <v [shadow_version]s, sorted by page and snapshot>]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t shadow_magic_number = 0x776f646168732d6dLL;
+  const uint64_t shadow_version_number = 1LL;
+  const uint64_t shadow_header_size = 80LL;
+
+  const uint64_t shadow_page_bits = 12LL;
+  const uint64_t shadow_page_size = 1LL << shadow_page_bits;
+
+  const uint64_t default_frames_per_snapshot = 100000LL;
+
+  /** A page of memory, and which of its bytes are known. */
+  struct shadow_page {
+    uint8_t bytes[shadow_page_size];
+    /** Bit i % 8 of byte i / 8 is set if byte i is known. */
+    uint8_t known[shadow_page_size / 8];
+  };
+
+  /** The contents of page [page], numbered by address divided by
+      [shadow_page_size], from snapshot [snapshot] until the next
+      version of the page. */
+  struct shadow_version {
+    uint64_t page;
+    uint64_t snapshot;
+    /** Offset of the [shadow_page] in the file. */
+    uint64_t offset;
+  };
+
+  class ShadowMemory {
+
+  public:
+
+    /** Opens the shadow memory of the trace read by [reader] from
+        [filename]. [reader] replays frames for [read]. Throws
+        [TraceException] if the file can not be read or was not built
+        for the trace. */
+    ShadowMemory(TraceContainerReader &reader, const std::string &filename);
+
+    ~ShadowMemory(void) noexcept;
+
+    /** Read the [len] bytes at [address] as they were just before
+        frame [frame_number], which may be the number of frames of the
+        trace, into [bytes], and set [known][i] to whether byte i was
+        ever shown by a memory operand. Bytes that are not known are
+        0. Moves the frame pointer of the reader. Returns the number of
+        known bytes. */
+    uint64_t read(uint64_t frame_number, uint64_t address, uint64_t len,
+                  uint8_t *bytes, bool *known);
+
+    /** Returns the number of frames between snapshots. */
+    uint64_t get_frames_per_snapshot(void) const noexcept { return frames_per_snapshot; }
+
+    /** Returns the number of page versions in all snapshots. */
+    uint64_t get_num_versions(void) const noexcept { return versions.size(); }
+
+    /** Scan the whole trace of [reader] and write its shadow memory,
+        with a snapshot every [frames_per_snapshot] frames, to
+        [filename]. The file is written to a temporary file first, so
+        readers never see a partial one. Moves the frame pointer of
+        the reader. */
+    static void build(TraceContainerReader &reader, const std::string &filename,
+                      uint64_t frames_per_snapshot = default_frames_per_snapshot);
+
+    /** Returns the name of the shadow memory that belongs to
+        [trace_filename]. */
+    static std::string filename_for(const std::string &trace_filename);
+
+  private:
+
+    TraceContainerReader &reader;
+    IndexedTrace trace;
+    uint64_t frames_per_snapshot;
+
+    /** The page images, read on demand. */
+    FILE *f;
+
+    std::vector<shadow_version> versions;
+
+    /** Load page [page] as of snapshot [snapshot] into [into]. */
+    void load_page(uint64_t page, uint64_t snapshot, shadow_page &into);
+
+    ShadowMemory(const ShadowMemory &) = delete;
+    ShadowMemory &operator=(const ShadowMemory &) = delete;
+  };
+};
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * Implementation of traces split by thread.
+ */
+
+#include "trace.shard.hpp"
+#include "trace.scan.hpp"
+#include <algorithm>
+#include <stdio.h>
+
+namespace SerializedTrace {
+
+  ShardedTraceWriter::ShardedTraceWriter(const std::string &filename_in,
+                                         const meta_frame &meta_in,
+                                         frame_architecture arch_in,
+                                         uint64_t machine_in,
+                                         uint64_t frames_per_toc_entry_in,
+                                         uint64_t buffer_size_in,
+                                         uint64_t trace_version_in,
+                                         block_codec codec_in)
+    : filename (filename_in)
+    , meta (meta_in)
+    , arch (arch_in)
+    , machine (machine_in)
+    , frames_per_toc_entry (frames_per_toc_entry_in)
+    , buffer_size (buffer_size_in)
+    , trace_version (trace_version_in)
+    , codec (codec_in)
+    , num_frames (0)
+  { }
+
+  void ShardedTraceWriter::add(const frame &f) {
+    uint64_t pc, thread_id;
+    frame_kind kind;
+    frame_columns_of(f, pc, thread_id, kind);
+    shard_for(thread_id).add(f);
+  }
+
+  void ShardedTraceWriter::add_raw(const uint8_t *data, uint64_t len) {
+    scanned_frame s;
+    if (!scan_frame(data, len, frame_field_thread_id, s)) {
+      throw (TraceException("Unable to scan frame"));
+    }
+    shard_for(s.thread_id).add_raw(data, len);
+  }
+
+  TraceContainerWriter &ShardedTraceWriter::shard_for(uint64_t thread_id) {
+    std::unordered_map<uint64_t, uint64_t>::iterator i = shard_of.find(thread_id);
+    if (i == shard_of.end()) {
+      uint64_t shard = shards.size();
+      shards.emplace_back(new TraceContainerWriter(ShardedTraceReader::shard_filename_for(filename, shard),
+                                                   meta, arch, machine, frames_per_toc_entry,
+                                                   buffer_size, trace_version, codec));
+      thread_ids.push_back(thread_id);
+      i = shard_of.emplace(thread_id, shard).first;
+    }
+
+    uint64_t shard = i->second;
+    if (runs.empty() || runs[runs.size() - 2] != shard) {
+      runs.push_back(shard);
+      runs.push_back(0);
+    }
+    runs.back()++;
+    num_frames++;
+    return *shards[shard];
+  }
+
+  void ShardedTraceWriter::finish(void) {
+    for (std::vector<std::unique_ptr<TraceContainerWriter> >::iterator i = shards.begin();
+         i != shards.end(); ++i) {
+      (*i)->finish();
+    }
+    write_sequence();
+  }
+
+  void ShardedTraceWriter::write_sequence(void) {
+    std::string name = ShardedTraceReader::sequence_filename_for(filename);
+    std::string tmp = name + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+      throw (TraceException("Unable to open sequence index " + tmp + " for writing"));
+    }
+
+    uint64_t header[sequence_header_size / sizeof(uint64_t)] = {
+      sequence_magic_number,
+      sequence_version,
+      num_frames,
+      thread_ids.size(),
+      runs.size() / 2,
+      0
+    };
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1
+      && fwrite(thread_ids.data(), sizeof(uint64_t), thread_ids.size(), f) == thread_ids.size()
+      && fwrite(runs.data(), sizeof(uint64_t), runs.size(), f) == runs.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), name.c_str()) != 0) {
+      remove(tmp.c_str());
+      throw (TraceException("Unable to write sequence index " + name));
+    }
+  }
+
+  ShardedTraceReader::ShardedTraceReader(const std::string &filename_in)
+    : filename (filename_in)
+    , current_frame (0)
+    , current_run (0)
+    , run_pos (0)
+    , reposition (true)
+  {
+    std::string name = sequence_filename_for(filename);
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open sequence index " + name));
+    }
+
+    uint64_t header[sequence_header_size / sizeof(uint64_t)];
+    bool ok = fread(header, sizeof(header), 1, f) == 1
+      && header[0] == sequence_magic_number && header[1] == sequence_version
+      && header[3] <= header[4] && header[4] <= header[2];
+    std::vector<uint64_t> pairs;
+    if (ok) {
+      num_frames = header[2];
+      thread_ids.resize(header[3]);
+      pairs.resize(2 * header[4]);
+      ok = fread(thread_ids.data(), sizeof(uint64_t), thread_ids.size(), f) == thread_ids.size()
+        && fread(pairs.data(), sizeof(uint64_t), pairs.size(), f) == pairs.size();
+    }
+    fclose(f);
+    if (!ok) {
+      throw (TraceException("Unable to read sequence index " + name));
+    }
+
+    /* Number the frames of every run in both orders. */
+    shard_frames.resize(thread_ids.size());
+    uint64_t first = 0;
+    for (uint64_t i = 0; i < pairs.size(); i += 2) {
+      uint64_t shard = pairs[i];
+      if (shard >= thread_ids.size() || pairs[i + 1] == 0) {
+        throw (TraceException("Malformed run in sequence index " + name));
+      }
+      sequence_run r = { thread_ids[shard], shard, first, shard_frames[shard], pairs[i + 1] };
+      runs.push_back(r);
+      first += r.num_frames;
+      shard_frames[shard] += r.num_frames;
+    }
+    if (first != num_frames) {
+      throw (TraceException("The runs of sequence index " + name + " do not add up"));
+    }
+    readers.resize(thread_ids.size());
+  }
+
+  std::unique_ptr<TraceContainerReader> ShardedTraceReader::open_thread(uint64_t thread_id) const {
+    std::vector<uint64_t>::const_iterator i = std::find(thread_ids.begin(), thread_ids.end(), thread_id);
+    if (i == thread_ids.end()) {
+      throw (TraceException("No thread " + std::to_string(thread_id) + " in the trace"));
+    }
+    return open_shard(i - thread_ids.begin());
+  }
+
+  void ShardedTraceReader::seek(uint64_t frame_number) {
+    if (frame_number >= num_frames) {
+      throw (TraceException("seek() to non-existant frame"));
+    }
+    /* Find the last run that starts at or before the frame. */
+    std::vector<sequence_run>::iterator r =
+      std::upper_bound(runs.begin(), runs.end(), frame_number,
+                       [](uint64_t n, const sequence_run &run) { return n < run.first_frame; });
+    --r;
+    current_frame = frame_number;
+    current_run = r - runs.begin();
+    run_pos = frame_number - r->first_frame;
+    reposition = true;
+  }
+
+  bool ShardedTraceReader::next(frame &into, uint64_t &thread_id) {
+    if (end_of_trace()) {
+      return false;
+    }
+
+    const sequence_run &r = runs[current_run];
+    TraceContainerReader &reader = shard_reader(r.shard);
+    /* Within a run, the reader is already in place. */
+    if (reposition || run_pos == 0) {
+      reader.seek(r.first_shard_frame + run_pos);
+      reposition = false;
+    }
+    reader.next(into);
+    thread_id = r.thread_id;
+
+    current_frame++;
+    if (++run_pos == r.num_frames) {
+      current_run++;
+      run_pos = 0;
+    }
+    return true;
+  }
+
+  std::string ShardedTraceReader::sequence_filename_for(const std::string &filename) {
+    return filename + ".seq";
+  }
+
+  std::string ShardedTraceReader::shard_filename_for(const std::string &filename, uint64_t shard) {
+    return filename + "." + std::to_string(shard);
+  }
+
+  std::unique_ptr<TraceContainerReader> ShardedTraceReader::open_shard(uint64_t shard) const {
+    std::unique_ptr<TraceContainerReader> r(new TraceContainerReader(shard_filename_for(filename, shard)));
+    if (r->get_num_frames() != shard_frames[shard]) {
+      throw (TraceException("Shard " + std::to_string(shard) + " does not match the sequence index"));
+    }
+    return r;
+  }
+
+  TraceContainerReader &ShardedTraceReader::shard_reader(uint64_t shard) {
+    if (!readers[shard]) {
+      readers[shard] = open_shard(shard);
+    }
+    return *readers[shard];
+  }
+};
@@ -0,0 +1,201 @@
+#ifndef TRACE_SHARD_HPP
+#define TRACE_SHARD_HPP
+
+/**
+ * Traces split by thread.
+ *
+ * A sharded trace keeps the frames of each thread in a trace of its
+ * own, a shard, so that a per-thread analysis reads only the frames
+ * of its thread. Frames without a thread id, such as module loads,
+ * go to a shard of their own, for [no_thread_id]. The shards are
+ * ordinary traces, named [ShardedTraceReader::shard_filename_for]
+ * the sharded trace, that any reader can open.
+ *
+ * A sequence index, in [ShardedTraceReader::sequence_filename_for]
+ * the sharded trace, records the order in which the frames of all
+ * threads were added, as runs of consecutive frames of one shard.
+ * Runs are the context switches of the trace, so the index is small,
+ * and it gives the merged order without decoding any frame.
+ *
+ * The format of the sequence index, all numbers in the byte order of
+ * the trace:
+ *
+ * [<uint64_t sequence magic number>
+ *  <uint64_t sequence version number>
+ *  <uint64_t n = number of frames of all shards>
+ *  <uint64_t s = number of shards>
+ *  <uint64_t r = number of runs>
+ *  <uint64_t 0>
+ *  <uint64_t thread id of shard 0>
+ *  ..............
+ *  <uint64_t thread id of shard s - 1>
+ *  [ <uint64_t shard of run 0>
+ *    <uint64_t number of frames of run 0> ]
+ *  ..............
+ *  [ the same for runs up to r - 1 ]]
+ */
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t sequence_magic_number = 0x65636e6575716573LL;
+  const uint64_t sequence_version = 1LL;
+  const uint64_t sequence_header_size = 48LL;
+
+  /** Output buffer of each shard, smaller than that of a single
+      trace since a writer has one per thread. */
+  const uint64_t default_shard_buffer_size = 256LL << 10;
+
+  /** Consecutive frames of one shard in the merged order. */
+  struct sequence_run {
+    /** Thread id of the frames, or [no_thread_id]. */
+    uint64_t thread_id;
+    uint64_t shard;
+    /** Number of the first frame in the merged order and in the
+        shard. */
+    uint64_t first_frame;
+    uint64_t first_shard_frame;
+    uint64_t num_frames;
+  };
+
+  class ShardedTraceWriter {
+
+  public:
+
+    /** Creates a writer of a sharded trace named [filename]. Each
+        shard is written by a [TraceContainerWriter] with the other
+        arguments. Shards are created as threads show up, each of
+        them keeping a file open until [finish]. */
+    ShardedTraceWriter(const std::string &filename,
+                       const meta_frame &meta,
+                       frame_architecture arch = default_arch,
+                       uint64_t machine = default_machine,
+                       uint64_t frames_per_toc_entry = default_frames_per_toc_entry,
+                       uint64_t buffer_size = default_shard_buffer_size,
+                       uint64_t trace_version = default_trace_version,
+                       block_codec codec = block_codec_none);
+
+    /** Add [f] to the shard of its thread. */
+    void add(const frame &f);
+
+    /** Add a frame that is already serialized as the [len] bytes at
+        [data]. */
+    void add_raw(const uint8_t *data, uint64_t len);
+
+    /** Returns the number of frames added to all shards. */
+    uint64_t get_num_frames(void) const noexcept { return num_frames; }
+
+    /** Finish every shard and write the sequence index. */
+    void finish(void);
+
+  private:
+
+    const std::string filename;
+    const meta_frame meta;
+    const frame_architecture arch;
+    const uint64_t machine;
+    const uint64_t frames_per_toc_entry;
+    const uint64_t buffer_size;
+    const uint64_t trace_version;
+    const block_codec codec;
+
+    /** The shards, in the order their threads showed up, their
+        thread ids, and the shard of each thread id. */
+    std::vector<std::unique_ptr<TraceContainerWriter> > shards;
+    std::vector<uint64_t> thread_ids;
+    std::unordered_map<uint64_t, uint64_t> shard_of;
+
+    /** The runs so far, as pairs of shard and number of frames. */
+    std::vector<uint64_t> runs;
+
+    uint64_t num_frames;
+
+    /** Return the shard writer for [thread_id], creating it if
+        needed, and extend the runs with a frame of it. */
+    TraceContainerWriter &shard_for(uint64_t thread_id);
+
+    void write_sequence(void);
+  };
+
+  class ShardedTraceReader {
+
+  public:
+
+    /** Opens the sharded trace named [filename] by reading its
+        sequence index. Shards are opened when they are first
+        needed. Throws [TraceException] if the index can not be
+        read. */
+    ShardedTraceReader(const std::string &filename);
+
+    /** Returns the number of frames of all shards. */
+    uint64_t get_num_frames(void) const noexcept { return num_frames; }
+
+    /** Returns the thread id of every shard, in shard order. */
+    const std::vector<uint64_t> &get_thread_ids(void) const noexcept { return thread_ids; }
+
+    /** Returns the runs of the merged order, one per context
+        switch. */
+    const std::vector<sequence_run> &get_runs(void) const noexcept { return runs; }
+
+    /** Open a reader of the shard of [thread_id], to replay that
+        thread alone. Throws [TraceException] if the trace has no
+        such thread. */
+    std::unique_ptr<TraceContainerReader> open_thread(uint64_t thread_id) const;
+
+    /** Seek to frame [frame_number] of the merged order. */
+    void seek(uint64_t frame_number);
+
+    /** Parse the next frame of the merged order into [into], and
+        store its thread id in [thread_id]. Returns false at the end
+        of the trace. */
+    bool next(frame &into, uint64_t &thread_id);
+
+    /** Return true if the merged order is at its end. */
+    bool end_of_trace(void) const noexcept { return current_frame >= num_frames; }
+
+    /** Return the name of the sequence index of [filename]. */
+    static std::string sequence_filename_for(const std::string &filename);
+
+    /** Return the name of shard [shard] of [filename]. */
+    static std::string shard_filename_for(const std::string &filename, uint64_t shard);
+
+  private:
+
+    const std::string filename;
+    uint64_t num_frames;
+    std::vector<uint64_t> thread_ids;
+    std::vector<sequence_run> runs;
+
+    /** Number of frames of each shard. */
+    std::vector<uint64_t> shard_frames;
+
+    /** Readers of the shards for the merged order, opened on
+        demand. */
+    std::vector<std::unique_ptr<TraceContainerReader> > readers;
+
+    /** Position in the merged order: the frame, its run, and how
+        many frames of that run were read. */
+    uint64_t current_frame;
+    uint64_t current_run;
+    uint64_t run_pos;
+
+    /** Set by [seek], when the reader of the current run has to be
+        moved to the current frame. */
+    bool reposition;
+
+    /** Open a reader of [shard], checking that it matches the
+        sequence index. */
+    std::unique_ptr<TraceContainerReader> open_shard(uint64_t shard) const;
+
+    /** Return the reader of [shard] for the merged order. */
+    TraceContainerReader &shard_reader(uint64_t shard);
+  };
+};
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * Implementation of reader and writer statistics.
+ */
+
+#include "trace.stats.hpp"
+#include <algorithm>
+
+namespace SerializedTrace {
+
+  void time_histogram::clear(void) noexcept {
+    std::fill(buckets, buckets + num_buckets, 0);
+    count = 0;
+    total_ns = 0;
+  }
+
+  void time_histogram::add(uint64_t ns) noexcept {
+    int b = 0;
+    while (b < num_buckets - 1 && (ns >> (b + 1)) != 0) {
+      b++;
+    }
+    buckets[b]++;
+    count++;
+    total_ns += ns;
+  }
+
+  uint64_t time_histogram::percentile(double p) const noexcept {
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, p * count + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < num_buckets - 1; b++) {
+      seen += buckets[b];
+      if (seen >= rank) {
+        return 1ULL << (b + 1);
+      }
+    }
+    return ~0ULL;
+  }
+
+  void trace_stats::clear(void) noexcept {
+    bytes_read = 0;
+    bytes_written = 0;
+    frames_parsed = 0;
+    parse_time.clear();
+    frames_serialized = 0;
+    serialize_time.clear();
+    blocks = 0;
+    block_time.clear();
+    io_time.clear();
+    seeks = 0;
+    seek_skips = 0;
+    buffer_reallocations = 0;
+  }
+
+  namespace {
+
+    void print_histogram(std::ostream &out, const char *name, const time_histogram &h) {
+      out << name << ": " << h.count << " in " << h.total_ns << " ns";
+      if (h.count > 0) {
+        out << ", mean " << h.total_ns / h.count << " ns"
+            << ", p50 < " << h.percentile(0.5) << " ns"
+            << ", p99 < " << h.percentile(0.99) << " ns";
+      }
+      out << std::endl;
+    }
+  }
+
+  void trace_stats::print(std::ostream &out) const {
+    out << "bytes read: " << bytes_read << std::endl
+        << "bytes written: " << bytes_written << std::endl
+        << "frames parsed: " << frames_parsed << std::endl;
+    print_histogram(out, "parse time", parse_time);
+    out << "frames serialized: " << frames_serialized << std::endl;
+    print_histogram(out, "serialize time", serialize_time);
+    out << "blocks: " << blocks << std::endl;
+    print_histogram(out, "block time", block_time);
+    print_histogram(out, "io time", io_time);
+    out << "seeks: " << seeks << std::endl
+        << "seek skips: " << seek_skips << std::endl
+        << "buffer reallocations: " << buffer_reallocations << std::endl;
+  }
+};
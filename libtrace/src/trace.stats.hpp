@@ -0,0 +1,130 @@
+#ifndef TRACE_STATS_HPP
+#define TRACE_STATS_HPP
+
+/**
+ * Statistics of trace readers and writers: how many bytes and frames
+ * went through them, and where the time went.
+ *
+ * Statistics are only collected if libtrace is configured with
+ * --enable-stats, which defines TRACE_STATS. Otherwise the
+ * TRACE_STATS_* macros expand to nothing, and the statistics of every
+ * reader and writer stay zero.
+ */
+
+#ifndef _WIN32
+#include "config.h"
+#endif
+#include <chrono>
+#include <ostream>
+#include <stdint.h>
+
+namespace SerializedTrace {
+
+#ifdef TRACE_STATS
+  const bool stats_enabled = true;
+#else
+  const bool stats_enabled = false;
+#endif
+
+  /** Histogram of durations, in buckets of powers of two
+      nanoseconds. */
+  struct time_histogram {
+    static const int num_buckets = 64;
+
+    /** Number of durations of [2^b, 2^(b+1)) nanoseconds in bucket
+        b; bucket 0 also holds durations of 0. */
+    uint64_t buckets[num_buckets];
+    uint64_t count;
+    uint64_t total_ns;
+
+    time_histogram(void) { clear(); }
+
+    void clear(void) noexcept;
+
+    /** Add a duration of [ns] nanoseconds. */
+    void add(uint64_t ns) noexcept;
+
+    /** Return an upper bound of the [p]th percentile, for [p] in
+        [0, 1], or 0 if the histogram is empty. */
+    uint64_t percentile(double p) const noexcept;
+  };
+
+  /** Statistics of a reader or a writer. */
+  struct trace_stats {
+    /** Bytes read from the trace file by a reader, and bytes of
+        frames or blocks written to it by a writer. */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    /** Frames parsed by a reader, or serialized or encoded by a
+        writer, and the time it took. */
+    uint64_t frames_parsed;
+    time_histogram parse_time;
+    uint64_t frames_serialized;
+    time_histogram serialize_time;
+
+    /** Blocks decompressed and decoded by a reader, or compressed by
+        a writer, and the time it took. */
+    uint64_t blocks;
+    time_histogram block_time;
+
+    /** Time spent in reads and writes of the trace file. Reads of a
+        mapped trace are page faults, which are not timed. */
+    time_histogram io_time;
+
+    /** Calls to [seek], and the frames they skipped over to reach the
+        requested frame. */
+    uint64_t seeks;
+    uint64_t seek_skips;
+
+    /** Times a buffer had to grow. */
+    uint64_t buffer_reallocations;
+
+    trace_stats(void) { clear(); }
+
+    void clear(void) noexcept;
+
+    /** Print the statistics to [out], one per line. */
+    void print(std::ostream &out) const;
+  };
+
+#ifdef TRACE_STATS
+  /** Adds the lifetime of the timer to a histogram. */
+  class stats_timer {
+
+  public:
+
+    explicit stats_timer(time_histogram &h)
+      : histogram (h)
+      , start (std::chrono::steady_clock::now())
+    { }
+
+    ~stats_timer(void) {
+      histogram.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start).count());
+    }
+
+  private:
+
+    time_histogram &histogram;
+    const std::chrono::steady_clock::time_point start;
+  };
+
+#define TRACE_STATS_CONCAT_(a, b) a##b
+#define TRACE_STATS_CONCAT(a, b) TRACE_STATS_CONCAT_(a, b)
+
+/** Add [n] to the statistic [counter]. */
+#define TRACE_STATS_ADD(counter, n) ((counter) += (n))
+
+/** Add the time until the end of the enclosing scope to the
+    [histogram]. */
+#define TRACE_STATS_TIME(histogram) \
+  ::SerializedTrace::stats_timer TRACE_STATS_CONCAT(stats_timer_, __LINE__) (histogram)
+#else
+/* Not evaluated, but keeps the operands in use. */
+#define TRACE_STATS_ADD(counter, n) ((void) sizeof((counter) += (n)))
+#define TRACE_STATS_TIME(histogram) ((void) 0)
+#endif
+};
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * Implementation of the streaming trace reader.
+ */
+
+#include "trace.stream.hpp"
+#include "trace.codec.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace SerializedTrace {
+
+  /** Bytes requested from the stream per read. */
+  static const uint64_t stream_read_size = 1LL << 20;
+
+  TraceStreamReader::TraceStreamReader(int fd_in, bool follow_in, unsigned interval_in)
+    : fd (fd_in)
+    , owned (false)
+    , follow (follow_in)
+    , stopped (false)
+    , interval (interval_in)
+  {
+    read_header();
+  }
+
+  TraceStreamReader::TraceStreamReader(const std::string &filename, bool follow_in, unsigned interval_in)
+    : fd (0)
+    , owned (false)
+    , follow (follow_in)
+    , stopped (false)
+    , interval (interval_in)
+  {
+    if (filename != "-") {
+      fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw (TraceException("Unable to open trace for reading"));
+      }
+      owned = true;
+    }
+    try {
+      read_header();
+    } catch (...) {
+      if (owned) {
+        close(fd);
+      }
+      throw;
+    }
+  }
+
+  TraceStreamReader::~TraceStreamReader(void) noexcept {
+    if (owned) {
+      close(fd);
+    }
+  }
+
+  void TraceStreamReader::read_header(void) {
+    struct stat st;
+    regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    num_frames_read = 0;
+    buf_pos = 0;
+    buf_len = 0;
+    stream_offset = 0;
+    block_data = NULL;
+    block_size = 0;
+    block_pos = 0;
+    toc_offset = 0;
+
+    if (!fill(meta_offset)) {
+      throw (TraceException("Unable to read trace header"));
+    }
+    trace_header header = decode_trace_header(buf.data() + buf_pos);
+    consume(meta_offset);
+    trace_version = header.trace_version;
+    arch = header.arch;
+    mach = header.machine;
+    /* A non-zero toc offset means the writer had finished, and is
+       the only way to tell where the frames of a finished trace
+       that is piped in end. */
+    toc_offset = header.toc_offset;
+
+    uint64_t meta_size = header.meta_size;
+    if (!fill(meta_size)) {
+      throw (TraceException("Unable to read meta frame"));
+    }
+    if (!meta.ParseFromArray(buf.data() + buf_pos, meta_size)) {
+      throw (TraceException("Unable to parse meta frame"));
+    }
+    consume(meta_size);
+  }
+
+  bool TraceStreamReader::next(frame &into) {
+    uint64_t frame_len;
+    const uint8_t *data;
+
+    if (trace_version >= blocked_trace_version) {
+      while (block_pos == block_size) {
+        if (!next_block()) {
+          return false;
+        }
+      }
+      if (block_size - block_pos < sizeof(frame_len)) {
+        throw (TraceException("Truncated frame in block"));
+      }
+      memcpy(&frame_len, block_data + block_pos, sizeof(frame_len));
+      block_pos += sizeof(frame_len);
+      if (frame_len == 0 || block_size - block_pos < frame_len) {
+        throw (TraceException("Malformed frame length in block"));
+      }
+      data = block_data + block_pos;
+      block_pos += frame_len;
+    } else {
+      if (end_of_frames()) {
+        return false;
+      }
+      if (!fill(sizeof(frame_len))) {
+        return end_of_stream();
+      }
+      memcpy(&frame_len, buf.data() + buf_pos, sizeof(frame_len));
+      if (!fill(sizeof(frame_len) + frame_len)) {
+        return end_of_stream();
+      }
+      data = buf.data() + buf_pos + sizeof(frame_len);
+      consume(sizeof(frame_len) + frame_len);
+    }
+
+    if (!(into.ParseFromArray(data, frame_len))) {
+      throw (TraceException("Unable to parse from string"));
+    }
+    num_frames_read++;
+    return true;
+  }
+
+  bool TraceStreamReader::next_block(void) {
+    if (end_of_frames()) {
+      return false;
+    }
+    if (!fill(block_header_size)) {
+      return end_of_stream();
+    }
+    uint64_t header[block_header_size / sizeof(uint64_t)];
+    memcpy(header, buf.data() + buf_pos, sizeof(header));
+    uint64_t codec = header[0];
+    uint64_t block_frames = header[1];
+    uint64_t raw_size = header[2];
+    uint64_t stored_size = header[3];
+
+    /* Wait for the whole block before consuming its header, so that
+       a reader that stops following is left at a block boundary. */
+    if (!fill(block_header_size + stored_size)) {
+      return end_of_stream();
+    }
+    const uint8_t *stored = buf.data() + buf_pos + block_header_size;
+    if (codec == block_codec_none) {
+      if (stored_size != raw_size) {
+        throw (TraceException("Malformed uncompressed block"));
+      }
+      /* The buffer is only refilled once the block is used up. */
+      block_data = stored;
+    } else {
+      if (block_buf.size() < raw_size) {
+        block_buf.resize(raw_size);
+      }
+      decompress_block(codec, stored, stored_size, block_buf.data(), raw_size);
+      block_data = block_buf.data();
+    }
+    block_size = raw_size;
+    block_pos = 0;
+    if (trace_version >= encoded_trace_version) {
+      block_size = decoder.decode_block(block_data, raw_size, block_frames, decoded_buf);
+      block_data = decoded_buf.data();
+    }
+    consume(block_header_size + stored_size);
+    return true;
+  }
+
+  void TraceStreamReader::stop_following(void) noexcept {
+    stopped.store(true);
+  }
+
+  bool TraceStreamReader::end_of_frames(void) const noexcept {
+    return toc_offset != 0 && stream_offset - (buf_len - buf_pos) >= toc_offset;
+  }
+
+  bool TraceStreamReader::end_of_stream(void) {
+    if (buf_len == buf_pos || end_of_frames()) {
+      return false;
+    }
+    /* A trace file that is still being written ends with a partial
+       frame whenever the writer is in the middle of a write. */
+    if (stopped.load() || (regular && toc_offset == 0)) {
+      return false;
+    }
+    throw (TraceException("Trace ends in the middle of a frame"));
+  }
+
+  bool TraceStreamReader::fill(uint64_t len) {
+    while (buf_len - buf_pos < len) {
+      /* Move the unconsumed bytes to the front, and make room for
+         the rest. */
+      if (buf_pos > 0) {
+        memmove(buf.data(), buf.data() + buf_pos, buf_len - buf_pos);
+        buf_len -= buf_pos;
+        buf_pos = 0;
+      }
+      if (buf.size() < std::max(len, stream_read_size)) {
+        buf.resize(std::max(len, stream_read_size));
+      }
+
+      ssize_t n = read(fd, buf.data() + buf_len, buf.size() - buf_len);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw (TraceException("Unable to read from trace"));
+      }
+      buf_len += n;
+      stream_offset += n;
+      /* The writer updates the header before it appends the toc, so
+         rereading it after each read tells whether we got there. */
+      poll_toc_offset();
+
+      if (n == 0) {
+        /* Reads from pipes and sockets block until there is data, so
+           they only return nothing once the writer is gone. */
+        if (!follow || !regular || stopped.load() || toc_offset != 0) {
+          return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+      }
+    }
+    return true;
+  }
+
+  void TraceStreamReader::poll_toc_offset(void) {
+    if (!regular || toc_offset != 0) {
+      return;
+    }
+    uint64_t offset;
+    if (pread(fd, &offset, sizeof(offset), toc_offset_offset) == sizeof(offset)) {
+      toc_offset = offset;
+    }
+  }
+};
@@ -0,0 +1,180 @@
+#ifndef TRACE_STREAM_HPP
+#define TRACE_STREAM_HPP
+
+/**
+ * A trace reader for streams that can not seek: pipes, sockets, and
+ * trace files that are still being written.
+ *
+ * [TraceContainerReader] needs the table of contents, which the
+ * writer only emits in [finish], and seeks to it. The stream reader
+ * instead parses the header and the frames strictly in order and
+ * never looks at the table of contents. A trace written to a
+ * non-seekable stream has none, and in a trace file the header tells
+ * where the frames end once the writer has finished.
+ *
+ * In follow mode the reader behaves like [tail -f]: when it runs out
+ * of data it waits for the writer to append more, and only stops
+ * when the writer finishes the trace or [stop_following] is
+ * called. The frames of a version 4 trace appear block by block, and
+ * a writer only makes buffered frames visible when it fills its
+ * buffer or is flushed with [TraceContainerWriter::flush].
+ */
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** Milliseconds to wait before polling a followed trace again. */
+  const unsigned default_follow_interval = 100;
+
+  class TraceStreamReader {
+
+  public:
+
+    /** Creates a reader for the trace that is read from [fd], which
+        must be positioned at the start of the trace. The descriptor
+        is not closed by the reader. If [follow] is true and [fd] is a
+        regular file, the reader waits for more data at the end of
+        the file, polling every [interval] milliseconds. Pipes and
+        sockets are always read until the writer closes them. The header and meta frame are read
+        immediately, so this blocks until the writer has created
+        them. */
+    TraceStreamReader(int fd,
+                      bool follow = false,
+                      unsigned interval = default_follow_interval);
+
+    /** Creates a reader for the trace in [filename], or for the
+        standard input if [filename] is "-". */
+    TraceStreamReader(const std::string &filename,
+                      bool follow = false,
+                      unsigned interval = default_follow_interval);
+
+    /** Closes the trace if it was opened by the reader. */
+    ~TraceStreamReader(void) noexcept;
+
+    /** Read the next frame into [into]. Returns false, leaving
+        [into] untouched, at the end of the trace. In follow mode,
+        this blocks until a complete frame is available, the trace is
+        finished, or [stop_following] is called. */
+    bool next(frame &into);
+
+    /** Make a following reader stop at the end of the data that has
+        been written so far, as if the trace ended there. May be
+        called from any thread. */
+    void stop_following(void) noexcept;
+
+    /** Return the number of frames read so far. */
+    uint64_t frames_read(void) const noexcept { return num_frames_read; }
+
+    /** Return the trace version. */
+    uint64_t get_trace_version(void) const noexcept { return trace_version; }
+
+    /** Return the architecture of the trace. */
+    frame_architecture get_arch(void) const noexcept { return arch; }
+
+    /** Return the machine type of the trace. */
+    uint64_t get_machine(void) const noexcept { return mach; }
+
+    const meta_frame *get_meta(void) const { return &meta; }
+
+  private:
+
+    /** Descriptor to read the trace from. */
+    int fd;
+
+    /** True if [fd] was opened by the reader. */
+    bool owned;
+
+    /** True if [fd] is a regular file, whose header can be reread to
+        learn whether the writer has finished. */
+    bool regular;
+
+    /** Follow mode, and whether [stop_following] was called. */
+    const bool follow;
+    std::atomic<bool> stopped;
+    const unsigned interval;
+
+    /** Trace version. */
+    uint64_t trace_version;
+
+    /** CPU architecture. */
+    frame_architecture arch;
+
+    /** Machine type. */
+    uint64_t mach;
+
+    meta_frame meta;
+
+    /** Offset where the frames end, or 0 while the writer has not
+        finished the trace. */
+    uint64_t toc_offset;
+
+    /** Number of frames returned by [next]. */
+    uint64_t num_frames_read;
+
+    /** Bytes read from [fd] and not consumed yet, starting at
+        [buf_pos]. */
+    std::vector<uint8_t> buf;
+    uint64_t buf_pos;
+    uint64_t buf_len;
+
+    /** Offset in the trace of the first byte after [buf_len]. */
+    uint64_t stream_offset;
+
+    /** Contents of the current block of a version 4 trace, either
+        pointing into [buf], into [block_buf] or, for version 5, into
+        [decoded_buf], and the offset of its next frame. */
+    const uint8_t *block_data;
+    uint64_t block_size;
+    uint64_t block_pos;
+
+    /** Decompressed contents of the current block. */
+    std::vector<uint8_t> block_buf;
+
+    /** Decoder of the blocks of a version 5 trace, and the decoded
+        contents of the current block. */
+    FrameDecoder decoder;
+    std::vector<uint8_t> decoded_buf;
+
+    /** Read the header and meta frame. */
+    void read_header(void);
+
+    /** Return true if the frames of a finished trace have all been
+        consumed. */
+    bool end_of_frames(void) const noexcept;
+
+    /** Make sure that [len] bytes are buffered, reading and, in
+        follow mode, waiting for them as needed. Returns false if the
+        stream ends first. */
+    bool fill(uint64_t len);
+
+    /** Consume [len] buffered bytes. */
+    void consume(uint64_t len) noexcept { buf_pos += len; }
+
+    /** Called when the stream ends before a complete frame or
+        block. Returns false if the trace ends cleanly there, and
+        throws [TraceException] otherwise. */
+    bool end_of_stream(void);
+
+    /** Read and decompress the next block. Returns false at the end
+        of the trace. */
+    bool next_block(void);
+
+    /** Reread the offset of the toc from the header of a regular
+        file. */
+    void poll_toc_offset(void);
+
+    TraceStreamReader(const TraceStreamReader &) = delete;
+    TraceStreamReader &operator=(const TraceStreamReader &) = delete;
+  };
+};
+
+#endif
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * Implementation of the block tables.
+ */
+
+#include "trace.toc.hpp"
+#include "trace.container.hpp"
+#include <algorithm>
+#include <string.h>
+#include <string>
+
+namespace SerializedTrace {
+
+  frame_kind serialized_frame_kind(const uint8_t *data, uint64_t len) noexcept {
+    /* A frame holds exactly one of its variants, so it starts with
+       the key of that field, which fits into one byte. */
+    if (len == 0 || (data[0] & 7) != 2) {
+      return frame_kind_unknown;
+    }
+    uint8_t field = data[0] >> 3;
+    if (field >= num_frame_kinds) {
+      return frame_kind_unknown;
+    }
+    return (frame_kind) field;
+  }
+
+  bool frame_pc(const frame &f, uint64_t &pc) noexcept {
+    if (f.has_std_frame()) {
+      pc = f.std_frame().address();
+      return true;
+    }
+    if (f.has_syscall_frame()) {
+      pc = f.syscall_frame().address();
+      return true;
+    }
+    if (f.has_exception_frame() && f.exception_frame().has_from_addr()) {
+      pc = f.exception_frame().from_addr();
+      return true;
+    }
+    return false;
+  }
+
+  bool operand_store(const operand_info &o, uint64_t &low, uint64_t &high) noexcept {
+    if (!o.operand_usage().written() || !o.operand_info_specific().has_mem_operand()) {
+      return false;
+    }
+    low = o.operand_info_specific().mem_operand().address();
+    uint64_t bytes = o.bit_length() > 8 ? (o.bit_length() + 7) / 8 : 1;
+    high = low + bytes - 1;
+    return true;
+  }
+
+  /** Hash an 8 byte aligned memory word into three bloom filter
+      bits. */
+  static void bloom_bits(uint64_t word, uint64_t bits[3]) noexcept {
+    uint64_t h = word + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    const uint64_t size = summary_bloom_words * 64;
+    bits[0] = h % size;
+    bits[1] = (h >> 21) % size;
+    bits[2] = (h >> 42) % size;
+  }
+
+  void block_summary::clear(void) noexcept {
+    min_pc = ~0ULL;
+    max_pc = 0;
+    thread_mask = 0;
+    syscall_mask = 0;
+    memset(store_bloom, 0, sizeof(store_bloom));
+  }
+
+  void block_summary::add(const frame &f) noexcept {
+    uint64_t pc;
+    if (frame_pc(f, pc)) {
+      min_pc = std::min(min_pc, pc);
+      max_pc = std::max(max_pc, pc);
+    }
+
+    if (f.has_std_frame()) {
+      const std_frame &s = f.std_frame();
+      thread_mask |= 1ULL << (s.thread_id() % 64);
+      const operand_value_list *lists[] = { &s.operand_pre_list(), &s.operand_post_list() };
+      for (int l = 0; l < 2; l++) {
+        for (int i = 0; i < lists[l]->elem_size(); i++) {
+          uint64_t low, high;
+          if (!operand_store(lists[l]->elem(i), low, high)) {
+            continue;
+          }
+          for (uint64_t word = low >> 3; word <= high >> 3; word++) {
+            uint64_t bits[3];
+            bloom_bits(word, bits);
+            for (int b = 0; b < 3; b++) {
+              store_bloom[bits[b] / 64] |= 1ULL << (bits[b] % 64);
+            }
+          }
+        }
+      }
+    } else if (f.has_syscall_frame()) {
+      thread_mask |= 1ULL << (f.syscall_frame().thread_id() % 64);
+      syscall_mask |= 1ULL << (f.syscall_frame().number() % 64);
+    } else if (f.has_exception_frame() && f.exception_frame().has_thread_id()) {
+      thread_mask |= 1ULL << (f.exception_frame().thread_id() % 64);
+    }
+  }
+
+  bool block_summary::may_store_to(uint64_t address) const noexcept {
+    uint64_t bits[3];
+    bloom_bits(address >> 3, bits);
+    for (int b = 0; b < 3; b++) {
+      if (!((store_bloom[bits[b] / 64] >> (bits[b] % 64)) & 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint64_t toc_block::num_frames(void) const noexcept {
+    uint64_t n = 0;
+    for (int k = 0; k < num_frame_kinds; k++) {
+      n += kind_counts[k];
+    }
+    return n;
+  }
+
+  std::vector<toc_block> group_blocks(const std::vector<toc_block> &blocks) {
+    std::vector<toc_block> groups;
+    for (uint64_t i = 0; i < blocks.size(); i++) {
+      const toc_block &b = blocks[i];
+      if (i % toc_group_size == 0) {
+        groups.push_back(b);
+        continue;
+      }
+      toc_block &g = groups.back();
+      g.size = b.offset + b.size - g.offset;
+      for (int k = 0; k < num_frame_kinds; k++) {
+        g.kind_counts[k] += b.kind_counts[k];
+      }
+    }
+    return groups;
+  }
+
+  BlockTable::BlockTable(const read_function &read_in,
+                         uint64_t blocks_offset_in, uint64_t num_blocks_in,
+                         uint64_t groups_offset, uint64_t num_groups)
+    : read (read_in)
+    , blocks_offset (blocks_offset_in)
+    , num_blocks (num_blocks_in)
+    , groups (num_groups)
+    , summaries_offset (0)
+  {
+    if (num_groups != (num_blocks + toc_group_size - 1) / toc_group_size) {
+      throw (TraceException("Block groups do not match the block table"));
+    }
+    if (num_groups > 0) {
+      read(groups_offset, groups.data(), num_groups * sizeof(toc_block));
+    }
+  }
+
+  const toc_block &BlockTable::get_block(uint64_t block_number) {
+    if (block_number >= num_blocks) {
+      throw (TraceException("Block " + std::to_string(block_number) + " is not in the block table"));
+    }
+    uint64_t page_number = block_number / toc_page_size;
+    std::unordered_map<uint64_t, std::vector<toc_block> >::iterator page = pages.find(page_number);
+    if (page == pages.end()) {
+      uint64_t first = page_number * toc_page_size;
+      std::vector<toc_block> records(std::min(toc_page_size, num_blocks - first));
+      read(blocks_offset + first * sizeof(toc_block), records.data(), records.size() * sizeof(toc_block));
+      page = pages.emplace(page_number, std::move(records)).first;
+    }
+    return page->second[block_number % toc_page_size];
+  }
+
+  const toc_block &BlockTable::get_group(uint64_t group_number) const {
+    if (group_number >= groups.size()) {
+      throw (TraceException("Group " + std::to_string(group_number) + " is not in the block table"));
+    }
+    return groups[group_number];
+  }
+
+  void BlockTable::set_summaries(uint64_t summaries_offset_in) {
+    summaries_offset = summaries_offset_in;
+  }
+
+  const block_summary &BlockTable::get_summary(uint64_t block_number) {
+    if (!has_summaries() || block_number >= num_blocks) {
+      throw (TraceException("Block " + std::to_string(block_number) + " has no summary"));
+    }
+    uint64_t page_number = block_number / summary_page_size;
+    std::unordered_map<uint64_t, std::vector<block_summary> >::iterator page = summary_pages.find(page_number);
+    if (page == summary_pages.end()) {
+      uint64_t first = page_number * summary_page_size;
+      std::vector<block_summary> records(std::min(summary_page_size, num_blocks - first));
+      read(summaries_offset + first * sizeof(block_summary), records.data(), records.size() * sizeof(block_summary));
+      page = summary_pages.emplace(page_number, std::move(records)).first;
+    }
+    return page->second[block_number % summary_page_size];
+  }
+
+  uint64_t BlockTable::find_block(frame_kind kind, uint64_t block_number) {
+    while (block_number < num_blocks) {
+      const toc_block &g = groups[block_number / toc_group_size];
+      uint64_t group_end = std::min(num_blocks, (block_number / toc_group_size + 1) * toc_group_size);
+      if (g.kind_counts[kind] == 0) {
+        block_number = group_end;
+        continue;
+      }
+      for (; block_number < group_end; block_number++) {
+        if (get_block(block_number).kind_counts[kind] > 0) {
+          return block_number;
+        }
+      }
+    }
+    return num_blocks;
+  }
+};
@@ -0,0 +1,210 @@
+#ifndef TRACE_TOC_HPP
+#define TRACE_TOC_HPP
+
+/**
+ * Block tables of version 4 traces.
+ *
+ * Following the table of contents, a version 4 trace holds a list of
+ * sections, each of which is
+ *
+ *  [ <uint64_t section tag>
+ *    <uint64_t size of the section contents>
+ *    <section contents> ]
+ *
+ * up to the end of the file. Readers skip sections with tags they do
+ * not know. The block table sections form a two level table of
+ * contents:
+ *
+ *  - [toc_section_blocks] has one [toc_block] record for every block
+ *    of the trace.
+ *
+ *  - [toc_section_groups] has one [toc_block] record for every
+ *    [toc_group_size] consecutive blocks, that summarizes them.
+ *
+ * A trace may also have a [toc_section_summaries] section, with one
+ * [block_summary] of the contents of every block, that queries use
+ * to skip blocks without decompressing them.
+ *
+ * Since every block holds the same number of frames, the block of a
+ * frame is found by a division. The records instead make it cheap to
+ * find the blocks that contain frames of interest: the group table is
+ * small enough to be read when the trace is opened, and only the
+ * pages of the block table that belong to a matching group are read
+ * later.
+ */
+
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "frame.piqi.pb.h"
+
+namespace SerializedTrace {
+
+  /** Kinds of frames, numbered like the fields of the frame
+      variant. */
+  enum frame_kind {
+    frame_kind_unknown = 0,
+    frame_kind_std = 1,
+    frame_kind_syscall = 2,
+    frame_kind_exception = 3,
+    frame_kind_taint_intro = 4,
+    frame_kind_modload = 5,
+    frame_kind_key = 6,
+    num_frame_kinds = 7
+  };
+
+  /** Return the kind of the frame serialized in the [len] bytes at
+      [data], without parsing it. */
+  frame_kind serialized_frame_kind(const uint8_t *data, uint64_t len) noexcept;
+
+  const uint64_t toc_section_blocks = 1LL;
+  const uint64_t toc_section_groups = 2LL;
+  const uint64_t toc_section_summaries = 3LL;
+  const uint64_t toc_section_header_size = 16LL;
+
+  /** Number of blocks summarized by one group record. */
+  const uint64_t toc_group_size = 1024LL;
+
+  /** Number of block records read from the trace at once. */
+  const uint64_t toc_page_size = 1024LL;
+
+  /** Number of block summaries read from the trace at once. */
+  const uint64_t summary_page_size = 64LL;
+
+  /** Size of the bloom filter of a block summary, in 64 bit words. */
+  const uint64_t summary_bloom_words = 128LL;
+
+  /** Summary of a block, or of a group of blocks. */
+  struct toc_block {
+    /** Number of the first frame. */
+    uint64_t first_frame;
+
+    /** Offset of the block header, and size of the block or blocks,
+        including their headers. */
+    uint64_t offset;
+    uint64_t size;
+
+    /** Number of frames of each [frame_kind]. */
+    uint64_t kind_counts[num_frame_kinds];
+
+    /** Return the number of frames. */
+    uint64_t num_frames(void) const noexcept;
+  };
+
+  /** Return true if [f] has a program counter, and store it in
+      [pc]. Standard and system call frames have one, and exception
+      frames that record where they were raised. */
+  bool frame_pc(const frame &f, uint64_t &pc) noexcept;
+
+  /** Return true if the operand [o] writes to memory, and store the
+      first and last byte address written in [low] and [high]. */
+  bool operand_store(const operand_info &o, uint64_t &low, uint64_t &high) noexcept;
+
+  /** Summary of the contents of a block, that tells which queries
+      can not match any of its frames. Every test may give a false
+      positive, but never a false negative. */
+  struct block_summary {
+    /** Smallest and largest program counter, or [min_pc] >
+        [max_pc] if no frame has one. */
+    uint64_t min_pc;
+    uint64_t max_pc;
+
+    /** Bit [t % 64] is set for every thread id [t]. */
+    uint64_t thread_mask;
+
+    /** Bit [n % 64] is set for every system call number [n]. */
+    uint64_t syscall_mask;
+
+    /** Bloom filter of the 8 byte aligned memory words that are
+        written. */
+    uint64_t store_bloom[summary_bloom_words];
+
+    /** Reset to the summary of no frames. */
+    void clear(void) noexcept;
+
+    /** Account for frame [f]. */
+    void add(const frame &f) noexcept;
+
+    bool may_have_pc(uint64_t low, uint64_t high) const noexcept {
+      return min_pc <= max_pc && max_pc >= low && min_pc < high;
+    }
+
+    bool may_have_thread(uint64_t thread_id) const noexcept {
+      return (thread_mask >> (thread_id % 64)) & 1;
+    }
+
+    bool may_have_syscall(uint64_t number) const noexcept {
+      return (syscall_mask >> (number % 64)) & 1;
+    }
+
+    /** Return true if a frame may write to [address]. */
+    bool may_store_to(uint64_t address) const noexcept;
+  };
+
+  /** Return the group records that summarize [blocks]. */
+  std::vector<toc_block> group_blocks(const std::vector<toc_block> &blocks);
+
+  /** Read access to the block table of a trace, that loads the
+      block records lazily. */
+  class BlockTable {
+
+  public:
+
+    /** Function that reads [len] bytes at [offset] of the trace into
+        [dst]. */
+    typedef std::function<void(uint64_t offset, void *dst, uint64_t len)> read_function;
+
+    /** Creates a block table of [num_blocks] records at
+        [blocks_offset], summarized by the [num_groups] records at
+        [groups_offset]. The group records are read immediately. */
+    BlockTable(const read_function &read,
+               uint64_t blocks_offset, uint64_t num_blocks,
+               uint64_t groups_offset, uint64_t num_groups);
+
+    uint64_t get_num_blocks(void) const noexcept { return num_blocks; }
+
+    uint64_t get_num_groups(void) const noexcept { return groups.size(); }
+
+    /** Return the record of block [block_number]. */
+    const toc_block &get_block(uint64_t block_number);
+
+    /** Return the record of group [group_number]. */
+    const toc_block &get_group(uint64_t group_number) const;
+
+    /** Return the number of the first block from [block_number] on
+        that holds a frame of [kind], or the number of blocks if there
+        is none. Groups without such frames are skipped without
+        reading their blocks. */
+    uint64_t find_block(frame_kind kind, uint64_t block_number);
+
+    /** Use the [num_blocks] block summaries at [summaries_offset]. */
+    void set_summaries(uint64_t summaries_offset);
+
+    /** Return true if the trace has block summaries. */
+    bool has_summaries(void) const noexcept { return summaries_offset != 0; }
+
+    /** Return the summary of block [block_number]. */
+    const block_summary &get_summary(uint64_t block_number);
+
+  private:
+
+    read_function read;
+
+    uint64_t blocks_offset;
+    uint64_t num_blocks;
+
+    std::vector<toc_block> groups;
+
+    /** Pages of block records read so far, by page number. */
+    std::unordered_map<uint64_t, std::vector<toc_block> > pages;
+
+    /** Offset of the block summaries, 0 if there are none, and the
+        pages read so far. */
+    uint64_t summaries_offset;
+    std::unordered_map<uint64_t, std::vector<block_summary> > summary_pages;
+  };
+};
+
+#endif
@@ -0,0 +1,454 @@
+/**
+ * Implementation of the last writer index.
+ */
+
+#include "trace.writes.hpp"
+#include "trace.columns.hpp"
+#include "trace.parallel.hpp"
+#include "trace.scan.hpp"
+#include "trace.toc.hpp"
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+namespace SerializedTrace {
+
+  namespace {
+
+    bool seek_file(FILE *f, uint64_t offset) {
+#ifdef _WIN32
+      return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+      return fseeko(f, offset, SEEK_SET) == 0;
+#endif
+    }
+
+    void put_varint(uint64_t v, std::vector<uint8_t> &out) {
+      while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+      }
+      out.push_back((uint8_t) v);
+    }
+
+    /** Like [operand_store], but the range ends at the top of the
+        address space instead of wrapping around. */
+    bool written_memory(const operand_info &o, uint64_t &low, uint64_t &high) noexcept {
+      if (!operand_store(o, low, high)) {
+        return false;
+      }
+      if (high < low) {
+        high = ~0ULL;
+      }
+      return true;
+    }
+
+    typedef std::unordered_map<std::string, std::vector<uint64_t> > register_postings;
+
+    /** The postings of the segments read by one worker. Workers read
+        segments in increasing order, so every list is sorted. */
+    struct worker_postings {
+      std::unordered_map<uint64_t, register_postings> registers;
+      std::unordered_map<uint64_t, std::vector<uint64_t> > memory;
+    };
+
+    void post(std::vector<uint64_t> &postings, uint64_t frame_number) {
+      if (postings.empty() || postings.back() != frame_number) {
+        postings.push_back(frame_number);
+      }
+    }
+
+    /** Post frame [frame_number] to what the serialized operand list
+        [data] writes. */
+    void post_operands(const uint8_t *data, uint64_t len, uint64_t thread_id,
+                       uint64_t frame_number, uint64_t granule,
+                       operand_value_list &operands, worker_postings &into) {
+      if (!data) {
+        return;
+      }
+      if (!operands.ParseFromArray(data, len)) {
+        throw (TraceException("Unable to parse operands"));
+      }
+      for (int i = 0; i < operands.elem_size(); i++) {
+        const operand_info &o = operands.elem(i);
+        uint64_t low, high;
+        if (written_memory(o, low, high)) {
+          for (uint64_t g = low / granule; ; g++) {
+            post(into.memory[g], frame_number);
+            if (g == high / granule) {
+              break;
+            }
+          }
+        } else if (o.operand_usage().written() && o.operand_info_specific().has_reg_operand()) {
+          post(into.registers[thread_id][o.operand_info_specific().reg_operand().name()],
+               frame_number);
+        }
+      }
+    }
+
+    /** Append the [postings] of a worker to those of [key] in
+        [merged]. */
+    template <typename Map>
+    void merge(Map &merged, const typename Map::key_type &key,
+               std::vector<uint64_t> &postings) {
+      std::vector<uint64_t> &into = merged[key];
+      if (into.empty()) {
+        into.swap(postings);
+      } else {
+        into.insert(into.end(), postings.begin(), postings.end());
+        std::vector<uint64_t>().swap(postings);
+      }
+    }
+
+    /** Write [frames] as a posting list at [end], and describe it in
+        [into]. */
+    void write_postings_list(FILE *out, uint64_t &end, const std::vector<uint64_t> &frames,
+                             writes_postings &into) {
+      std::vector<writes_skip> skips;
+      std::vector<uint8_t> deltas;
+      for (std::vector<uint64_t>::size_type i = 0; i < frames.size(); i++) {
+        if (i % writes_block_size == 0) {
+          writes_skip s = { frames[i], deltas.size() };
+          skips.push_back(s);
+        } else {
+          put_varint(frames[i] - frames[i - 1], deltas);
+        }
+      }
+      if (fwrite(skips.data(), sizeof(writes_skip), skips.size(), out) != skips.size() ||
+          fwrite(deltas.data(), 1, deltas.size(), out) != deltas.size()) {
+        throw (TraceException("Unable to write posting list"));
+      }
+      into.count = frames.size();
+      into.offset = end;
+      into.size = skips.size() * sizeof(writes_skip) + deltas.size();
+      end += into.size;
+    }
+  }
+
+  WriteIndex::WriteIndex(TraceContainerReader &reader_in, const std::string &filename)
+    : reader (reader_in)
+    , f (NULL)
+  {
+    f = fopen(filename.c_str(), "rb");
+    if (!f) {
+      throw (TraceException("Unable to open write index " + filename));
+    }
+
+    uint64_t header[writes_header_size / sizeof(uint64_t)];
+    if (fread(header, sizeof(header), 1, f) != 1) {
+      fclose(f);
+      throw (TraceException("Unable to read write index header"));
+    }
+    trace.trace_version = header[2];
+    trace.num_frames = header[3];
+    trace.toc_offset = header[4];
+    trace.trace_size = header[5];
+    granule = header[6];
+    if (header[0] != writes_magic_number || header[1] != writes_version_number ||
+        !(trace == reader.indexed_trace()) || granule == 0) {
+      fclose(f);
+      throw (TraceException("Write index " + filename + " does not match the trace"));
+    }
+
+    registers.resize(header[7]);
+    granules.resize(header[9]);
+    names.resize(header[12]);
+    if (!seek_file(f, header[8]) ||
+        fread(registers.data(), sizeof(writes_register), registers.size(), f) != registers.size() ||
+        !seek_file(f, header[10]) ||
+        fread(granules.data(), sizeof(writes_granule), granules.size(), f) != granules.size() ||
+        !seek_file(f, header[11]) ||
+        fread(&names[0], 1, names.size(), f) != names.size()) {
+      fclose(f);
+      throw (TraceException("Write index " + filename + " is truncated"));
+    }
+  }
+
+  WriteIndex::~WriteIndex(void) noexcept {
+    fclose(f);
+  }
+
+  bool WriteIndex::last_register_write(uint64_t thread_id, const std::string &name,
+                                       uint64_t before, uint64_t &frame_number) {
+    std::vector<writes_register>::const_iterator r =
+      std::lower_bound(registers.begin(), registers.end(), thread_id,
+                       [&](const writes_register &e, uint64_t t) {
+                         return e.thread_id < t
+                           || (e.thread_id == t
+                               && names.compare(e.name_offset, e.name_len, name) < 0);
+                       });
+    if (r == registers.end() || r->thread_id != thread_id
+        || names.compare(r->name_offset, r->name_len, name) != 0) {
+      return false;
+    }
+    return last_before(r->postings, before, frame_number);
+  }
+
+  bool WriteIndex::last_register_write(const std::string &name, uint64_t before,
+                                       uint64_t &frame_number) {
+    bool found = false;
+    for (std::vector<writes_register>::const_iterator r = registers.begin();
+         r != registers.end(); ++r) {
+      uint64_t candidate;
+      if (names.compare(r->name_offset, r->name_len, name) == 0
+          && last_before(r->postings, before, candidate)
+          && (!found || candidate > frame_number)) {
+        frame_number = candidate;
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  bool WriteIndex::last_memory_write(uint64_t address, uint64_t len,
+                                     uint64_t before, uint64_t &frame_number) {
+    if (len == 0) {
+      return false;
+    }
+    uint64_t last_byte = address + (len - 1);
+    if (last_byte < address) {
+      throw (TraceException("last_memory_write() past the end of the address space"));
+    }
+
+    std::vector<writes_granule>::const_iterator g =
+      std::lower_bound(granules.begin(), granules.end(), address / granule,
+                       [](const writes_granule &e, uint64_t g) {
+                         return e.granule < g;
+                       });
+    bool found = false;
+    for (; g != granules.end() && g->granule <= last_byte / granule; ++g) {
+      /* Frames posted to a granule the bytes cover write some of the
+         bytes; the others have to be read back. */
+      bool covered = g->granule * granule >= address
+        && g->granule * granule + (granule - 1) <= last_byte;
+      uint64_t cursor = before;
+      uint64_t candidate;
+      while (last_before(g->postings, cursor, candidate)
+             && (!found || candidate > frame_number)) {
+        if (covered || writes_memory(candidate, address, len)) {
+          frame_number = candidate;
+          found = true;
+          break;
+        }
+        cursor = candidate;
+      }
+    }
+    return found;
+  }
+
+  bool WriteIndex::last_before(const writes_postings &postings, uint64_t before,
+                               uint64_t &frame_number) {
+    uint64_t num_skips = (postings.count + writes_block_size - 1) / writes_block_size;
+
+    /* Find the last block that starts before [before]. */
+    writes_skip skip = { 0, 0 };
+    writes_skip next = { 0, postings.size - num_skips * sizeof(writes_skip) };
+    uint64_t low = 0, high = num_skips;
+    while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      writes_skip s;
+      if (!seek_file(f, postings.offset + mid * sizeof(writes_skip)) ||
+          fread(&s, sizeof(s), 1, f) != 1) {
+        throw (TraceException("Unable to read posting list"));
+      }
+      if (s.frame < before) {
+        skip = s;
+        low = mid + 1;
+      } else {
+        next = s;
+        high = mid;
+      }
+    }
+    if (low == 0) {
+      return false;
+    }
+
+    uint64_t block = low - 1;
+    uint64_t num_deltas = std::min(writes_block_size, postings.count - block * writes_block_size) - 1;
+    std::vector<uint8_t> deltas(next.offset - skip.offset);
+    if (!seek_file(f, postings.offset + num_skips * sizeof(writes_skip) + skip.offset) ||
+        fread(deltas.data(), 1, deltas.size(), f) != deltas.size()) {
+      throw (TraceException("Unable to read posting list"));
+    }
+
+    frame_number = skip.frame;
+    std::vector<uint8_t>::const_iterator p = deltas.begin();
+    for (uint64_t i = 0; i < num_deltas; i++) {
+      uint64_t delta = 0;
+      for (int shift = 0; ; shift += 7) {
+        if (p == deltas.end() || shift >= 64) {
+          throw (TraceException("Malformed posting list"));
+        }
+        uint8_t b = *p++;
+        delta |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          break;
+        }
+      }
+      if (frame_number + delta >= before) {
+        break;
+      }
+      frame_number += delta;
+    }
+    return true;
+  }
+
+  bool WriteIndex::writes_memory(uint64_t frame_number, uint64_t address, uint64_t len) {
+    reader.seek(frame_number);
+    uint64_t frame_len;
+    const uint8_t *data = reader.next_raw(frame_len);
+    scanned_frame s;
+    if (!data || !scan_frame(data, frame_len, frame_field_operands, s)) {
+      throw (TraceException("Unable to scan frame"));
+    }
+    if (s.kind != frame_kind_std) {
+      return false;
+    }
+
+    const uint8_t *lists[] = { s.operand_pre_list, s.operand_post_list };
+    const uint64_t lens[] = { s.operand_pre_list_len, s.operand_post_list_len };
+    operand_value_list operands;
+    for (int l = 0; l < 2; l++) {
+      if (!lists[l]) {
+        continue;
+      }
+      if (!operands.ParseFromArray(lists[l], lens[l])) {
+        throw (TraceException("Unable to parse operands"));
+      }
+      for (int i = 0; i < operands.elem_size(); i++) {
+        uint64_t low, high;
+        if (written_memory(operands.elem(i), low, high)
+            && low <= address + (len - 1) && high >= address) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void WriteIndex::build(TraceContainerReader &reader, const std::string &filename,
+                         uint64_t granule, unsigned num_threads) {
+    if (granule == 0) {
+      throw (TraceException("The write index needs a positive granule size"));
+    }
+    if (num_threads == 0) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<worker_postings> postings(num_threads);
+    parallel_for_each_segment(reader, num_threads,
+      [&](unsigned worker, TraceContainerReader &r, uint64_t first, uint64_t last) {
+        worker_postings &into = postings[worker];
+        operand_value_list operands;
+        for (uint64_t n = first; n < last; n++) {
+          uint64_t len;
+          const uint8_t *data = r.next_raw(len);
+          scanned_frame s;
+          if (!data || !scan_frame(data, len, frame_field_thread_id | frame_field_operands, s)) {
+            throw (TraceException("Unable to scan frame"));
+          }
+          if (s.kind == frame_kind_std) {
+            post_operands(s.operand_pre_list, s.operand_pre_list_len, s.thread_id,
+                          n, granule, operands, into);
+            post_operands(s.operand_post_list, s.operand_post_list_len, s.thread_id,
+                          n, granule, operands, into);
+          }
+        }
+      });
+
+    /* Every frame was read by one worker, so merged lists only need
+       sorting. */
+    std::map<std::pair<uint64_t, std::string>, std::vector<uint64_t> > registers;
+    std::map<uint64_t, std::vector<uint64_t> > memory;
+    for (std::vector<worker_postings>::iterator w = postings.begin(); w != postings.end(); ++w) {
+      for (std::unordered_map<uint64_t, register_postings>::iterator t = w->registers.begin();
+           t != w->registers.end(); ++t) {
+        for (register_postings::iterator r = t->second.begin(); r != t->second.end(); ++r) {
+          merge(registers, std::make_pair(t->first, r->first), r->second);
+        }
+      }
+      for (std::unordered_map<uint64_t, std::vector<uint64_t> >::iterator g = w->memory.begin();
+           g != w->memory.end(); ++g) {
+        merge(memory, g->first, g->second);
+      }
+      *w = worker_postings();
+    }
+
+    std::string tmp = filename + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+      throw (TraceException("Unable to open write index " + tmp + " for writing"));
+    }
+
+    try {
+      /* The header is written last. */
+      uint64_t end = writes_header_size;
+      if (!seek_file(out, end)) {
+        throw (TraceException("Unable to seek in write index"));
+      }
+
+      std::vector<writes_register> register_directory;
+      std::string names;
+      for (std::map<std::pair<uint64_t, std::string>, std::vector<uint64_t> >::iterator r =
+             registers.begin(); r != registers.end(); ++r) {
+        std::sort(r->second.begin(), r->second.end());
+        writes_register d = { r->first.first, names.size(), r->first.second.size(), { 0, 0, 0 } };
+        names += r->first.second;
+        write_postings_list(out, end, r->second, d.postings);
+        register_directory.push_back(d);
+      }
+
+      std::vector<writes_granule> memory_directory;
+      for (std::map<uint64_t, std::vector<uint64_t> >::iterator g = memory.begin();
+           g != memory.end(); ++g) {
+        std::sort(g->second.begin(), g->second.end());
+        writes_granule d = { g->first, { 0, 0, 0 } };
+        write_postings_list(out, end, g->second, d.postings);
+        memory_directory.push_back(d);
+      }
+
+      IndexedTrace trace = reader.indexed_trace();
+      uint64_t register_offset = end;
+      uint64_t memory_offset = register_offset + register_directory.size() * sizeof(writes_register);
+      uint64_t names_offset = memory_offset + memory_directory.size() * sizeof(writes_granule);
+      uint64_t header[writes_header_size / sizeof(uint64_t)] = {
+        writes_magic_number,
+        writes_version_number,
+        trace.trace_version,
+        trace.num_frames,
+        trace.toc_offset,
+        trace.trace_size,
+        granule,
+        register_directory.size(),
+        register_offset,
+        memory_directory.size(),
+        memory_offset,
+        names_offset,
+        names.size()
+      };
+      if (fwrite(register_directory.data(), sizeof(writes_register), register_directory.size(), out)
+          != register_directory.size() ||
+          fwrite(memory_directory.data(), sizeof(writes_granule), memory_directory.size(), out)
+          != memory_directory.size() ||
+          fwrite(names.data(), 1, names.size(), out) != names.size() ||
+          !seek_file(out, 0) ||
+          fwrite(header, sizeof(header), 1, out) != 1) {
+        throw (TraceException("Unable to write write index " + tmp));
+      }
+    } catch (...) {
+      fclose(out);
+      remove(tmp.c_str());
+      throw;
+    }
+
+    if (fclose(out) != 0 || rename(tmp.c_str(), filename.c_str()) != 0) {
+      remove(tmp.c_str());
+      throw (TraceException("Unable to write write index " + filename));
+    }
+  }
+
+  std::string WriteIndex::filename_for(const std::string &trace_filename) {
+    return trace_filename + ".writes";
+  }
+};
@@ -0,0 +1,177 @@
+#ifndef TRACE_WRITES_HPP
+#define TRACE_WRITES_HPP
+
+/**
+ * A last writer index: for every register and every granule of
+ * memory, the sorted numbers of the frames that write it, so that
+ * "which frame last wrote R, or A, before frame N" is a binary search
+ * instead of a scan backwards through the trace.
+ *
+ * A frame writes the operands of its operand pre and post lists whose
+ * [operand_usage] is [written]. Registers are told apart by thread
+ * and name, memory by granule, the address divided by the granule
+ * size g. A frame that writes any byte of a granule is posted to it,
+ * so [WriteIndex::last_memory_write] reads back candidate frames to
+ * check that they write the bytes asked for.
+ *
+ * [WriteIndex::build] reads the segments of the trace, the frames
+ * between two toc entries, concurrently and merges their postings.
+ *
+ * A posting list of c frame numbers is stored as the first frame of
+ * every block of [writes_block_size] postings, followed by the
+ * differences between consecutive postings as unsigned LEB128
+ * varints:
+ *
+ * [<ceil(c / writes_block_size) [writes_skip]s>
+ *  <varint differences>]
+ *
+ * The index is stored next to the trace, in [WriteIndex::filename_for]
+ * the trace. Its format, all numbers in the byte order of the trace:
+ *
+ * [<uint64_t writes magic number>
+ *  <uint64_t writes version number>
+ *  <uint64_t trace version number>
+ *  <uint64_t n = number of trace frames>
+ *  <uint64_t offset of the trace toc>
+ *  <uint64_t size of the trace file>
+ *  <uint64_t g = granule size>
+ *  <uint64_t r = number of registers>
+ *  <uint64_t offset of the register directory>
+ *  <uint64_t m = number of granules>
+ *  <uint64_t offset of the memory directory>
+ *  <uint64_t offset of the register names>
+ *  <uint64_t size of the register names>
+ *  <posting lists>
+ *  <r [writes_register]s, sorted by thread and name>
+ *  <m [writes_granule]s, sorted by granule>
+ *  <register names>]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  const uint64_t writes_magic_number = 0x736574697277722dLL;
+  const uint64_t writes_version_number = 1LL;
+  const uint64_t writes_header_size = 104LL;
+
+  const uint64_t writes_block_size = 128LL;
+
+  const uint64_t default_writes_granule = 64LL;
+
+  /** The first frame of a block of postings. */
+  struct writes_skip {
+    uint64_t frame;
+    /** Offset of the differences that follow [frame], from the end
+        of the skips of the list. */
+    uint64_t offset;
+  };
+
+  /** Where a posting list is. */
+  struct writes_postings {
+    /** Number of postings. */
+    uint64_t count;
+    /** Offset of the list in the file. */
+    uint64_t offset;
+    /** Size of the list in bytes. */
+    uint64_t size;
+  };
+
+  struct writes_register {
+    uint64_t thread_id;
+    /** Offset and length of the name in the register names. */
+    uint64_t name_offset;
+    uint64_t name_len;
+    writes_postings postings;
+  };
+
+  struct writes_granule {
+    uint64_t granule;
+    writes_postings postings;
+  };
+
+  class WriteIndex {
+
+  public:
+
+    /** Opens the index of the trace read by [reader] from [filename].
+        [reader] reads back candidate frames for
+        [last_memory_write]. Throws [TraceException] if the file can
+        not be read or was not built for the trace. */
+    WriteIndex(TraceContainerReader &reader, const std::string &filename);
+
+    ~WriteIndex(void) noexcept;
+
+    /** Find the last frame before frame [before] that writes register
+        [name] of thread [thread_id], or of no thread if it is
+        [no_thread_id], and store its number in [frame_number].
+        Returns false if there is none. */
+    bool last_register_write(uint64_t thread_id, const std::string &name,
+                             uint64_t before, uint64_t &frame_number);
+
+    /** Find the last frame before frame [before] that writes register
+        [name] of any thread, or of no thread, and store its number in
+        [frame_number]. Returns false if there is none. */
+    bool last_register_write(const std::string &name, uint64_t before,
+                             uint64_t &frame_number);
+
+    /** Find the last frame before frame [before] that writes any of
+        the [len] bytes at [address], and store its number in
+        [frame_number]. Moves the frame pointer of the reader. Returns
+        false if there is none. */
+    bool last_memory_write(uint64_t address, uint64_t len,
+                           uint64_t before, uint64_t &frame_number);
+
+    /** Returns the granule size. */
+    uint64_t get_granule(void) const noexcept { return granule; }
+
+    /** Returns the number of registers written in the trace. */
+    uint64_t get_num_registers(void) const noexcept { return registers.size(); }
+
+    /** Returns the number of granules written in the trace. */
+    uint64_t get_num_granules(void) const noexcept { return granules.size(); }
+
+    /** Read the trace of [reader] with [num_threads] threads, or one
+        per core if it is 0, and write its index, with granules of
+        [granule] bytes, to [filename]. The file is written to a
+        temporary file first, so readers never see a partial one. The
+        frame pointer of the reader is not moved. */
+    static void build(TraceContainerReader &reader, const std::string &filename,
+                      uint64_t granule = default_writes_granule,
+                      unsigned num_threads = 0);
+
+    /** Returns the name of the index that belongs to
+        [trace_filename]. */
+    static std::string filename_for(const std::string &trace_filename);
+
+  private:
+
+    TraceContainerReader &reader;
+    IndexedTrace trace;
+    uint64_t granule;
+
+    /** The posting lists, read on demand. */
+    FILE *f;
+
+    std::vector<writes_register> registers;
+    std::vector<writes_granule> granules;
+    std::string names;
+
+    /** Find the last posting of [postings] before [before]. */
+    bool last_before(const writes_postings &postings, uint64_t before,
+                     uint64_t &frame_number);
+
+    /** Returns whether frame [frame_number] writes any of the [len]
+        bytes at [address]. */
+    bool writes_memory(uint64_t frame_number, uint64_t address, uint64_t len);
+
+    WriteIndex(const WriteIndex &) = delete;
+    WriteIndex &operator=(const WriteIndex &) = delete;
+  };
+};
+
+#endif
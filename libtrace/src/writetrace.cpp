@@ -0,0 +1,93 @@
+/**
+ * Build the last writer index of a trace, or find the last frame that
+ * wrote a register or memory before a frame with it.
+ */
+
+#include <iostream>
+#include <limits>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include "trace.writes.hpp"
+
+using namespace SerializedTrace;
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " --build [<granule> [<threads>]] <trace>" << std::endl
+            << "       " << name << " <trace> <frame number> reg <register> [<thread>]" << std::endl
+            << "       " << name << " <trace> <frame number> mem <address> [<length>]" << std::endl
+            << "  The first form writes the write index of the trace, the others print" << std::endl
+            << "  the last frame before the frame that wrote the register or memory." << std::endl
+            << "  Registers are looked up in every thread unless a thread is given." << std::endl;
+  exit(1);
+}
+
+uint64_t number(const char *s, const char *name) {
+  char *end;
+  /* strtoull accepts, and negates, a leading minus sign. */
+  if (*s == '-') {
+    usage(name);
+  }
+  uint64_t n = strtoull(s, &end, 0);
+  if (end == s || *end != '\0') {
+    usage(name);
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0] ? argv[0] : "writetrace";
+  if (argc >= 3 && strcmp(argv[1], "--build") == 0) {
+    if (argc > 5) {
+      usage(name);
+    }
+    uint64_t granule = argc >= 4 ? number(argv[2], name) : default_writes_granule;
+    uint64_t num_threads = argc == 5 ? number(argv[3], name) : 0;
+    if (granule == 0 || num_threads > std::numeric_limits<unsigned>::max()) {
+      usage(name);
+    }
+    TraceContainerReader r(argv[argc - 1]);
+    WriteIndex::build(r, WriteIndex::filename_for(argv[argc - 1]), granule, num_threads);
+    WriteIndex w(r, WriteIndex::filename_for(argv[argc - 1]));
+    std::cout << w.get_num_registers() << " registers and "
+              << w.get_num_granules() << " granules of " << granule << " bytes written" << std::endl;
+    return 0;
+  }
+  if (argc != 5 && argc != 6) {
+    usage(name);
+  }
+  uint64_t frame_number = number(argv[2], name);
+  bool reg = strcmp(argv[3], "reg") == 0;
+  if (!reg && strcmp(argv[3], "mem") != 0) {
+    usage(name);
+  }
+  uint64_t address = 0, len = 1, thread = 0;
+  if (reg) {
+    thread = argc == 6 ? number(argv[5], name) : 0;
+  } else {
+    address = number(argv[4], name);
+    len = argc == 6 ? number(argv[5], name) : 1;
+    if (len == 0 || address + (len - 1) < address) {
+      usage(name);
+    }
+  }
+
+  TraceContainerReader r(argv[1]);
+  WriteIndex w(r, WriteIndex::filename_for(argv[1]));
+  uint64_t last;
+  bool found;
+  if (!reg) {
+    found = w.last_memory_write(address, len, frame_number, last);
+  } else if (argc == 6) {
+    found = w.last_register_write(thread, argv[4], frame_number, last);
+  } else {
+    found = w.last_register_write(argv[4], frame_number, last);
+  }
+
+  if (found) {
+    std::cout << last << std::endl;
+  } else {
+    std::cout << "never written" << std::endl;
+  }
+  return found ? 0 : 2;
+}
@@ -0,0 +1,132 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+/**
+ * Helpers shared by the tests of libtrace. Each test is a program
+ * that returns 0 if all of its checks pass, and prints the checks
+ * that fail.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include "trace.container.hpp"
+
+namespace SerializedTrace {
+
+  /** Number of checks that failed so far. */
+  static int test_failures = 0;
+
+  /** Count and report a failed check unless [ok]. */
+  inline bool check(bool ok, const char *what, const char *file, int line) {
+    if (!ok) {
+      test_failures++;
+      std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+    }
+    return ok;
+  }
+
+#define CHECK(e) SerializedTrace::check((e), #e, __FILE__, __LINE__)
+
+  /** Run [test], reporting an exception as a failure. */
+  template <typename F>
+  void run_test(const char *name, F test) {
+    try {
+      test();
+    } catch (std::exception &e) {
+      test_failures++;
+      std::cerr << name << ": " << e.what() << std::endl;
+    }
+  }
+
+  /** Return the exit status of a test program. */
+  inline int test_status(void) {
+    return test_failures == 0 ? 0 : 1;
+  }
+
+  /** A meta frame with all its required fields. */
+  inline meta_frame test_meta(void) {
+    meta_frame meta;
+    meta.mutable_tracer()->set_name("test");
+    meta.mutable_tracer()->set_version("1");
+    meta.mutable_target()->set_path("test");
+    meta.mutable_target()->set_md5sum("");
+    meta.mutable_fstats()->set_size(0);
+    meta.mutable_fstats()->set_atime(0);
+    meta.mutable_fstats()->set_mtime(0);
+    meta.mutable_fstats()->set_ctime(0);
+    meta.set_user("");
+    meta.set_host("");
+    meta.set_time(0);
+    return meta;
+  }
+
+  inline void add_test_operand(operand_value_list *l, const char *reg, uint64_t address,
+                               bool written, uint64_t value) {
+    operand_info *o = l->add_elem();
+    if (reg) {
+      o->mutable_operand_info_specific()->mutable_reg_operand()->set_name(reg);
+    } else {
+      o->mutable_operand_info_specific()->mutable_mem_operand()->set_address(address);
+    }
+    o->set_bit_length(32);
+    operand_usage *u = o->mutable_operand_usage();
+    u->set_read(!written);
+    u->set_written(written);
+    u->set_index(false);
+    u->set_base(false);
+    o->mutable_taint_info()->set_no_taint(true);
+    uint32_t v = value;
+    o->set_value(&v, sizeof(v));
+  }
+
+  /** Frame [i] of the test traces: standard frames of four threads
+      over a loop of 50 instructions, that read registers and memory
+      and sometimes store, with now and then a system call or an
+      exception. */
+  inline frame test_frame(uint64_t i) {
+    frame f;
+    uint64_t thread = (i / 7) % 4;
+    uint64_t pc = 0x8048000 + (i % 50) * 4;
+    if (i % 23 == 22) {
+      syscall_frame *s = f.mutable_syscall_frame();
+      s->set_address(pc);
+      s->set_thread_id(thread);
+      s->set_number(i % 3);
+      s->mutable_argument_list()->add_elem(i);
+      s->mutable_argument_list()->add_elem(-1);
+    } else if (i % 37 == 36) {
+      exception_frame *e = f.mutable_exception_frame();
+      e->set_exception_number(13);
+      if (i % 2 == 0) {
+        e->set_thread_id(thread);
+        e->set_from_addr(pc);
+        e->set_to_addr(pc + 0x100);
+      }
+    } else {
+      std_frame *s = f.mutable_std_frame();
+      s->set_address(pc);
+      s->set_thread_id(thread);
+      uint32_t bytes = pc;
+      s->set_rawbytes(&bytes, 1 + i % 4);
+      add_test_operand(s->mutable_operand_pre_list(), "EAX", 0, false, i);
+      add_test_operand(s->mutable_operand_pre_list(), NULL, 0x10000 + (i % 64) * 4, false, i * 3);
+      if (i % 3 == 0) {
+        operand_value_list *post = s->mutable_operand_post_list();
+        add_test_operand(post, NULL, 0x20000 + (i % 16) * 4, true, i * 5);
+        add_test_operand(post, "EBX", 0, true, i * 7);
+      }
+      if (i % 5 == 0) {
+        s->set_mode("x86");
+      }
+    }
+    return f;
+  }
+
+  /** Return true if [a] and [b] are the same frame. */
+  inline bool same_frame(const frame &a, const frame &b) {
+    return a.SerializeAsString() == b.SerializeAsString();
+  }
+};
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * Frames pushed into an [AsyncTraceWriter] reach the trace in the
+ * order they were pushed, whatever the number of workers.
+ */
+
+#include <stdio.h>
+#include "test.hpp"
+#include "trace.async.hpp"
+
+using namespace SerializedTrace;
+
+const uint64_t test_num_frames = 5000;
+
+/** Check that [filename] holds the first [num_frames] test frames. */
+void check_trace(const std::string &filename, uint64_t num_frames) {
+  TraceContainerReader r(filename);
+  CHECK(r.get_num_frames() == num_frames);
+  frame f;
+  uint64_t i = 0;
+  while (r.next(f)) {
+    if (!CHECK(same_frame(f, test_frame(i)))) {
+      break;
+    }
+    i++;
+  }
+  CHECK(i == num_frames);
+}
+
+/** Push the test frames through a small queue, by copy, by move and
+    already serialized in turn. */
+void push_frames(AsyncTraceWriter &w, uint64_t num_frames) {
+  for (uint64_t i = 0; i < num_frames; i++) {
+    switch (i % 3) {
+    case 0:
+      CHECK(w.add(test_frame(i)));
+      break;
+    case 1: {
+      frame f = test_frame(i);
+      CHECK(w.add(std::move(f)));
+      break;
+    }
+    default:
+      CHECK(w.add_serialized(test_frame(i).SerializeAsString()));
+      break;
+    }
+  }
+}
+
+void test_order(unsigned num_workers) {
+  std::string filename = "test_async." + std::to_string(num_workers) + ".frames";
+  {
+    TraceContainerWriter tw(filename, test_meta(), default_arch, default_machine, 64);
+    AsyncTraceWriter w(tw, 16, backpressure_block, num_workers);
+    push_frames(w, test_num_frames);
+    w.finish();
+    CHECK(w.get_dropped() == 0);
+  }
+  check_trace(filename, test_num_frames);
+  remove(filename.c_str());
+}
+
+/** Destroying the writer without [finish] still writes the queued
+    frames, and the trace can then be finished directly. */
+void test_destructor(unsigned num_workers) {
+  std::string filename = "test_async.drop." + std::to_string(num_workers) + ".frames";
+  {
+    TraceContainerWriter tw(filename, test_meta(), default_arch, default_machine, 64);
+    {
+      AsyncTraceWriter w(tw, 16, backpressure_block, num_workers);
+      push_frames(w, 100);
+    }
+    tw.finish();
+  }
+  check_trace(filename, 100);
+  remove(filename.c_str());
+}
+
+int main(void) {
+  const unsigned workers[] = { 1, 2, 4 };
+  for (unsigned n : workers) {
+    run_test("order", [=] { test_order(n); });
+    run_test("destructor", [=] { test_destructor(n); });
+  }
+  return test_status();
+}
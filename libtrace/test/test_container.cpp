@@ -0,0 +1,224 @@
+/**
+ * Round trips of every trace format through the writer and both
+ * readers, and the checks the readers make on the table of
+ * contents.
+ */
+
+#include <stdio.h>
+#include <vector>
+#include "test.hpp"
+#include "trace.codec.hpp"
+
+using namespace SerializedTrace;
+
+const uint64_t test_num_frames = 1000;
+const uint64_t test_frames_per_toc_entry = 64;
+
+struct trace_format {
+  const char *name;
+  uint64_t version;
+  block_codec codec;
+};
+
+const trace_format formats[] = {
+  { "v3", 3, block_codec_none },
+  { "v4", 4, block_codec_none },
+  { "v4-zstd", 4, block_codec_zstd },
+  { "v4-lz4", 4, block_codec_lz4 },
+  { "v5", 5, block_codec_none },
+  { "v5-zstd", 5, block_codec_zstd },
+};
+
+void write_test_trace(const std::string &filename, uint64_t num_frames,
+                      uint64_t frames_per_toc_entry,
+                      uint64_t version = default_trace_version,
+                      block_codec codec = block_codec_none) {
+  TraceContainerWriter w(filename, test_meta(), default_arch, default_machine,
+                         frames_per_toc_entry, default_write_buffer_size,
+                         version, codec);
+  for (uint64_t i = 0; i < num_frames; i++) {
+    w.add(test_frame(i));
+  }
+  w.finish();
+}
+
+/** Check that [r] reads back the test frames, sequentially and
+    after seeks in both directions. */
+void check_reader(TraceContainerReader &r, const char *name) {
+  std::cerr << name << std::endl;
+  CHECK(r.get_num_frames() == test_num_frames);
+  CHECK(r.get_frames_per_toc_entry() == test_frames_per_toc_entry);
+
+  uint64_t i = 0;
+  while (!r.end_of_trace()) {
+    std::unique_ptr<frame> f = r.get_frame();
+    if (!CHECK(same_frame(*f, test_frame(i)))) {
+      break;
+    }
+    i++;
+  }
+  CHECK(i == test_num_frames);
+
+  const uint64_t m = test_frames_per_toc_entry;
+  const uint64_t seeks[] = {
+    0, 1, m - 1, m, m + 1, 5 * m + 3, 2 * m, 2 * m + 7, 2 * m + 5,
+    test_num_frames - 1, 0, 3 * m - 1, 3 * m, test_num_frames / 2
+  };
+  for (uint64_t s : seeks) {
+    r.seek(s);
+    std::unique_ptr<frame> f = r.get_frame();
+    CHECK(same_frame(*f, test_frame(s)));
+    if (s + 1 < test_num_frames) {
+      f = r.get_frame();
+      CHECK(same_frame(*f, test_frame(s + 1)));
+    }
+  }
+  r.seek(test_num_frames - 1);
+  r.get_frame();
+  CHECK(r.end_of_trace());
+
+  r.seek(m - 2);
+  std::unique_ptr<std::vector<frame> > batch = r.get_frames(5);
+  CHECK(batch->size() == 5);
+  for (uint64_t j = 0; j < batch->size(); j++) {
+    CHECK(same_frame((*batch)[j], test_frame(m - 2 + j)));
+  }
+}
+
+void test_round_trip(const trace_format &format) {
+  if (!codec_supported(format.codec)) {
+    return;
+  }
+  std::string filename = std::string("test_container.") + format.name + ".frames";
+  write_test_trace(filename, test_num_frames, test_frames_per_toc_entry,
+                   format.version, format.codec);
+  {
+    TraceContainerReader r(filename);
+    CHECK(r.get_trace_version() == format.version);
+    check_reader(r, (std::string(format.name) + " stdio").c_str());
+  }
+  {
+    MappedTraceReader r(filename);
+    check_reader(r, (std::string(format.name) + " mapped").c_str());
+  }
+  {
+    TraceContainerReader r(filename);
+    bool indexed = r.use_frame_index(false);
+    CHECK(indexed == (format.version < blocked_trace_version));
+    if (indexed) {
+      check_reader(r, (std::string(format.name) + " indexed").c_str());
+    }
+  }
+  remove(filename.c_str());
+}
+
+uint64_t file_size(const std::string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  fseek(f, 0, SEEK_END);
+  uint64_t size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+uint64_t read_toc_offset(const std::string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  uint64_t toc_offset = 0;
+  fseek(f, toc_offset_offset, SEEK_SET);
+  if (fread(&toc_offset, sizeof(toc_offset), 1, f) != 1) {
+    toc_offset = 0;
+  }
+  fclose(f);
+  return toc_offset;
+}
+
+/** Without an entry for the first frames, a trace of [n] frames has
+    (n - 1) / m toc entries, and the readers reject a trace with
+    ceil(n / m) of them, as written by older versions of the writer,
+    when m divides n. */
+void test_toc_entries(uint64_t num_frames) {
+  const uint64_t m = 4;
+  std::string filename = "test_container.toc.frames";
+  write_test_trace(filename, num_frames, m);
+
+  uint64_t toc_offset = read_toc_offset(filename);
+  CHECK(file_size(filename) == toc_offset + 8 + (num_frames - 1) / m * 8);
+  {
+    TraceContainerReader r(filename);
+    r.seek(num_frames - 1);
+    std::unique_ptr<frame> f = r.get_frame();
+    CHECK(same_frame(*f, test_frame(num_frames - 1)));
+  }
+
+  FILE *f = fopen(filename.c_str(), "ab");
+  uint64_t extra = 0;
+  CHECK(fwrite(&extra, sizeof(extra), 1, f) == 1);
+  fclose(f);
+  bool rejected = false;
+  try {
+    TraceContainerReader r(filename);
+  } catch (TraceException &e) {
+    rejected = true;
+  }
+  CHECK(rejected);
+  rejected = false;
+  try {
+    MappedTraceReader r(filename);
+  } catch (TraceException &e) {
+    rejected = true;
+  }
+  CHECK(rejected);
+  remove(filename.c_str());
+}
+
+/** A seek after a frame failed to parse must not skip ahead from
+    the middle of that frame. */
+void test_seek_after_error(TraceContainerReader &r) {
+  for (uint64_t i = 0; i < 5; i++) {
+    r.get_frame();
+  }
+  bool failed = false;
+  try {
+    r.get_frame();
+  } catch (TraceException &e) {
+    failed = true;
+  }
+  CHECK(failed);
+  r.seek(7);
+  std::unique_ptr<frame> f = r.get_frame();
+  CHECK(same_frame(*f, test_frame(7)));
+}
+
+void test_bad_frame(void) {
+  std::string filename = "test_container.bad.frames";
+  {
+    TraceContainerWriter w(filename, test_meta(), default_arch, default_machine, 1000);
+    const uint8_t garbage[] = { 0xff, 0xff, 0xff, 0xff };
+    for (uint64_t i = 0; i < 10; i++) {
+      if (i == 5) {
+        w.add_raw(garbage, sizeof(garbage));
+      } else {
+        w.add(test_frame(i));
+      }
+    }
+    w.finish();
+  }
+  {
+    TraceContainerReader r(filename);
+    test_seek_after_error(r);
+  }
+  {
+    MappedTraceReader r(filename);
+    test_seek_after_error(r);
+  }
+  remove(filename.c_str());
+}
+
+int main(void) {
+  for (const trace_format &format : formats) {
+    run_test(format.name, [&] { test_round_trip(format); });
+  }
+  run_test("toc entries", [] { test_toc_entries(10); });
+  run_test("toc entries", [] { test_toc_entries(8); });
+  run_test("bad frame", test_bad_frame);
+  return test_status();
+}
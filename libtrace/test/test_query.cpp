@@ -0,0 +1,178 @@
+/**
+ * Queries return the same frames as a linear scan of the trace, with
+ * and without frame columns and block summaries.
+ */
+
+#include <stdio.h>
+#include <vector>
+#include "test.hpp"
+#include "trace.columns.hpp"
+#include "trace.query.hpp"
+
+using namespace SerializedTrace;
+
+const uint64_t test_num_frames = 3000;
+const uint64_t test_frames_per_toc_entry = 100;
+
+/** Return true if [f] meets [query], computed from the fields of the
+    frame rather than with the helpers of the query engine. */
+bool scan_matches(const trace_query &query, uint64_t number, const frame &f) {
+  if (number < query.first_frame || number >= query.last_frame) {
+    return false;
+  }
+  bool has_pc = false, has_thread = false;
+  uint64_t pc = 0, thread_id = 0;
+  if (f.has_std_frame()) {
+    has_pc = has_thread = true;
+    pc = f.std_frame().address();
+    thread_id = f.std_frame().thread_id();
+  } else if (f.has_syscall_frame()) {
+    has_pc = has_thread = true;
+    pc = f.syscall_frame().address();
+    thread_id = f.syscall_frame().thread_id();
+  } else if (f.has_exception_frame()) {
+    has_pc = f.exception_frame().has_from_addr();
+    pc = f.exception_frame().from_addr();
+    has_thread = f.exception_frame().has_thread_id();
+    thread_id = f.exception_frame().thread_id();
+  }
+  if (query.match_pc && (!has_pc || pc < query.pc_low || pc >= query.pc_high)) {
+    return false;
+  }
+  if (query.match_thread && (!has_thread || thread_id != query.thread_id)) {
+    return false;
+  }
+  if (query.match_store) {
+    if (!f.has_std_frame()) {
+      return false;
+    }
+    bool stores = false;
+    const operand_value_list *lists[] = {
+      &f.std_frame().operand_pre_list(), &f.std_frame().operand_post_list()
+    };
+    for (const operand_value_list *l : lists) {
+      for (const operand_info &o : l->elem()) {
+        if (o.operand_usage().written() && o.operand_info_specific().has_mem_operand()) {
+          uint64_t address = o.operand_info_specific().mem_operand().address();
+          uint64_t bytes = o.bit_length() > 8 ? (o.bit_length() + 7) / 8 : 1;
+          stores = stores || (address <= query.store_address && query.store_address < address + bytes);
+        }
+      }
+    }
+    if (!stores) {
+      return false;
+    }
+  }
+  if (query.match_syscall && (!f.has_syscall_frame() || f.syscall_frame().number() != query.syscall_number)) {
+    return false;
+  }
+  return true;
+}
+
+std::vector<trace_query> test_queries(void) {
+  std::vector<trace_query> queries;
+  trace_query q;
+
+  q.first_frame = 250;
+  q.last_frame = 1234;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_pc = true;
+  q.pc_low = 0x8048000 + 40;
+  q.pc_high = 0x8048000 + 80;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_thread = true;
+  q.thread_id = 2;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_store = true;
+  q.store_address = 0x20006;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_syscall = true;
+  q.syscall_number = 1;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_pc = true;
+  q.pc_low = 0x8048000;
+  q.pc_high = 0x8048000 + 100;
+  q.match_thread = true;
+  q.thread_id = 3;
+  q.first_frame = 100;
+  q.last_frame = 700;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_store = true;
+  q.store_address = 0x2003c;
+  q.match_thread = true;
+  q.thread_id = 1;
+  queries.push_back(q);
+
+  q = trace_query();
+  q.match_syscall = true;
+  q.syscall_number = 9;
+  queries.push_back(q);
+
+  return queries;
+}
+
+void check_queries(TraceContainerReader &r, const FrameColumns *columns) {
+  for (const trace_query &q : test_queries()) {
+    std::vector<uint64_t> expected, found;
+    for (uint64_t i = 0; i < test_num_frames; i++) {
+      if (scan_matches(q, i, test_frame(i))) {
+        expected.push_back(i);
+      }
+    }
+    uint64_t n = run_query(r, q, [&](uint64_t number, const frame &f) {
+        CHECK(same_frame(f, test_frame(number)));
+        found.push_back(number);
+        return true;
+      }, columns);
+    CHECK(n == found.size());
+    CHECK(found == expected);
+  }
+}
+
+void test_trace(const char *name, uint64_t version, bool columns, bool summaries) {
+  std::cerr << name << std::endl;
+  std::string filename = std::string("test_query.") + name + ".frames";
+  {
+    TraceContainerWriter w(filename, test_meta(), default_arch, default_machine,
+                           test_frames_per_toc_entry, default_write_buffer_size, version);
+    if (columns) {
+      w.write_columns();
+    }
+    if (summaries) {
+      w.write_block_summaries();
+    }
+    for (uint64_t i = 0; i < test_num_frames; i++) {
+      w.add(test_frame(i));
+    }
+    w.finish();
+  }
+  TraceContainerReader r(filename);
+  if (columns) {
+    FrameColumns c(FrameColumns::filename_for(filename), r.indexed_trace());
+    check_queries(r, &c);
+    remove(FrameColumns::filename_for(filename).c_str());
+  } else {
+    check_queries(r, NULL);
+  }
+  remove(filename.c_str());
+}
+
+int main(void) {
+  run_test("v3", [] { test_trace("v3", 3, false, false); });
+  run_test("v3-columns", [] { test_trace("v3-columns", 3, true, false); });
+  run_test("v4-summaries", [] { test_trace("v4-summaries", 4, false, true); });
+  run_test("v4-columns", [] { test_trace("v4-columns", 4, true, true); });
+  return test_status();
+}
@@ -1,5 +1,5 @@
 (* OASIS_START *)
-(* DO NOT EDIT (digest: 5654b884edf5267e4adea62d7ab38556) *)
+(* DO NOT EDIT (digest: 934a3f001fffd081a16544cd2e0e2046) *)
 module OASISGettext = struct
 (* # 22 "src/oasis/OASISGettext.ml" *)
 
@@ -889,12 +889,18 @@ let package_default =
      MyOCamlbuildBase.lib_ocaml =
        [
           ("bap-frames", ["lib"], []);
+          ("bap-frames-codecs", ["lib/codecs"], []);
           ("bap-plugin-frames", ["plugin"], []);
           ("frames-tests", ["test"], [])
        ];
      lib_c = [];
      flags = [];
-     includes = [("test", ["lib"]); ("plugin", ["lib"])]
+     includes =
+       [
+          ("test", ["lib"]);
+          ("plugin", ["lib"]);
+          ("lib/codecs", ["lib"])
+       ]
   }
   ;;
 
@@ -902,7 +908,7 @@ let conf = {MyOCamlbuildFindlib.no_automatic_syntax = false}
 
 let dispatch_default = MyOCamlbuildBase.dispatch_default conf package_default;;
 
-# 906 "myocamlbuild.ml"
+# 912 "myocamlbuild.ml"
 (* OASIS_STOP *)
 let oasis_env =
   BaseEnvLight.load
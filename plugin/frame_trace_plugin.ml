@@ -6,27 +6,27 @@ include Self()
 let create_frame_reader uri =
   let reader = Frame_reader.create uri in
   let arch = Frame_reader.arch reader in
+  let context =
+    object
+      val mutable tid = None
+      method switch id' =
+        match tid with
+        | Some id when Int64.equal id id' -> false
+        | _ -> tid <- Some id'; true
+    end in
+  let generator = Frame_events.create ?arch ~context:context#switch () in
   object(self)
-    val mutable events : value list = []
-    val context =
-      object
-        val mutable tid = None
-        method switch id' =
-          match tid with
-          | Some id when Int64.equal id id' -> false
-          | _ -> tid <- Some id'; true
-      end
+    val events : value Queue.t = Queue.create ()
 
     method meta = Frame_reader.meta reader
 
     method next =
-      match events with
-      | e :: ev -> events <- ev; Some (Ok e)
-      | [] -> match Frame_reader.next_frame reader with
+      match Queue.dequeue events with
+      | Some e -> Some (Ok e)
+      | None -> match Frame_reader.next_frame reader with
         | None -> None
         | Some frame ->
-          events <-
-            Frame_events.of_frame ?arch ~context:context#switch frame;
+          Frame_events.iter generator frame ~f:(Queue.enqueue events);
           self#next
         | exception exn -> Some (Error (Error.of_exn exn))
   end
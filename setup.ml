@@ -1,5 +1,5 @@
 (* OASIS_START *)
-(* DO NOT EDIT (digest: e03f68c945ea73d32f9b986f114490b9) *)
+(* DO NOT EDIT (digest: 7d526cbcee38177d3760dee3af10a28b) *)
 (*
    Regenerated by OASIS v0.4.12
    Visit https://github.com/ocaml/oasis for more information and
@@ -7110,6 +7110,17 @@ let setup_t =
           files_ab = [];
           sections =
             [
+               Flag
+                 ({
+                     cs_name = "codecs";
+                     cs_data = PropList.Data.create ();
+                     cs_plugin_data = []
+                  },
+                   {
+                      flag_description =
+                        Some "Build the zstd and lz4 block codecs";
+                      flag_default = [(OASISExpr.EBool true, false)]
+                   });
                Library
                  ({
                      cs_name = "bap-frames";
@@ -7129,7 +7140,8 @@ let setup_t =
                            FindlibPackage
                              ("core_kernel.binary_packing", None);
                            FindlibPackage ("piqirun.pb", None);
-                           FindlibPackage ("ppx_jane", None)
+                           FindlibPackage ("ppx_jane", None);
+                           FindlibPackage ("unix", None)
                         ];
                       bs_build_tools =
                         [ExternalTool "ocamlbuild"; ExternalTool "piqi"];
@@ -7270,6 +7282,161 @@ let setup_t =
                       lib_findlib_directory = None;
                       lib_findlib_containers = []
                    });
+               Library
+                 ({
+                     cs_name = "bap-frames-codecs";
+                     cs_data = PropList.Data.create ();
+                     cs_plugin_data = []
+                  },
+                   {
+                      bs_build =
+                        [
+                           (OASISExpr.EBool true, false);
+                           (OASISExpr.EFlag "codecs", true)
+                        ];
+                      bs_install =
+                        [
+                           (OASISExpr.EBool true, false);
+                           (OASISExpr.EFlag "codecs", true)
+                        ];
+                      bs_path = "lib/codecs";
+                      bs_compiled_object = Best;
+                      bs_build_depends =
+                        [
+                           InternalLibrary "bap-frames";
+                           FindlibPackage ("lz4", None);
+                           FindlibPackage ("zstd", None)
+                        ];
+                      bs_build_tools = [ExternalTool "ocamlbuild"];
+                      bs_interface_patterns =
+                        [
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("uncapitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mli"
+                                ];
+                              origin = "${uncapitalize_file module}.mli"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("capitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mli"
+                                ];
+                              origin = "${capitalize_file module}.mli"
+                           }
+                        ];
+                      bs_implementation_patterns =
+                        [
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("uncapitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".ml"
+                                ];
+                              origin = "${uncapitalize_file module}.ml"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("capitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".ml"
+                                ];
+                              origin = "${capitalize_file module}.ml"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("uncapitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mll"
+                                ];
+                              origin = "${uncapitalize_file module}.mll"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("capitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mll"
+                                ];
+                              origin = "${capitalize_file module}.mll"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("uncapitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mly"
+                                ];
+                              origin = "${uncapitalize_file module}.mly"
+                           };
+                           {
+                              OASISSourcePatterns.Templater.atoms =
+                                [
+                                   OASISSourcePatterns.Templater.Text "";
+                                   OASISSourcePatterns.Templater.Expr
+                                     (OASISSourcePatterns.Templater.Call
+                                        ("capitalize_file",
+                                          OASISSourcePatterns.Templater.Ident
+                                            "module"));
+                                   OASISSourcePatterns.Templater.Text ".mly"
+                                ];
+                              origin = "${capitalize_file module}.mly"
+                           }
+                        ];
+                      bs_c_sources = [];
+                      bs_data_files = [];
+                      bs_findlib_extra_files = [];
+                      bs_ccopt = [(OASISExpr.EBool true, [])];
+                      bs_cclib = [(OASISExpr.EBool true, [])];
+                      bs_dlllib = [(OASISExpr.EBool true, [])];
+                      bs_dllpath = [(OASISExpr.EBool true, [])];
+                      bs_byteopt = [(OASISExpr.EBool true, [])];
+                      bs_nativeopt = [(OASISExpr.EBool true, [])]
+                   },
+                   {
+                      lib_modules = ["Frame_codecs"];
+                      lib_pack = false;
+                      lib_internal_modules = [];
+                      lib_findlib_parent = Some "bap-frames";
+                      lib_findlib_name = Some "codecs";
+                      lib_findlib_directory = None;
+                      lib_findlib_containers = []
+                   });
                Library
                  ({
                      cs_name = "bap-plugin-frames";
@@ -7559,7 +7726,12 @@ let setup_t =
                       bs_nativeopt = [(OASISExpr.EBool true, [])]
                    },
                    {
-                      lib_modules = ["Test_enum"];
+                      lib_modules =
+                        [
+                           "Test_enum";
+                           "Test_reader";
+                           "Test_events"
+                        ];
                       lib_pack = false;
                       lib_internal_modules = [];
                       lib_findlib_parent = None;
@@ -7778,7 +7950,7 @@ let setup_t =
      oasis_fn = Some "_oasis";
      oasis_version = "0.4.12";
      oasis_digest =
-       Some "~\026!)\128\156\243\136\183\200\001\170\147>\249\221";
+       Some "\003<|\001w2\183#\017\210\030\207\188\004\025@";
      oasis_exec = None;
      oasis_setup_args = [];
      setup_update = false
@@ -7786,7 +7958,7 @@ let setup_t =
 
 let setup () = BaseSetup.setup setup_t;;
 
-# 7792 "setup.ml"
+# 7964 "setup.ml"
 let setup_t = BaseCompat.Compat_0_4.adapt_setup_t setup_t
 open BaseCompat.Compat_0_4
 (* OASIS_STOP *)
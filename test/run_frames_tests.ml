@@ -4,6 +4,8 @@ open OUnit2
 let suite () =
   "Bap-frames" >::: [
     Test_enum.suite ();
+    Test_reader.suite ();
+    Test_events.suite ();
   ]
 
 let () = run_test_tt_main (suite ())
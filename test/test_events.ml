@@ -0,0 +1,88 @@
+open Core_kernel
+open Bap.Std
+open OUnit2
+
+module Frame = Frame_piqi
+
+let operand ?(read=false) ?(written=false) operand_info_specific
+    bit_length value = {
+  Frame.Operand_info.operand_info_specific; bit_length; value;
+  operand_usage = {Frame.Operand_usage.read; written;
+                   index = false; base = false};
+  taint_info = `no_taint;
+}
+
+let reg name = `reg_operand {Frame.Reg_operand.name}
+let mem address = `mem_operand {Frame.Mem_operand.address}
+
+let std ?mode ?post thread_id address pre = `std_frame {
+    Frame.Std_frame.address; thread_id; mode;
+    rawbytes = "\x89\xd8";
+    operand_pre_list = pre;
+    operand_post_list = post;
+  }
+
+let syscall thread_id address number = `syscall_frame {
+    Frame.Syscall_frame.address; thread_id; number;
+    argument_list = [1L; -2L];
+  }
+
+let exception_frame ?thread_id exception_number = `exception_frame {
+    Frame.Exception_frame.exception_number; thread_id;
+    from_addr = Some 0x8048010L;
+    to_addr = None;
+  }
+
+(** Frames of two threads, that switch on standard, system call and
+    exception frames, replay the same instructions, and read EAX at
+    two widths. *)
+let frames : Frame.frame list = [
+  std 1L 0x8048000L [
+    operand ~read:true (reg "EAX") 32 "\x01\x00\x00\x00";
+    operand ~read:true (mem 0x1000L) 32 "\x02\x00\x00\x00";
+  ];
+  std 1L 0x8048002L [
+    operand ~read:true ~written:true (reg "EAX") 16 "\x03\x00";
+  ] ~post:[operand ~written:true (reg "EAX") 16 "\x04\x00"];
+  syscall 2L 0x8048004L 4L;
+  exception_frame ~thread_id:2L 13L;
+  exception_frame ~thread_id:1L 14L;
+  exception_frame 6L;
+  std 2L 0x8048000L ~mode:"thumb" [
+    operand ~read:true (reg "EAX") 32 "\x05\x00\x00\x00";
+  ] ~post:[operand ~written:true (mem 0x1004L) 32 "\x06\x00\x00\x00"];
+  std 2L 0x8048002L [operand ~read:true (reg "EAX") 16 "\x07\x00"];
+  syscall 1L 0x8048004L 1L;
+]
+
+(** A context that switches whenever the thread changes, like the one
+    of the frame plugin. *)
+let context () =
+  let current = ref None in
+  fun id -> match !current with
+    | Some id' when Int64.equal id id' -> false
+    | _ -> current := Some id; true
+
+let to_string events =
+  List.map events ~f:Value.to_string |> String.concat ~sep:"; "
+
+let same_events xs ys =
+  List.length xs = List.length ys &&
+  List.for_all2_exn xs ys ~f:(fun x y -> Value.compare x y = 0)
+
+let test_iter arch _ctxt =
+  let switch = context () in
+  let expected =
+    List.concat_map frames ~f:(Frame_events.of_frame ~context:switch ?arch) in
+  let t = Frame_events.create ~context:(context ()) ?arch () in
+  let events = ref [] in
+  List.iter frames ~f:(fun frame ->
+      Frame_events.iter t frame ~f:(fun e -> events := e :: !events));
+  assert_equal ~cmp:same_events ~printer:to_string
+    expected (List.rev !events)
+
+let suite () =
+  "Frame_events" >::: [
+    "iter" >:: test_iter None;
+    "iter x86_64" >:: test_iter (Some `x86_64);
+  ]
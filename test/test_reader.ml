@@ -0,0 +1,97 @@
+open Core_kernel
+open OUnit2
+
+(** The traces of test/data, named relative to the top directory,
+    where the tests run. *)
+let trace name = Uri.of_string ("test/data/" ^ name)
+
+let num_frames = 62
+let frames_per_toc_entry = 16
+
+let read_all name =
+  let r = Frame_reader.create (trace name) in
+  let rec loop acc = match Frame_reader.next_frame r with
+    | None -> List.rev acc
+    | Some frame -> loop (frame :: acc) in
+  loop []
+
+(** Frames at the start, the middle and the end of the TOC entries,
+    the last of which is not full, visited forwards within an entry,
+    and backwards. *)
+let positions =
+  let m = frames_per_toc_entry in [
+    0; m / 2; m - 1;
+    m; m + m / 2; 2 * m - 1;
+    3 * m; num_frames - 1;
+    2 * m + m / 2; 2 * m; 3 * m - 1;
+    0;
+  ]
+
+let test_version name version _ctxt =
+  let r = Frame_reader.create (trace name) in
+  assert_equal ~printer:Int.to_string version (Frame_reader.version r)
+
+let test_num_frames name _ctxt =
+  let r = Frame_reader.create (trace name) in
+  assert_equal ~printer:Int.to_string num_frames (Frame_reader.num_frames r);
+  assert_equal ~printer:Int.to_string num_frames (List.length (read_all name))
+
+let test_seek name _ctxt =
+  let frames = Array.of_list (read_all name) in
+  let r = Frame_reader.create (trace name) in
+  List.iter positions ~f:(fun n ->
+      Frame_reader.seek r n;
+      assert_equal ~msg:(sprintf "frame %d" n)
+        (Some frames.(n)) (Frame_reader.next_frame r);
+      if n + 1 < num_frames then
+        assert_equal ~msg:(sprintf "frame %d after a seek" (n + 1))
+          (Some frames.(n + 1)) (Frame_reader.next_frame r))
+
+let test_seek_past_end name _ctxt =
+  let r = Frame_reader.create (trace name) in
+  assert_raises (Invalid_argument "Frame_reader.seek: no frame 62")
+    (fun () -> Frame_reader.seek r num_frames)
+
+(** Every version holds the frames of the version 3 trace. *)
+let test_same_frames name _ctxt =
+  assert_equal ~msg:name (read_all "v3.frames") (read_all name)
+
+(** The tests do not link bap-frames.codecs. *)
+let test_unsupported_codec _ctxt =
+  let r = Frame_reader.create (trace "v4-zstd.frames") in
+  assert_raises (Frame_reader.Parse_error "unsupported codec 1")
+    (fun () -> Frame_reader.next_frame r)
+
+(** The blocks of v4-codec77.frames are stored as is, but under codec
+    77, which nothing registers until [test_registered_codec]. *)
+let fake_codec = 77
+
+let test_unregistered_codec _ctxt =
+  let r = Frame_reader.create (trace "v4-codec77.frames") in
+  assert_raises (Frame_reader.Parse_error "unsupported codec 77")
+    (fun () -> Frame_reader.next_frame r)
+
+let test_registered_codec _ctxt =
+  Frame_reader.register_codec fake_codec (fun ~size data ->
+      assert_equal ~printer:Int.to_string size (String.length data);
+      data);
+  assert_equal (read_all "v3.frames") (read_all "v4-codec77.frames")
+
+let versions = [
+  "v3.frames", 3;
+  "v4.frames", 4;
+  "v5.frames", 5;
+]
+
+let suite () =
+  "Frame_reader" >::: List.concat_map versions ~f:(fun (name, version) -> [
+      name ^ " version" >:: test_version name version;
+      name ^ " num_frames" >:: test_num_frames name;
+      name ^ " seek" >:: test_seek name;
+      name ^ " seek past the end" >:: test_seek_past_end name;
+      name ^ " frames" >:: test_same_frames name;
+    ]) @ [
+    "unsupported codec" >:: test_unsupported_codec;
+    "unregistered codec" >:: test_unregistered_codec;
+    "registered codec" >:: test_registered_codec;
+  ]